@@ -0,0 +1,401 @@
+#include "disk_async.h"
+#include "disk_emu.h"
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+#include<pthread.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/uio.h>
+#include<sys/syscall.h>
+#include<linux/io_uring.h>
+
+/*
+Notes:
+1. Requests are queued with submit_read_blocks/submit_write_blocks(_vector) and all of them are waited for with wait_blocks()
+2. The ring is driven with the raw io_uring_setup/io_uring_enter system calls, there is no liburing dependency
+3. Only the pread backend of disk_emu is used asynchronously (stdio buffers and O_DIRECT alignment do not mix with it),
+   on every other backend, or when the kernel has no io_uring, each request is done synchronously when it is submitted
+4. A request that completes short or with an error is redone synchronously, so callers only see whole transfers. So is a
+   request the kernel does not take from the submission ring, it is taken back out of the ring first
+5. Several threads may submit at once: wait_blocks() only waits for the calling thread's own requests, and whichever thread
+   is waiting reaps the completions of everyone (one thread at a time sleeps in io_uring_enter, the others on a condition)
+*/
+
+struct async_request{
+    int in_use;
+    int *batch_blocks; //Batch and in-flight counter of the thread that submitted the request
+    int *in_flight;
+    int writing;
+    int start_address;
+    int nblocks;
+    struct iovec *vectors; //One iovec per block, must stay valid until the request completes
+};
+
+//Ring shared with the kernel
+int ring_fd = -1;
+unsigned int ring_depth = 0;
+void *sq_ring = NULL;
+void *cq_ring = NULL;
+size_t sq_ring_length = 0;
+size_t cq_ring_length = 0;
+struct io_uring_sqe *sq_entries = NULL;
+size_t sq_entries_length = 0;
+
+//Pointers into the mapped rings
+unsigned int *sq_head;
+unsigned int *sq_tail;
+unsigned int *sq_mask;
+unsigned int *sq_array;
+unsigned int *cq_head;
+unsigned int *cq_tail;
+unsigned int *cq_mask;
+struct io_uring_cqe *cq_entries;
+
+//One slot per request the ring can hold, user_data of an entry is its slot number
+struct async_request *requests = NULL;
+int requests_in_flight = 0;
+int requests_queued = 0; //Entries written to the ring but not handed to the kernel yet
+
+//Blocks transferred (or -1 after a failure) by this thread since its last wait_blocks(), and its requests still in flight
+__thread int batch_blocks = 0;
+__thread int thread_in_flight = 0;
+
+//Ring state is only touched with ring_lock held, ring_progress is signalled whenever completions were reaped
+pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ring_progress = PTHREAD_COND_INITIALIZER;
+int ring_polling = 0; //1 while a thread sleeps in io_uring_enter for completions
+
+int block_size_of_disk = 0;
+
+//============================================RING SETUP====================================================
+
+int async_disk_open(int queue_depth, int block_size){
+    struct io_uring_params params;
+
+    async_disk_close();
+    block_size_of_disk = block_size;
+    batch_blocks = 0;
+
+    //Case where the disk is not on a backend that can be driven asynchronously
+    int disk_fd = disk_descriptor();
+    if (disk_fd < 0 || queue_depth < 1){
+        return -1;
+    }
+
+    memset(&params, 0, sizeof(params));
+    ring_fd = (int)syscall(__NR_io_uring_setup, queue_depth, &params);
+    if (ring_fd < 0){
+        ring_fd = -1;
+        return -1;
+    }
+    ring_depth = params.sq_entries;
+
+    //Mapping the submission and completion rings (a single mapping when the kernel allows it)
+    sq_ring_length = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cq_ring_length = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP){
+        if (cq_ring_length > sq_ring_length){
+            sq_ring_length = cq_ring_length;
+        }
+        cq_ring_length = sq_ring_length;
+    }
+
+    sq_ring = mmap(NULL, sq_ring_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED){
+        sq_ring = NULL;
+        async_disk_close();
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP){
+        cq_ring = sq_ring;
+    }
+    else{
+        cq_ring = mmap(NULL, cq_ring_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED){
+            cq_ring = NULL;
+            async_disk_close();
+            return -1;
+        }
+    }
+
+    sq_entries_length = params.sq_entries * sizeof(struct io_uring_sqe);
+    sq_entries = (struct io_uring_sqe*)mmap(NULL, sq_entries_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sq_entries == MAP_FAILED){
+        sq_entries = NULL;
+        async_disk_close();
+        return -1;
+    }
+
+    sq_head = (unsigned int*)((char*)sq_ring + params.sq_off.head);
+    sq_tail = (unsigned int*)((char*)sq_ring + params.sq_off.tail);
+    sq_mask = (unsigned int*)((char*)sq_ring + params.sq_off.ring_mask);
+    sq_array = (unsigned int*)((char*)sq_ring + params.sq_off.array);
+    cq_head = (unsigned int*)((char*)cq_ring + params.cq_off.head);
+    cq_tail = (unsigned int*)((char*)cq_ring + params.cq_off.tail);
+    cq_mask = (unsigned int*)((char*)cq_ring + params.cq_off.ring_mask);
+    cq_entries = (struct io_uring_cqe*)((char*)cq_ring + params.cq_off.cqes);
+
+    requests = (struct async_request*)calloc(ring_depth, sizeof(struct async_request));
+    requests_in_flight = 0;
+    requests_queued = 0;
+    return 0;
+}
+
+void async_disk_close(){
+
+    //Nothing may still be reading or writing the caller's buffers
+    if (ring_fd >= 0){
+        wait_blocks();
+    }
+
+    if (sq_entries != NULL){
+        munmap(sq_entries, sq_entries_length);
+        sq_entries = NULL;
+    }
+    if (cq_ring != NULL && cq_ring != sq_ring){
+        munmap(cq_ring, cq_ring_length);
+    }
+    cq_ring = NULL;
+    if (sq_ring != NULL){
+        munmap(sq_ring, sq_ring_length);
+        sq_ring = NULL;
+    }
+    if (ring_fd >= 0){
+        close(ring_fd);
+        ring_fd = -1;
+    }
+    free(requests);
+    requests = NULL;
+    requests_in_flight = 0;
+    requests_queued = 0;
+}
+
+//1 == submitted requests really run in the background, 0 == each one is done before its submit call returns
+int async_disk_enabled(){
+    return ring_fd >= 0;
+}
+
+//=============================================COMPLETIONS==================================================
+
+//Adding the outcome of a request to a thread's current batch
+void account_blocks(int *batch, int blocks){
+    if (blocks < 0){
+        *batch = -1;
+    }
+    else if (*batch >= 0){
+        *batch = *batch + blocks;
+    }
+}
+
+//Doing a request with the synchronous disk calls (fallback path and retry of failed requests)
+int transfer_now(int writing, int start_address, int nblocks, void **buffers){
+
+    //Case where the blocks sit one after another in memory: one disk call for all of them
+    int contiguous = 1;
+    for (int i = 1; i < nblocks && contiguous; i++){
+        contiguous = (char*)buffers[i] == (char*)buffers[0] + (long)i * block_size_of_disk;
+    }
+    if (contiguous){
+        return writing ? write_blocks(start_address, nblocks, buffers[0]) : read_blocks(start_address, nblocks, buffers[0]);
+    }
+
+    if (writing){
+        return write_blocks_vector(start_address, nblocks, buffers);
+    }
+    return read_blocks_vector(start_address, nblocks, buffers);
+}
+
+//Retiring every completion the kernel has posted
+void reap_completions(){
+    unsigned int head = *cq_head;
+    unsigned int tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail){
+        struct io_uring_cqe *cqe = &cq_entries[head & *cq_mask];
+        struct async_request *request = &requests[cqe->user_data];
+
+        //Case where the transfer came back short or failed, finishing it synchronously
+        if (cqe->res != request->nblocks * block_size_of_disk){
+            void **buffers = (void**)malloc(sizeof(void*) * request->nblocks);
+            for (int i = 0; i < request->nblocks; i++){
+                buffers[i] = request->vectors[i].iov_base;
+            }
+            account_blocks(request->batch_blocks, transfer_now(request->writing, request->start_address, request->nblocks, buffers));
+            free(buffers);
+        }
+        else{
+            account_blocks(request->batch_blocks, request->nblocks);
+        }
+
+        free(request->vectors);
+        request->vectors = NULL;
+        request->in_use = 0;
+        *request->in_flight = *request->in_flight - 1;
+        requests_in_flight--;
+        head++;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+//Handing the queued entries to the kernel and waiting for at least min_complete completions
+int enter_ring(unsigned int min_complete){
+    unsigned int flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+    while (1){
+        int submitted = (int)syscall(__NR_io_uring_enter, ring_fd, requests_queued, min_complete, flags, NULL, 0);
+        if (submitted < 0 && errno == EINTR){
+            continue;
+        }
+        if (submitted < 0){
+            return -1;
+        }
+        requests_queued = requests_queued - submitted;
+        return 0;
+    }
+}
+
+//Waiting (ring_lock held) until at least one request in flight completes
+void wait_for_progress(){
+
+    //Case where another thread already sleeps in the kernel, it wakes everyone once it reaped
+    if (ring_polling == 1){
+        pthread_cond_wait(&ring_progress, &ring_lock);
+        return;
+    }
+
+    //Entries still waiting in the submission ring are handed over too, the completion being waited for may be one of them
+    unsigned int to_submit = requests_queued;
+    ring_polling = 1;
+    pthread_mutex_unlock(&ring_lock);
+    int submitted;
+    while ((submitted = (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0)) < 0 && errno == EINTR){
+    }
+    pthread_mutex_lock(&ring_lock);
+    ring_polling = 0;
+    if (submitted > 0){
+        requests_queued = requests_queued > submitted ? requests_queued - submitted : 0;
+    }
+
+    reap_completions();
+    pthread_cond_broadcast(&ring_progress);
+}
+
+//Finding a free request slot, waiting for a completion when the ring is full
+int claim_request(){
+    while (requests_in_flight == (int)ring_depth){
+        wait_for_progress();
+    }
+    for (unsigned int i = 0; i < ring_depth; i++){
+        if (requests[i].in_use == 0){
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+//=============================================SUBMISSION===================================================
+
+int submit_blocks(int writing, int start_address, int nblocks, void **buffers){
+
+    //Case where there is no ring: the request is done right away
+    if (ring_fd < 0){
+        int result = transfer_now(writing, start_address, nblocks, buffers);
+        account_blocks(&batch_blocks, result);
+        return result < 0 ? -1 : 0;
+    }
+
+    pthread_mutex_lock(&ring_lock);
+    int slot = claim_request();
+    struct async_request *request = &requests[slot];
+    request->in_use = 1;
+    request->batch_blocks = &batch_blocks;
+    request->in_flight = &thread_in_flight;
+    request->writing = writing;
+    request->start_address = start_address;
+    request->nblocks = nblocks;
+    request->vectors = (struct iovec*)malloc(sizeof(struct iovec) * nblocks);
+    for (int i = 0; i < nblocks; i++){
+        request->vectors[i].iov_base = buffers[i];
+        request->vectors[i].iov_len = block_size_of_disk;
+    }
+
+    //Filling the next submission entry
+    unsigned int tail = *sq_tail;
+    unsigned int index = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sq_entries[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = writing ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = disk_descriptor();
+    sqe->off = (unsigned long long)start_address * block_size_of_disk;
+    sqe->addr = (unsigned long long)(unsigned long)request->vectors;
+    sqe->len = nblocks;
+    sqe->user_data = slot;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    requests_in_flight++;
+    thread_in_flight++;
+    requests_queued++;
+
+    //Starting the transfer now, the caller keeps going while it runs
+    int result = enter_ring(0);
+
+    //Case where the kernel did not take the entry, it is taken back out of the ring and the request is done right away
+    if (result < 0 || requests_queued > 0){
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+        free(request->vectors);
+        request->vectors = NULL;
+        request->in_use = 0;
+        requests_in_flight--;
+        thread_in_flight--;
+        requests_queued--;
+        pthread_mutex_unlock(&ring_lock);
+
+        result = transfer_now(writing, start_address, nblocks, buffers);
+        account_blocks(&batch_blocks, result);
+        return result < 0 ? -1 : 0;
+    }
+    pthread_mutex_unlock(&ring_lock);
+    count_disk_transfer(writing, nblocks);
+    return 0;
+}
+
+int submit_read_blocks(int start_address, int nblocks, void *buffer){
+    void **buffers = (void**)malloc(sizeof(void*) * nblocks);
+    for (int i = 0; i < nblocks; i++){
+        buffers[i] = (char*)buffer + (long)i * block_size_of_disk;
+    }
+    int result = submit_blocks(0, start_address, nblocks, buffers);
+    free(buffers);
+    return result;
+}
+
+int submit_write_blocks(int start_address, int nblocks, void *buffer){
+    void **buffers = (void**)malloc(sizeof(void*) * nblocks);
+    for (int i = 0; i < nblocks; i++){
+        buffers[i] = (char*)buffer + (long)i * block_size_of_disk;
+    }
+    int result = submit_blocks(1, start_address, nblocks, buffers);
+    free(buffers);
+    return result;
+}
+
+int submit_write_blocks_vector(int start_address, int nblocks, void **buffers){
+    return submit_blocks(1, start_address, nblocks, buffers);
+}
+
+int wait_blocks(){
+    if (ring_fd >= 0){
+        pthread_mutex_lock(&ring_lock);
+        while (thread_in_flight > 0){
+            wait_for_progress();
+        }
+        pthread_mutex_unlock(&ring_lock);
+    }
+
+    int result = batch_blocks;
+    batch_blocks = 0;
+    return result;
+}
@@ -0,0 +1,18 @@
+#ifndef DISK_ASYNC_H
+#define DISK_ASYNC_H
+
+int async_disk_open(int queue_depth, int block_size);
+
+void async_disk_close();
+
+int async_disk_enabled();
+
+int submit_read_blocks(int start_address, int nblocks, void *buffer);
+
+int submit_write_blocks(int start_address, int nblocks, void *buffer);
+
+int submit_write_blocks_vector(int start_address, int nblocks, void **buffers);
+
+int wait_blocks();
+
+#endif
@@ -1,11 +1,18 @@
 /*
  *   Written by a TA of the ECSE427 course 
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h> 
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
 #include "disk_emu.h"
 
 
@@ -14,14 +21,230 @@ double L, p;
 double r;
 int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY;
 
+/*Backend used by the next init_disk/init_fresh_disk, and the one of the open disk*/
+int requested_backend = DISK_BACKEND_STDIO;
+int disk_backend = DISK_BACKEND_STDIO;
+
+/*Mapping of the whole disk file (mmap backend only)*/
+char* disk_map = NULL;
+size_t disk_map_length = 0;
+
+/*Descriptor used by the pread/direct backends, direct_fd is only open when it was opened with O_DIRECT*/
+int disk_fd = -1;
+int direct_fd = -1;
+
+/*O_DIRECT transfers need the buffer, the offset and the length aligned to this*/
+#define DIRECT_ALIGNMENT 4096
+
+/*Held by O_DIRECT writes, which may rewrite whole pages around the blocks they are given*/
+pthread_mutex_t direct_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*Most iovecs handed to a single preadv/pwritev call*/
+#define MAX_IO_VECTORS 1024
+
+/*Transfers done since the disk was opened, see get_disk_counters()*/
+struct disk_counters counters;
+pthread_mutex_t counters_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*----------------------------------------------------------*/
+/*Counts one read or write call that moves nblocks blocks   */
+/*----------------------------------------------------------*/
+void count_disk_transfer(int writing, int nblocks)
+{
+    pthread_mutex_lock(&counters_lock);
+    if (writing)
+    {
+        counters.writes++;
+        counters.blocks_written += nblocks;
+    }
+    else
+    {
+        counters.reads++;
+        counters.blocks_read += nblocks;
+    }
+    pthread_mutex_unlock(&counters_lock);
+}
+
+/*Blocks the disk still writes before it acts as if the power went off, -1 == no limit*/
+long write_limit = -1;
+
+/*----------------------------------------------------------*/
+/*Simulates a crash for the tests: only the next `blocks`   */
+/*blocks written reach the disk file, the writes after them */
+/*are dropped but still succeed (-1 == no limit). Writes    */
+/*queued on io_uring (disk_async.c) are not limited         */
+/*----------------------------------------------------------*/
+void set_disk_write_limit(long blocks)
+{
+    pthread_mutex_lock(&counters_lock);
+    write_limit = blocks;
+    pthread_mutex_unlock(&counters_lock);
+}
+
+/*----------------------------------------------------------*/
+/*How many of the next nblocks blocks written reach the     */
+/*disk file before the simulated crash                      */
+/*----------------------------------------------------------*/
+int writable_blocks(int nblocks)
+{
+    pthread_mutex_lock(&counters_lock);
+    if (write_limit >= 0)
+    {
+        if (nblocks > write_limit)
+        {
+            nblocks = (int)write_limit;
+        }
+        write_limit -= nblocks;
+    }
+    pthread_mutex_unlock(&counters_lock);
+    return nblocks;
+}
+
+/*----------------------------------------------------------*/
+/*Copies the counters of the open disk (tests use them to   */
+/*see which transfers reached the disk file)                */
+/*----------------------------------------------------------*/
+void get_disk_counters(struct disk_counters *copy)
+{
+    pthread_mutex_lock(&counters_lock);
+    *copy = counters;
+    pthread_mutex_unlock(&counters_lock);
+}
+
+/*----------------------------------------------------------*/
+/*Selects the backend used by the next opened disk           */
+/*----------------------------------------------------------*/
+void set_disk_backend(int backend)
+{
+    requested_backend = backend;
+}
+
+/*----------------------------------------------------------*/
+/*Backend used by the open disk, get_disk_backend() tells   */
+/*the caller when the requested one could not be used       */
+/*----------------------------------------------------------*/
+int get_disk_backend()
+{
+    return disk_backend;
+}
+
+/*----------------------------------------------------------*/
+/*Sets up the requested backend on the open disk file       */
+/*(falls back to stdio or pread if it cannot be used)       */
+/*----------------------------------------------------------*/
+void open_backend(char *filename)
+{
+    struct stat disk_stat;
+    off_t aligned_length;
+
+    disk_backend = DISK_BACKEND_STDIO;
+    disk_map = NULL;
+    disk_map_length = (size_t)MAX_BLOCK * BLOCK_SIZE;
+    memset(&counters, 0, sizeof(counters));
+
+    /*Positioned I/O on the descriptor behind fp, there is no shared seek position*/
+    if (requested_backend == DISK_BACKEND_PREAD || requested_backend == DISK_BACKEND_DIRECT)
+    {
+        disk_fd = fileno(fp);
+        disk_backend = DISK_BACKEND_PREAD;
+
+        /*Bypassing the page cache needs a second descriptor (refused by file systems without O_DIRECT)*/
+        if (requested_backend == DISK_BACKEND_DIRECT)
+        {
+            /*Transfers are widened to whole pages, so the file must end on a page boundary*/
+            aligned_length = ((off_t)disk_map_length + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+            if (fstat(fileno(fp), &disk_stat) == 0 && disk_stat.st_size < aligned_length)
+            {
+                if (ftruncate(fileno(fp), aligned_length) != 0)
+                {
+                    return;
+                }
+            }
+            direct_fd = open(filename, O_RDWR | O_DIRECT);
+            if (direct_fd >= 0)
+            {
+                disk_fd = direct_fd;
+                disk_backend = DISK_BACKEND_DIRECT;
+            }
+        }
+        return;
+    }
+
+    if (requested_backend != DISK_BACKEND_MMAP)
+    {
+        return;
+    }
+
+    /*The file must cover every block, touching a page past its end would fault*/
+    if (fstat(fileno(fp), &disk_stat) != 0 || (size_t)disk_stat.st_size < disk_map_length)
+    {
+        return;
+    }
+
+    void* map = mmap(NULL, disk_map_length, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(fp), 0);
+    if (map == MAP_FAILED)
+    {
+        return;
+    }
+    disk_map = (char *)map;
+    disk_backend = DISK_BACKEND_MMAP;
+}
+
+/*----------------------------------------------------------*/
+/*Descriptor that positioned I/O on the disk may use, -1    */
+/*when the open backend is not the pread one                */
+/*----------------------------------------------------------*/
+int disk_descriptor()
+{
+    if (disk_backend == DISK_BACKEND_PREAD)
+    {
+        return disk_fd;
+    }
+    return -1;
+}
+
+/*----------------------------------------------------------*/
+/*Pushes every written block to the disk file               */
+/*----------------------------------------------------------*/
+int sync_disk()
+{
+    if (disk_backend == DISK_BACKEND_MMAP && disk_map != NULL)
+    {
+        return msync(disk_map, disk_map_length, MS_SYNC);
+    }
+    if (disk_backend == DISK_BACKEND_PREAD || disk_backend == DISK_BACKEND_DIRECT)
+    {
+        return fdatasync(disk_fd);
+    }
+    if (NULL != fp)
+    {
+        return fflush(fp);
+    }
+    return 0;
+}
+
 /*----------------------------------------------------------*/
 /*Close the disk file filled when you don't need it anymore. */
 /*----------------------------------------------------------*/
 int close_disk()
 {
+    if (disk_map != NULL)
+    {
+        munmap(disk_map, disk_map_length);
+        disk_map = NULL;
+    }
+    if (direct_fd >= 0)
+    {
+        close(direct_fd);
+        direct_fd = -1;
+    }
+    disk_fd = -1;
+    disk_backend = DISK_BACKEND_STDIO;
+
     if(NULL != fp)
     {
         fclose(fp);
+        fp = NULL;
     }
     return 0;
 }
@@ -31,8 +254,6 @@ int close_disk()
 /*---------------------------------------*/
 int init_fresh_disk(char *filename, int block_size, int num_blocks)
 {
-    int i, j;
-
     BLOCK_SIZE = block_size;
     MAX_BLOCK = num_blocks;
     
@@ -47,14 +268,13 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks)
         return -1;
     }
     
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
+    /*Sizes the file, the extended part reads back as 0's*/
+    if (ftruncate(fileno(fp), (off_t)MAX_BLOCK * BLOCK_SIZE) != 0)
     {
-        for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            fputc(0, fp);
-        }
+        printf("Could not size new disk file %s\n\n", filename);
+        return -1;
     }
+    open_backend(filename);
     return 0;
 }
 /*----------------------------*/
@@ -73,9 +293,104 @@ int init_disk(char *filename, int block_size, int num_blocks)
         printf("Could not open %s\n\n", filename);
         return -1;
     }
+    open_backend(filename);
+    return 0;
+}
+
+/*-------------------------------------------------------------------*/
+/*Moves length bytes at offset with pread/pwrite, retrying short     */
+/*transfers (reads past the end of the file come back as 0's)        */
+/*-------------------------------------------------------------------*/
+int transfer_fd(int writing, char *buffer, size_t length, off_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t done = writing ? pwrite(disk_fd, buffer, length, offset) : pread(disk_fd, buffer, length, offset);
+
+        if (done < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (done < 0)
+        {
+            return -1;
+        }
+        if (done == 0)
+        {
+            if (writing)
+            {
+                return -1;
+            }
+            memset(buffer, 0, length);
+            return 0;
+        }
+        buffer += done;
+        length -= done;
+        offset += done;
+    }
     return 0;
 }
 
+/*-------------------------------------------------------------------*/
+/*Same as transfer_fd for the pread/direct backends, going through   */
+/*an aligned bounce buffer when the disk was opened with O_DIRECT:   */
+/*the transfer is widened to whole pages, and a write first reads    */
+/*back the pages it only covers part of                              */
+/*-------------------------------------------------------------------*/
+int transfer_blocks(int writing, int start_address, int nblocks, char *buffer)
+{
+    size_t length = (size_t)nblocks * BLOCK_SIZE;
+    off_t offset = (off_t)start_address * BLOCK_SIZE;
+    off_t first_page, end_page;
+    size_t aligned_length, lead;
+    void* aligned;
+    int result = 0;
+
+    if (disk_backend != DISK_BACKEND_DIRECT)
+    {
+        return transfer_fd(writing, buffer, length, offset);
+    }
+
+    first_page = offset / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+    end_page = ((off_t)(offset + length) + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+    aligned_length = (size_t)(end_page - first_page);
+    lead = (size_t)(offset - first_page);
+
+    if (posix_memalign(&aligned, DIRECT_ALIGNMENT, aligned_length) != 0)
+    {
+        return -1;
+    }
+    if (!writing)
+    {
+        result = transfer_fd(0, (char *)aligned, aligned_length, first_page);
+        if (result == 0)
+        {
+            memcpy(buffer, (char *)aligned + lead, length);
+        }
+        free(aligned);
+        return result;
+    }
+
+    pthread_mutex_lock(&direct_lock);
+    /*Pages shared with blocks outside of the write keep their bytes*/
+    if (lead != 0)
+    {
+        result = transfer_fd(0, (char *)aligned, DIRECT_ALIGNMENT, first_page);
+    }
+    if (result == 0 && lead + length != aligned_length && (lead == 0 || aligned_length > DIRECT_ALIGNMENT))
+    {
+        result = transfer_fd(0, (char *)aligned + aligned_length - DIRECT_ALIGNMENT, DIRECT_ALIGNMENT, end_page - DIRECT_ALIGNMENT);
+    }
+    if (result == 0)
+    {
+        memcpy((char *)aligned + lead, buffer, length);
+        result = transfer_fd(1, (char *)aligned, aligned_length, first_page);
+    }
+    pthread_mutex_unlock(&direct_lock);
+    free(aligned);
+    return result;
+}
+
 /*-------------------------------------------------------------------*/
 /*Reads a series of blocks from the disk into the buffer             */
 /*-------------------------------------------------------------------*/
@@ -84,25 +399,44 @@ int read_blocks(int start_address, int nblocks, void *buffer)
     int i, s;
     s = 0;
 
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
-
     /*Checks that the data requested is within the range of addresses of the disk*/
     if (start_address + nblocks > MAX_BLOCK)
     {
         printf("out of bound error %d\n", start_address);
         return -1;
     }
+    count_disk_transfer(0, nblocks);
+
+    /*Mapped disk: the blocks are copied straight out of the mapping*/
+    if (disk_backend == DISK_BACKEND_MMAP)
+    {
+        memcpy(buffer, disk_map + (size_t)start_address * BLOCK_SIZE, (size_t)nblocks * BLOCK_SIZE);
+        return nblocks;
+    }
+
+    /*Descriptor backends: one positioned read for the whole series*/
+    if (disk_backend == DISK_BACKEND_PREAD || disk_backend == DISK_BACKEND_DIRECT)
+    {
+        if (transfer_blocks(0, start_address, nblocks, (char *)buffer) != 0)
+        {
+            printf("read error %d\n", start_address);
+            return -1;
+        }
+        return nblocks;
+    }
+
+    /*Sets up a temporary buffer*/
+    void* blockRead = (void*) malloc(BLOCK_SIZE);
 
     /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    fseeko(fp, (off_t)start_address * BLOCK_SIZE, SEEK_SET);
 
     /*For every block requested*/
     for (i = 0; i < nblocks; ++i)
     {
         s++;
         fread(blockRead, BLOCK_SIZE, 1, fp);
-        memcpy((char *)buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
+        memcpy((char *)buffer+((long)i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
     }
 
     free(blockRead);
@@ -112,22 +446,41 @@ int read_blocks(int start_address, int nblocks, void *buffer)
 /*------------------------------------------------------------------*/
 /*Writes a series of blocks to the disk from the buffer             */
 /*------------------------------------------------------------------*/
-int write_blocks(int start_address, int nblocks, void *buffer)
+int write_blocks_now(int start_address, int nblocks, void *buffer)
 {
     int i, s;
     s = 0;
 
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
-
     /*Checks that the data requested is within the range of addresses of the disk*/
     if (start_address + nblocks > MAX_BLOCK)
     {
         printf("out of bound error\n");
         return -1;
     }
+    count_disk_transfer(1, nblocks);
+
+    /*Mapped disk: the blocks are copied straight into the mapping, sync_disk() makes them durable*/
+    if (disk_backend == DISK_BACKEND_MMAP)
+    {
+        memcpy(disk_map + (size_t)start_address * BLOCK_SIZE, buffer, (size_t)nblocks * BLOCK_SIZE);
+        return nblocks;
+    }
+
+    /*Descriptor backends: one positioned write for the whole series, sync_disk() makes it durable*/
+    if (disk_backend == DISK_BACKEND_PREAD || disk_backend == DISK_BACKEND_DIRECT)
+    {
+        if (transfer_blocks(1, start_address, nblocks, (char *)buffer) != 0)
+        {
+            printf("write error %d\n", start_address);
+            return -1;
+        }
+        return nblocks;
+    }
+
+    void* blockWrite = (void*) malloc(BLOCK_SIZE);
 
     /*Goto where the data is to be written on the disk*/        
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    fseeko(fp, (off_t)start_address * BLOCK_SIZE, SEEK_SET);
 
     /*For every block requested*/        
     for (i = 0; i < nblocks; ++i)
@@ -135,7 +488,7 @@ int write_blocks(int start_address, int nblocks, void *buffer)
         /*Pause until the latency duration is elapsed*/
         usleep(L);
 
-        memcpy(blockWrite, (char *)buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
+        memcpy(blockWrite, (char *)buffer+((long)i*BLOCK_SIZE), BLOCK_SIZE);
 
         fwrite(blockWrite, BLOCK_SIZE, 1, fp);
         fflush(fp);
@@ -144,3 +497,101 @@ int write_blocks(int start_address, int nblocks, void *buffer)
     free(blockWrite);
     return s;
 }
+
+/*------------------------------------------------------------------*/
+/*Same as write_blocks_now, past a simulated crash the blocks are    */
+/*dropped without telling the caller                                 */
+/*------------------------------------------------------------------*/
+int write_blocks(int start_address, int nblocks, void *buffer)
+{
+    int kept = writable_blocks(nblocks);
+
+    if (kept > 0 && write_blocks_now(start_address, kept, buffer) < 0)
+    {
+        return -1;
+    }
+    return nblocks;
+}
+
+/*------------------------------------------------------------------*/
+/*Reads/writes a series of consecutive blocks, block i being in      */
+/*buffers[i] (one preadv/pwritev per MAX_IO_VECTORS blocks)          */
+/*------------------------------------------------------------------*/
+int transfer_blocks_vector(int writing, int start_address, int nblocks, void **buffers)
+{
+    struct iovec vectors[MAX_IO_VECTORS];
+    int i, done, requested;
+
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error %d\n", start_address);
+        return -1;
+    }
+
+    /*Only the plain pread backend can hand the caller's buffers to the kernel as they are*/
+    if (disk_backend != DISK_BACKEND_PREAD)
+    {
+        for (i = 0; i < nblocks; i++)
+        {
+            int s = writing ? write_blocks(start_address + i, 1, buffers[i]) : read_blocks(start_address + i, 1, buffers[i]);
+            if (s < 0)
+            {
+                return -1;
+            }
+        }
+        return nblocks;
+    }
+
+    /*Blocks past a simulated crash are dropped*/
+    requested = nblocks;
+    if (writing)
+    {
+        nblocks = writable_blocks(nblocks);
+    }
+    if (nblocks > 0)
+    {
+        count_disk_transfer(writing, nblocks);
+    }
+
+    for (done = 0; done < nblocks; )
+    {
+        int count = nblocks - done;
+        if (count > MAX_IO_VECTORS)
+        {
+            count = MAX_IO_VECTORS;
+        }
+        for (i = 0; i < count; i++)
+        {
+            vectors[i].iov_base = buffers[done + i];
+            vectors[i].iov_len = BLOCK_SIZE;
+        }
+
+        off_t offset = (off_t)(start_address + done) * BLOCK_SIZE;
+        ssize_t length = writing ? pwritev(disk_fd, vectors, count, offset) : preadv(disk_fd, vectors, count, offset);
+
+        /*Short or failed vector transfers are finished block by block*/
+        if (length != (ssize_t)count * BLOCK_SIZE)
+        {
+            for (i = 0; i < count; i++)
+            {
+                if (transfer_fd(writing, (char *)buffers[done + i], BLOCK_SIZE, offset + (off_t)i * BLOCK_SIZE) != 0)
+                {
+                    return -1;
+                }
+            }
+        }
+        done += count;
+    }
+    return requested;
+}
+
+int read_blocks_vector(int start_address, int nblocks, void **buffers)
+{
+    return transfer_blocks_vector(0, start_address, nblocks, buffers);
+}
+
+int write_blocks_vector(int start_address, int nblocks, void **buffers)
+{
+    return transfer_blocks_vector(1, start_address, nblocks, buffers);
+}
@@ -1,5 +1,29 @@
+/*Backends for the disk file, chosen with set_disk_backend() before init_disk/init_fresh_disk*/
+#define DISK_BACKEND_STDIO 0
+#define DISK_BACKEND_MMAP 1
+#define DISK_BACKEND_PREAD 2
+#define DISK_BACKEND_DIRECT 3 /*pread/pwrite on a descriptor opened with O_DIRECT*/
+
+/*Transfers done on the disk file since it was opened, a call that moves several blocks counts once*/
+struct disk_counters
+{
+    long reads;
+    long blocks_read;
+    long writes;
+    long blocks_written;
+};
+
+void set_disk_backend(int backend);
+int get_disk_backend();
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
+int read_blocks_vector(int start_address, int nblocks, void **buffers);
+int write_blocks_vector(int start_address, int nblocks, void **buffers);
+int sync_disk();
+int disk_descriptor();
+void count_disk_transfer(int writing, int nblocks);
+void get_disk_counters(struct disk_counters *copy);
+void set_disk_write_limit(long blocks);
 int close_disk();
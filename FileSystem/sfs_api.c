@@ -3,33 +3,172 @@
 #include<stdlib.h> 
 #include<unistd.h>
 #include<stdint.h>
+#include<limits.h>
 #include<string.h>
+#include<pthread.h>
+#include<time.h>
 #include "disk_emu.h"
-
-#define BLOCK_SIZE 1024
-#define MAX_BLOCK 1024 
+#include "sfs_cache.h"
+#include "sfs_journal.h"
+#include "disk_async.h"
 
 /*
 Notes: 
 1. MAX_FNAME_LENGTH = 15 //The code was built with the assumption that files of size 15 + '\0' will be used
-2. MAX_FD = 10 //While more than 10 files can be created, only 10 of them can be opened at once. 
+2. The file descriptor table grows as files are opened, so any number of files can be open at once
 3. MAX_BYTES = 30000 //The default value in the tests works
 4. MIN_BYTES = 10000 //The default value in the tests works
-5. With the i-node construction, the largest file size is 12*1024 + 1024^2/4 = 274432 bytes 
+5. Pointer i-nodes have 12 direct pointers plus single, double and triple indirect pointers (12 + P + P^2 + P^3 blocks, P = B/4 for a
+   block size B), extent i-nodes are only limited by the disk. File sizes and offsets are 32-bit ints, so no file goes past 2 GiB
+6. All disk accesses go through the write-back block cache (sfs_cache.c), call sfs_sync() to push everything to the disk
+   The disk file is read with stdio by default, sfs_configure_disk() switches to mmap, pread/pwrite or O_DIRECT (sfs_disk_backend() tells which one is in use)
+   With pread/pwrite, large reads and cache write-back are queued on io_uring (disk_async.c) and overlap each other
+7. The geometry (block size, block count) is chosen by mksfs_geometry() and stored in the super block, every layout offset comes from it
+8. Every call except mksfs()/mksfs_geometry() may run from several threads at once (see LOCKING below for the lock order)
+9. Each descriptor detects sequential sfs_fread() calls and prefetches the blocks that come next (see READAHEAD below)
+10. Small writes of an open file are gathered in its write buffer, blocks are only allocated when it is written back (see WRITE BUFFERS)
+11. Metadata blocks (i-node table, directory, free bitmap, pointer blocks) are written through the journal (sfs_journal.c). Their
+    changes are committed together by sfs_sync(), or at the end of the call that brings them to half the journal (see
+    commit_if_needed), and replayed by mksfs(0) after a crash. A freed block is only handed to the allocator once the transaction
+    that frees it is committed (see release_blocks)
+12. mksfs(0) only reads the super block (and replays the journal), the other metadata is loaded when a call first needs it and by a
+    background thread (see LAZY MOUNT below), sfs_time_to_first_open() tells how long the first sfs_fopen() took to be served
+13. sfs_snapshot() takes a copy-on-write snapshot of the disk, kept in the snapshot table (committed through the journal like the other
+    metadata) until sfs_snapshot_delete(). sfs_snapshot_export() writes it to a disk image file (see SNAPSHOT)
+14. sfs_clone() makes a new file that shares the data blocks of another one. The reference counts of the blocks are kept in the
+    blocks right before the free bitmap, and a write to a shared block goes to a copy of it (see unshare_file_blocks)
+15. Files of up to I_NODE_INLINE_BYTES bytes keep their data in the i-node, so they use no block and are read without any disk access
+16. Files can be sparse: a write past the end of the file leaves a hole, whose blocks are only allocated once written to. Holes
+    read as zeros without any disk access, sfs_seek_data() and sfs_seek_hole() move the read_write_pointer to the next data or hole
+17. sfs_fallocate() allocates the blocks of a range of a file ahead of the writes (contiguously when the disk allows it) without
+    writing them or changing the file size. Blocks it sets aside past the end of the file are zeroed once a write skips over them
 */
 
+//Geometry used by mksfs() (1024 blocks of 1024 bytes)
+#define DEFAULT_BLOCK_SIZE 1024
+#define DEFAULT_BLOCK_COUNT 1024
+
+//Limits accepted by mksfs_geometry()
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
+#define MIN_BLOCK_COUNT 64
+
+//Identifies a disk formatted by this file system
+#define SFS_MAGIC 0xACBD0009
+
+//Identifies the snapshot table of a disk that keeps a snapshot
+#define SNAPSHOT_MAGIC 0x534E4150
+
+//One i-node for every 8 blocks of the disk
+#define BLOCKS_PER_I_NODE 8
+
+//Journal takes one block out of 32, and never fewer than this
+#define MIN_JOURNAL_BLOCKS 32
+
+//Geometry of the mounted disk, every value comes from the super block
+#define BLOCK_SIZE ((int)super_block.block_size)
+#define MAX_BLOCK ((int)super_block.file_system_size)
+#define I_NODE_COUNT ((int)super_block.i_node_table_length)
+
+//Disk layout of the metadata
+#define I_NODE_TABLE_START ((int)super_block.i_node_table_start)
+#define I_NODE_TABLE_BLOCKS ((int)super_block.i_node_table_blocks)
+#define I_NODES_PER_BLOCK (BLOCK_SIZE / (int)sizeof(struct i_node))
+#define FREE_BIT_MAP_BLOCK ((int)super_block.free_bit_map_start)
+#define FREE_BIT_MAP_BLOCKS ((int)super_block.free_bit_map_blocks)
+#define REFERENCE_COUNT_START ((int)super_block.reference_count_start)
+#define REFERENCE_COUNT_BLOCKS ((int)super_block.reference_count_blocks)
+#define JOURNAL_START ((int)super_block.journal_start)
+#define JOURNAL_BLOCKS ((int)super_block.journal_blocks)
+#define SNAPSHOT_TABLE_START ((int)super_block.snapshot_table_start)
+#define SNAPSHOT_TABLE_BLOCKS ((int)super_block.snapshot_table_blocks)
+
+//Number of 64-bit words in the free bitmap (it fills its disk blocks completely)
+#define FREE_BIT_MAP_WORDS (FREE_BIT_MAP_BLOCKS * BLOCK_SIZE / 8)
+
+//Most (block, copy) pairs the snapshot table has room for
+#define SNAPSHOT_COPY_CAPACITY ((int)((SNAPSHOT_TABLE_BLOCKS * (long)BLOCK_SIZE - sizeof(struct snapshot_header)) / (2 * sizeof(uint32_t))))
+
+//Block map limits
+#define POINTERS_PER_BLOCK (BLOCK_SIZE / 4)
+#define MAX_POINTER_BLOCKS (12 + (long long)POINTERS_PER_BLOCK * (1 + POINTERS_PER_BLOCK * (1 + (long long)POINTERS_PER_BLOCK)))
+#define I_NODE_EXTENTS 4
+
+//Largest file whose data is kept in its i-node instead of a block (makes an i-node 128 bytes)
+#define I_NODE_INLINE_BYTES 120
+
+//The directory is stored as the data of the root i-node
+#define ROOT_DIRECTORY_I_NODE 0
+#define DIRECTORY_ENTRIES_PER_BLOCK (BLOCK_SIZE / (int)sizeof(struct directory_entry))
+
+//i-node flags
+#define I_NODE_FLAG_EXTENTS 1 //Data blocks are described by (start, length) extents instead of direct/indirect pointers
+#define I_NODE_FLAG_SHARED 2 //Some data blocks may be shared with a clone (sfs_clone), a write copies them first
+#define I_NODE_FLAG_INLINE 4 //The file has no blocks, its data is in the i-node (new files start this way)
+
+//Descriptors available right after mksfs(), the table doubles whenever they are all in use
+#define INITIAL_DESCRIPTORS 16
+
+//Default block cache configuration, can be changed with sfs_configure_cache() before mksfs()
+#define DEFAULT_CACHE_BLOCKS 64
+
+//Most disk requests kept in flight at once by the asynchronous disk path
+#define ASYNC_QUEUE_DEPTH 32
+
+//Readahead window of a descriptor: starts at the minimum and doubles on every sequential read, up to the maximum
+#define MIN_READAHEAD_BLOCKS 4
+#define DEFAULT_READAHEAD_BLOCKS 32
+
+//Size of the write buffer of an open file, larger writes go straight to the file's blocks
+#define WRITE_BUFFER_BLOCKS 16
+
+//Blocks of the i-node table read at a time while it is loaded after the mount
+#define I_NODE_LOAD_BLOCKS 64
+
 struct super_node{
-    int magic_number;
-    int block_size; 
-    int file_system_size; 
-    int i_node_table_length; 
-    int root_directory_node; 
+    uint32_t magic_number;
+    uint32_t block_size; 
+    uint32_t file_system_size; //Number of blocks on the disk
+    uint32_t i_node_table_length; //Number of i-nodes
+    uint32_t root_directory_node; 
+    uint32_t i_node_table_start; //First block of the i-node table
+    uint32_t i_node_table_blocks; 
+    uint32_t free_bit_map_start; //First block of the free bitmap
+    uint32_t free_bit_map_blocks; 
+    uint32_t journal_start; //First block of the journal region
+    uint32_t journal_blocks;
+    uint32_t reference_count_start; //First block of the reference counts
+    uint32_t reference_count_blocks;
+    uint32_t snapshot_table_start; //First block of the snapshot table
+    uint32_t snapshot_table_blocks;
+};
+
+//Start of the snapshot table, the pairs fill the rest of its region (see SNAPSHOT)
+struct snapshot_header{
+    uint32_t magic; //SNAPSHOT_MAGIC while a snapshot is kept
+    uint32_t copy_count; //Blocks set aside for copies when the snapshot was taken, one pair each
+    uint32_t copies[]; //copies[2 * i] is the block copy i holds the snapshot's content of (-1 == not used yet), copies[2 * i + 1] the copy
+};
+
+struct extent{
+    uint32_t file_block; //First block of the file covered by the extent
+    uint32_t disk_block; //First disk block of the run
+    uint32_t length; //Number of blocks in the run, 0 == unused extent slot
 };
 
 struct i_node{
     uint32_t file_size;
-    uint32_t direct_pointer[12]; //12 direct pointers
-    uint32_t indirect_pointer; //1 indirect pointer block 
+    uint32_t flags;
+    union{
+        struct{
+            uint32_t direct_pointer[12]; //12 direct pointers
+            uint32_t indirect_pointer; //1 indirect pointer block 
+            uint32_t double_indirect_pointer; //Block of pointers to indirect pointer blocks
+            uint32_t triple_indirect_pointer; //Block of pointers to double indirect pointer blocks
+        } pointers;
+        struct extent extents[I_NODE_EXTENTS]; //Used instead of the pointers when I_NODE_FLAG_EXTENTS is set
+        char inline_data[I_NODE_INLINE_BYTES]; //Data of the file when I_NODE_FLAG_INLINE is set
+    } map;
 }; 
 
 struct directory_entry{
@@ -41,51 +180,2835 @@ struct directory_entry{
 struct file_descriptor_entry{
     uint32_t i_node_number; 
     uint32_t read_write_pointer; 
+    int next_free; //Next descriptor of the free list while this one is not in use
+    int readahead_next; //File block a sequential sfs_fread() starts in
+    int readahead_window; //Blocks prefetched ahead of the read_write_pointer, 0 == access is not sequential
+    int readahead_end; //First file block that was not prefetched yet
+};
+
+//Bytes written to an open file that do not have blocks yet
+struct write_buffer{
+    char *data; //WRITE_BUFFER_BLOCKS blocks, allocated by the first buffered write
+    int start; //File offset of data[0]
+    int end; //File offset right after the last buffered byte, start == end when nothing is buffered
+    int disk_size; //File size the file's blocks describe (file_size already counts the buffered bytes)
+    int reserved; //Free blocks set aside so the buffer can always be written back
+};
+
+//Blocks of a metadata table that changed since the last flush
+struct dirty_blocks{
+    char *flags; //One flag per block of the table
+    int *list; //Blocks that are flagged, so a flush does not scan the whole table
+    int count;
 };
 
+//Super block of the mounted disk
+struct super_node super_block;
+
 //Caches
-struct i_node i_node_table[114];
-struct directory_entry directory_table[96];
-struct file_descriptor_entry file_descriptor_table[10]; 
-char free_bit_map[1024]; 
+struct i_node *i_node_table = NULL; //I_NODE_COUNT i-nodes, packed I_NODES_PER_BLOCK to a disk block
+uint64_t *i_node_free_map = NULL; //One bit per i-node, 1 == free | 0 == used (i-nodes that are not loaded yet count as used)
+char *i_node_block_loaded = NULL; //One flag per block of the i-node table, 1 == its i-nodes are in i_node_table
+int i_node_load_cursor = 0; //Lowest block of the i-node table that may not be loaded yet
+int i_node_free_hint = 0; //Lowest word of i_node_free_map that may have a free i-node
+struct directory_entry *directory_table = NULL; //Every entry slot of the directory file
+int directory_table_length = 0; //Number of entry slots (always whole directory blocks)
+uint64_t *directory_free_map = NULL; //One bit per entry slot, 1 == free | 0 == used
+int directory_free_hint = 0; //Lowest word of directory_free_map that may have a free slot
+int directory_loaded = 0; //directory_table was read from the disk (the mount loads it lazily)
+struct file_descriptor_entry *file_descriptor_table = NULL; 
+int file_descriptor_capacity = 0;
+int free_descriptor_head = -1; //First descriptor of the free list, -1 when every descriptor is in use
+int *i_node_descriptor = NULL; //Descriptor each i-node is open under, -1 == not open
+uint64_t *free_bit_map = NULL; //One bit per disk block, 1 == free | 0 == used
+int free_block_count = 0; //Number of 1 bits in free_bit_map
+int free_bit_map_loaded = 0; //free_bit_map was read from the disk (the mount loads it lazily)
+int *freed_blocks = NULL; //Blocks freed since the last commit, still used in free_bit_map (see release_blocks)
+int freed_count = 0;
+int freed_capacity = 0;
+int freed_sealed = 0; //freed_blocks[0, freed_sealed) are written as free by the commit that is running
+uint64_t *freed_block_map = NULL; //One bit per disk block, 1 == the block is in freed_blocks[0, freed_sealed)
+int snapshot_active = 0; //1 == a snapshot is taken (see SNAPSHOT)
+uint64_t *snapshot_bit_map = NULL; //One bit per disk block, 1 == the snapshot uses the block (its free bitmap with the journal and the snapshot table left out)
+int snapshot_held_blocks = 0; //Blocks free in free_bit_map that the snapshot still uses, the allocator leaves them alone
+uint16_t *reference_counts = NULL; //One per disk block: how many files share the block besides the first one (sfs_clone)
+int reserved_blocks = 0; //Free blocks set aside for write buffers, only their own write-back may allocate them
+__thread int reservation_allowance = 0; //Reserved blocks the calling thread is writing back a buffer with
+struct write_buffer *write_buffers = NULL; //One per i-node, only used while the file is open
+int write_buffer_count = 0;
+uint64_t *buffered_i_node_map = NULL; //One bit per i-node, 1 == its write buffer holds bytes (changed with atomic operations)
+
+//Next-fit cursor: word of the free_bit_map where the next block search starts
+int free_bit_map_cursor; 
+
+//Pointer for sfs_getnextfilename
+int current_file_read; 
+
+//Dirty blocks of every metadata table, only the blocks flagged here are committed by flush_metadata()
+struct dirty_blocks i_node_table_dirty;
+struct dirty_blocks directory_table_dirty;
+struct dirty_blocks free_bit_map_dirty;
+struct dirty_blocks reference_count_dirty;
+int dirty_pointer_blocks = 0; //Pointer blocks changed in the block maps, they join the transaction on the next commit (atomic)
+int commit_wanted = 0; //1 == the running transaction is half the journal, the next operation to end commits it (atomic)
+
+//Block cache settings and mount state
+int cache_size_setting = DEFAULT_CACHE_BLOCKS;
+int cache_policy_setting = SFS_CACHE_LRU;
+int readahead_setting = DEFAULT_READAHEAD_BLOCKS;
+int disk_mounted = 0;
+int exit_handler_registered = 0;
+
+//============================================FILE DESCRIPTORS==============================================
+
+/*
+Descriptors that are not in use form a free list through next_free, so opening and closing a file never scans the table.
+Each open i-node is found through i_node_descriptor, since opening a file that is already open gives back its descriptor.
+The caller holds descriptor_lock for all of these.
+*/
+
+//Adding descriptors [first, last) to the front of the free list, lowest first
+void add_free_descriptors(int first, int last){
+    for (int i = last - 1; i >= first; i--){
+        file_descriptor_table[i].i_node_number = -1;
+        file_descriptor_table[i].read_write_pointer = 0;
+        file_descriptor_table[i].next_free = free_descriptor_head;
+        free_descriptor_head = i;
+    }
+}
+
+//Closing every descriptor (a file system is being mounted)
+void reset_descriptor_table(){
+    file_descriptor_capacity = INITIAL_DESCRIPTORS;
+    file_descriptor_table = (struct file_descriptor_entry*)realloc(file_descriptor_table, sizeof(struct file_descriptor_entry) * file_descriptor_capacity);
+    free_descriptor_head = -1;
+    add_free_descriptors(0, file_descriptor_capacity);
+
+    for (int i = 0; i < I_NODE_COUNT; i++){
+        i_node_descriptor[i] = -1;
+    }
+}
+
+//Giving an open descriptor to an i-node, the table doubles when every descriptor is in use
+int open_descriptor(int i_node, int read_write_pointer){
+    if (free_descriptor_head == -1){
+        int old_capacity = file_descriptor_capacity;
+        file_descriptor_capacity = file_descriptor_capacity * 2;
+        file_descriptor_table = (struct file_descriptor_entry*)realloc(file_descriptor_table, sizeof(struct file_descriptor_entry) * file_descriptor_capacity);
+        add_free_descriptors(old_capacity, file_descriptor_capacity);
+    }
+
+    int fileID = free_descriptor_head;
+    free_descriptor_head = file_descriptor_table[fileID].next_free;
+    file_descriptor_table[fileID].i_node_number = i_node;
+    file_descriptor_table[fileID].read_write_pointer = read_write_pointer;
+    file_descriptor_table[fileID].readahead_next = read_write_pointer / BLOCK_SIZE;
+    file_descriptor_table[fileID].readahead_window = 0;
+    file_descriptor_table[fileID].readahead_end = 0;
+    i_node_descriptor[i_node] = fileID;
+    return fileID;
+}
+
+//I-node of an open descriptor, -1 if the descriptor is not open (or not a descriptor at all)
+int descriptor_i_node(int fileID){
+    if (fileID < 0 || fileID >= file_descriptor_capacity){
+        return -1;
+    }
+    return (int)file_descriptor_table[fileID].i_node_number;
+}
+
+void release_descriptor(int fileID){
+    i_node_descriptor[file_descriptor_table[fileID].i_node_number] = -1;
+    file_descriptor_table[fileID].i_node_number = -1; //-1 signifies that the slot is not in use! 
+    file_descriptor_table[fileID].next_free = free_descriptor_head;
+    free_descriptor_head = fileID;
+}
+
+//=================================================LOCKING==================================================
+
+/*
+Locks are always taken in this order (a thread never waits for an earlier lock while holding a later one):
+commit_lock -> directory_lock -> i_node_locks[i] -> descriptor_lock -> block_map_lock -> block map locks -> allocator_lock -> metadata_lock
+-> snapshot_table_lock (-> journal_lock inside sfs_journal.c) -> snapshot_lock (-> cache_lock inside sfs_cache.c)
+*/
+pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER; //One flush_metadata() at a time, so each commits a whole set of changes
+pthread_rwlock_t directory_lock = PTHREAD_RWLOCK_INITIALIZER; //directory_table, its index, free slots and current_file_read
+pthread_rwlock_t *i_node_locks = NULL; //One per i-node: block map and file_size, shared by readers, held alone by a writer
+int i_node_lock_count = 0;
+pthread_mutex_t descriptor_lock = PTHREAD_MUTEX_INITIALIZER; //file_descriptor_table, its free list and i_node_descriptor
+pthread_mutex_t allocator_lock = PTHREAD_MUTEX_INITIALIZER; //free_bit_map, free_bit_map_cursor, the free i-node map and loading them
+pthread_mutex_t metadata_lock = PTHREAD_MUTEX_INITIALIZER; //Dirty block lists, held while they are flushed
+pthread_mutex_t snapshot_table_lock = PTHREAD_MUTEX_INITIALIZER; //Held while a metadata block goes into the journal, so the copy the snapshot needs is recorded first
+pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER; //The snapshot table, its copies and writing snapshot_bit_map (see SNAPSHOT)
+
+//Making one lock per i-node of the mounted disk
+void init_i_node_locks(){
+    for (int i = 0; i < i_node_lock_count; i++){
+        pthread_rwlock_destroy(&i_node_locks[i]);
+    }
+    i_node_lock_count = I_NODE_COUNT;
+    i_node_locks = (pthread_rwlock_t*)realloc(i_node_locks, sizeof(pthread_rwlock_t) * i_node_lock_count);
+    for (int i = 0; i < i_node_lock_count; i++){
+        pthread_rwlock_init(&i_node_locks[i], NULL);
+    }
+}
+
+/*
+Locking the i-node that an open descriptor points to (for reading or for writing) and getting the read_write_pointer.
+The descriptor is checked again once the i-node is locked, since the file may have been closed or removed meanwhile.
+Returns the locked i-node, -1 if the descriptor is not open.
+*/
+int lock_descriptor_i_node(int fileID, int writing, int *read_write_pointer){
+    while (1){
+        pthread_mutex_lock(&descriptor_lock);
+        int i_node = descriptor_i_node(fileID);
+        pthread_mutex_unlock(&descriptor_lock);
+        if (i_node == -1){
+            return -1;
+        }
+
+        if (writing){
+            pthread_rwlock_wrlock(&i_node_locks[i_node]);
+        }
+        else{
+            pthread_rwlock_rdlock(&i_node_locks[i_node]);
+        }
+
+        //Case where the descriptor still points to the same i-node
+        pthread_mutex_lock(&descriptor_lock);
+        int still_open = descriptor_i_node(fileID) == i_node;
+        *read_write_pointer = file_descriptor_table[fileID].read_write_pointer;
+        pthread_mutex_unlock(&descriptor_lock);
+        if (still_open){
+            return i_node;
+        }
+        pthread_rwlock_unlock(&i_node_locks[i_node]);
+    }
+}
+
+//Making room for `blocks` blocks in a dirty block tracker, the new blocks start out clean
+void resize_dirty_blocks(struct dirty_blocks *dirty, int old_blocks, int blocks){
+    dirty->flags = (char*)realloc(dirty->flags, blocks + 1);
+    dirty->list = (int*)realloc(dirty->list, sizeof(int) * (blocks + 1));
+    for (int i = old_blocks; i <= blocks; i++){
+        dirty->flags[i] = 0;
+    }
+}
+
+/*
+Blocks the next commit writes: the flagged blocks of the metadata tables, the changed pointer blocks of the block maps and the
+images already in the running transaction (the caller holds metadata_lock)
+*/
+int transaction_size_locked(){
+    int count = i_node_table_dirty.count + directory_table_dirty.count + free_bit_map_dirty.count + reference_count_dirty.count;
+    return count + __atomic_load_n(&dirty_pointer_blocks, __ATOMIC_RELAXED) + journal_pending();
+}
+
+//Asking for a commit once the transaction is half the journal, the other half leaves room for the operations still running
+void check_transaction_size_locked(){
+    if (transaction_size_locked() >= journal_capacity() / 2){
+        __atomic_store_n(&commit_wanted, 1, __ATOMIC_RELEASE);
+    }
+}
+
+void mark_block_dirty(struct dirty_blocks *dirty, int block){
+    pthread_mutex_lock(&metadata_lock);
+    if (dirty->flags[block] == 0){
+        dirty->flags[block] = 1;
+        dirty->list[dirty->count] = block;
+        dirty->count++;
+        check_transaction_size_locked();
+    }
+    pthread_mutex_unlock(&metadata_lock);
+}
+
+void mark_i_node_dirty(int i_node){
+    mark_block_dirty(&i_node_table_dirty, i_node / I_NODES_PER_BLOCK);
+}
+
+void mark_directory_dirty(int entry){
+    mark_block_dirty(&directory_table_dirty, entry / DIRECTORY_ENTRIES_PER_BLOCK);
+}
+
+void mark_free_bit_map_dirty(int block){
+    mark_block_dirty(&free_bit_map_dirty, block / (BLOCK_SIZE * 8));
+}
+
+void mark_reference_count_dirty(int block){
+    mark_block_dirty(&reference_count_dirty, block / (BLOCK_SIZE / (int)sizeof(uint16_t)));
+}
+
+//==============================================FREE BITMAP=================================================
+
+//Bits of word `word` of a block bitmap that stand for blocks [start, end)
+uint64_t word_range_mask(int word, int start, int end){
+    int first = word * 64;
+    if (end <= first || start >= first + 64){
+        return 0;
+    }
+    uint64_t mask = ~(uint64_t)0;
+    if (start > first){
+        mask = mask & (~(uint64_t)0 << (start - first));
+    }
+    if (end < first + 64){
+        mask = mask & (((uint64_t)1 << (end - first)) - 1);
+    }
+    return mask;
+}
+
+//Whether the snapshot uses `block`, which then stays out of the allocator even once it is free (the caller holds allocator_lock or snapshot_lock)
+int snapshot_uses_block(int block){
+    return snapshot_active == 1 && ((snapshot_bit_map[block / 64] >> (block % 64)) & 1);
+}
+
+void set_block_free(int block){
+    if ((free_bit_map[block / 64] & ((uint64_t)1 << (block % 64))) == 0){
+        free_block_count++;
+        if (snapshot_uses_block(block)){
+            snapshot_held_blocks++;
+        }
+    }
+    free_bit_map[block / 64] |= (uint64_t)1 << (block % 64);
+    mark_free_bit_map_dirty(block);
+}
+
+void set_block_used(int block){
+    if ((free_bit_map[block / 64] & ((uint64_t)1 << (block % 64))) != 0){
+        free_block_count--;
+        if (snapshot_uses_block(block)){
+            snapshot_held_blocks--;
+        }
+    }
+    free_bit_map[block / 64] &= ~((uint64_t)1 << (block % 64));
+    mark_free_bit_map_dirty(block);
+}
+
+/*
+A block that is freed stays used in free_bit_map until the transaction that frees it is committed. Before that, the committed
+i-nodes and pointer blocks may still lead to it, so reusing it would let a crash replay them over someone else's data. Each
+commit seals the blocks freed so far (they are written as free in its bitmap blocks) and hands them to the allocator once it is
+on the disk. The caller holds allocator_lock for all of these.
+*/
+void defer_block_free(int block){
+    if (freed_count == freed_capacity){
+        freed_capacity = freed_capacity == 0 ? 64 : freed_capacity * 2;
+        freed_blocks = (int*)realloc(freed_blocks, sizeof(int) * freed_capacity);
+    }
+    freed_blocks[freed_count] = block;
+    freed_count++;
+}
+
+void seal_freed_blocks(){
+    for (int i = freed_sealed; i < freed_count; i++){
+        freed_block_map[freed_blocks[i] / 64] |= (uint64_t)1 << (freed_blocks[i] % 64);
+        mark_free_bit_map_dirty(freed_blocks[i]);
+    }
+    freed_sealed = freed_count;
+}
+
+void release_sealed_blocks(){
+    if (freed_sealed == 0){
+        return;
+    }
+    for (int i = 0; i < freed_sealed; i++){
+        freed_block_map[freed_blocks[i] / 64] &= ~((uint64_t)1 << (freed_blocks[i] % 64));
+        set_block_free(freed_blocks[i]);
+    }
+    memmove(freed_blocks, freed_blocks + freed_sealed, sizeof(int) * (freed_count - freed_sealed));
+    freed_count = freed_count - freed_sealed;
+    freed_sealed = 0;
+}
+
+//1 if a sealed block has an image in the journal log since its last checkpoint (takes allocator_lock)
+int sealed_blocks_logged(){
+    int logged = 0;
+    pthread_mutex_lock(&allocator_lock);
+    for (int i = 0; i < freed_sealed && logged == 0; i++){
+        logged = journal_logged(freed_blocks[i]);
+    }
+    pthread_mutex_unlock(&allocator_lock);
+    return logged;
+}
+
+//Counting the free blocks of a free bitmap read from the disk, and the ones among them a snapshot still uses
+void count_free_blocks(){
+    free_block_count = 0;
+    snapshot_held_blocks = 0;
+    for (int i = 0; i < FREE_BIT_MAP_WORDS; i++){
+        free_block_count = free_block_count + __builtin_popcountll(free_bit_map[i]);
+        if (snapshot_active == 1){
+            snapshot_held_blocks = snapshot_held_blocks + __builtin_popcountll(free_bit_map[i] & snapshot_bit_map[i]);
+        }
+    }
+}
+
+//============================================EXTENT ALLOCATOR==============================================
+
+//Blocks of word `word` of free_bit_map that can be handed out: the free ones a snapshot does not use (the caller holds allocator_lock)
+uint64_t allocatable_bits(int word){
+    if (snapshot_active == 1){
+        return free_bit_map[word] & ~snapshot_bit_map[word];
+    }
+    return free_bit_map[word];
+}
+
+//Finding the first free block at or after `block`, -1 if there is none
+int find_free_block(int block){
+    if (block >= MAX_BLOCK){
+        return -1;
+    }
+
+    //Ignoring the blocks of the first word that come before `block`
+    int word = block / 64;
+    uint64_t bits = allocatable_bits(word) & (~(uint64_t)0 << (block % 64));
+
+    //Skipping fully used words 64 blocks at a time
+    while (bits == 0){
+        word++;
+        if (word >= FREE_BIT_MAP_WORDS){
+            return -1;
+        }
+        bits = allocatable_bits(word);
+    }
+    return word * 64 + __builtin_ctzll(bits);
+}
+
+//Counting how many free blocks follow each other starting at `block` (stops at max_length)
+int count_free_run(int block, int max_length){
+    int length = 0;
+
+    while (length < max_length && block + length < MAX_BLOCK){
+        int current = block + length;
+        uint64_t bits = allocatable_bits(current / 64) >> (current % 64);
+
+        //Number of consecutive free blocks from `current` to the end of its word
+        int free_in_word = (~bits == 0) ? 64 : __builtin_ctzll(~bits);
+        length = length + free_in_word;
+
+        //Case where the run stops inside this word
+        if (free_in_word < 64 - (current % 64)){
+            break;
+        }
+    }
+
+    if (length > max_length){
+        length = max_length;
+    }
+    return length;
+}
+
+/*
+Allocating up to `wanted` contiguous blocks. The run starts at `goal` when that block is free, so a file keeps growing in place.
+Otherwise the first run of `wanted` free blocks after the next-fit cursor is used, or the longest run on the disk if none is long enough.
+The number of blocks obtained is stored in `allocated`. Returns the first block of the run, -1 if the disk is full.
+*/
+int allocate_extent(int goal, int wanted, int *allocated){
+    int best_start = -1; 
+    int best_length = 0; 
+
+    pthread_mutex_lock(&allocator_lock);
+
+    //Blocks reserved for write buffers are left alone, except the ones the calling thread is writing a buffer back with
+    int available = free_block_count - snapshot_held_blocks - reserved_blocks + reservation_allowance;
+    if (wanted > available){
+        wanted = available;
+    }
+    if (wanted <= 0){
+        pthread_mutex_unlock(&allocator_lock);
+        *allocated = 0;
+        return -1;
+    }
+
+    //Case where the block right after the previous one is free
+    if (goal >= 0 && goal < MAX_BLOCK){
+        best_length = count_free_run(goal, wanted);
+        if (best_length > 0){
+            best_start = goal;
+        }
+    }
+
+    //Scanning from the cursor to the end of the disk, then from the start of the disk to the cursor
+    int cursor_block = free_bit_map_cursor * 64;
+    for (int pass = 0; pass < 2 && best_length < wanted; pass++){
+        int block = (pass == 0) ? cursor_block : 0;
+        int limit = (pass == 0) ? MAX_BLOCK : cursor_block;
+
+        while (best_length < wanted){
+            block = find_free_block(block);
+            if (block == -1 || block >= limit){
+                break;
+            }
+
+            int length = count_free_run(block, wanted);
+            if (length > best_length){
+                best_start = block;
+                best_length = length;
+            }
+            block = block + length;
+        }
+    }
+
+    //Case where the disk is full
+    if (best_start == -1){
+        pthread_mutex_unlock(&allocator_lock);
+        *allocated = 0;
+        return -1;
+    }
+
+    for (int i = 0; i < best_length; i++){
+        set_block_used(best_start + i);
+    }
+
+    //Next search starts right after this run
+    free_bit_map_cursor = (best_start + best_length) / 64;
+    if (free_bit_map_cursor * 64 >= MAX_BLOCK){
+        free_bit_map_cursor = 0;
+    }
+
+    //Blocks taken from the calling thread's reservation are no longer set aside
+    int from_reservation = best_length < reservation_allowance ? best_length : reservation_allowance;
+    reservation_allowance = reservation_allowance - from_reservation;
+    reserved_blocks = reserved_blocks - from_reservation;
+
+    pthread_mutex_unlock(&allocator_lock);
+    *allocated = best_length;
+    return best_start;
+}
+
+//Giving a run of blocks back to the free bitmap once the next commit is on the disk, a block shared with other files only loses one of its references
+void release_blocks(int start, int count){
+    pthread_mutex_lock(&allocator_lock);
+    for (int i = start; i < start + count; i++){
+        if (reference_counts[i] > 0){
+            reference_counts[i]--;
+            mark_reference_count_dirty(i);
+        }
+        else{
+            defer_block_free(i);
+        }
+    }
+    pthread_mutex_unlock(&allocator_lock);
+}
+
+//Adding a reference to each block of a run (a clone now uses it too), -1 without changing anything if a block has too many
+int add_block_references(int start, int count){
+    pthread_mutex_lock(&allocator_lock);
+    for (int i = start; i < start + count; i++){
+        if (reference_counts[i] == UINT16_MAX){
+            pthread_mutex_unlock(&allocator_lock);
+            return -1;
+        }
+    }
+    for (int i = start; i < start + count; i++){
+        reference_counts[i]++;
+        mark_reference_count_dirty(i);
+    }
+    pthread_mutex_unlock(&allocator_lock);
+    return 0;
+}
+
+//Whether another file or the snapshot uses the block too
+int block_is_shared(int block){
+    pthread_mutex_lock(&allocator_lock);
+    int shared = reference_counts[block] > 0 || snapshot_uses_block(block);
+    pthread_mutex_unlock(&allocator_lock);
+    return shared;
+}
+
+//Allocating one free disk block, -1 if the disk is full
+int allocate_block(){
+    int allocated;
+    return allocate_extent(-1, 1, &allocated);
+}
+
+//Setting `count` free blocks aside for a write buffer, -1 if the disk does not have that many left
+int reserve_blocks(int count){
+    pthread_mutex_lock(&allocator_lock);
+    if (free_block_count - snapshot_held_blocks - reserved_blocks < count){
+        pthread_mutex_unlock(&allocator_lock);
+        return -1;
+    }
+    reserved_blocks = reserved_blocks + count;
+    pthread_mutex_unlock(&allocator_lock);
+    return 0;
+}
+
+void unreserve_blocks(int count){
+    pthread_mutex_lock(&allocator_lock);
+    reserved_blocks = reserved_blocks - count;
+    pthread_mutex_unlock(&allocator_lock);
+}
+
+//=============================================SNAPSHOT COPIES==============================================
+
+/*
+The snapshot's blocks stay where they are: a write gives a file new data blocks instead of changing them (see unshare_file_blocks).
+Metadata blocks have a fixed place though, so the first time one of them goes to the journal after the snapshot, what it held is
+copied to one of the blocks sfs_snapshot() set aside. The copy is written before the transaction that changes the block, and the
+block of the snapshot table that records it goes into the journal ahead of the new content, so a crash never loses either one.
+snapshot_copies finds the copy of a block without going through the table.
+*/
+char *snapshot_table = NULL; //SNAPSHOT_TABLE_BLOCKS blocks, a struct snapshot_header followed by its pairs
+int snapshot_next_copy = 0; //First pair of the table whose copy is not used yet
+uint32_t *snapshot_copies = NULL; //Open addressing table of (disk block, block holding its copy) pairs, -1 == empty slot
+int snapshot_copy_size = 0; //Pairs the table has room for
+int snapshot_copy_count = 0;
+__thread int writing_snapshot_copies = 0; //1 == the calling thread is writing a copy, which is not checked by the write hook
+
+//Slot of snapshot_copies that holds the copy of `block`, or the empty slot where it would go (the caller holds snapshot_lock)
+int snapshot_copy_slot(int block){
+    unsigned int slot = ((unsigned int)block * 2654435761u) & (snapshot_copy_size - 1);
+    while (snapshot_copies[2 * slot] != (uint32_t)-1 && snapshot_copies[2 * slot] != (uint32_t)block){
+        slot = (slot + 1) & (snapshot_copy_size - 1);
+    }
+    return (int)slot;
+}
+
+//Block holding the snapshot's copy of `block`, -1 if it has none (the caller holds snapshot_lock)
+int find_snapshot_copy(int block){
+    if (snapshot_copy_count == 0){
+        return -1;
+    }
+    return (int)snapshot_copies[2 * snapshot_copy_slot(block) + 1];
+}
+
+//Recording that `copy` holds the snapshot's copy of `block`, the table doubles once it is half full (the caller holds snapshot_lock)
+void add_snapshot_copy(int block, int copy){
+    if (2 * (snapshot_copy_count + 1) > snapshot_copy_size){
+        uint32_t *old_copies = snapshot_copies;
+        int old_size = snapshot_copy_size;
+        snapshot_copy_size = old_size == 0 ? 64 : old_size * 2;
+        snapshot_copies = (uint32_t*)malloc(sizeof(uint32_t) * 2 * snapshot_copy_size);
+        memset(snapshot_copies, 0xFF, sizeof(uint32_t) * 2 * snapshot_copy_size);
+        for (int i = 0; i < old_size; i++){
+            if (old_copies[2 * i] != (uint32_t)-1){
+                int slot = snapshot_copy_slot((int)old_copies[2 * i]);
+                snapshot_copies[2 * slot] = old_copies[2 * i];
+                snapshot_copies[2 * slot + 1] = old_copies[2 * i + 1];
+            }
+        }
+        free(old_copies);
+    }
+    int slot = snapshot_copy_slot(block);
+    snapshot_copies[2 * slot] = (uint32_t)block;
+    snapshot_copies[2 * slot + 1] = (uint32_t)copy;
+    snapshot_copy_count++;
+}
+
+//Whether `block` still holds what the snapshot has in it, so it must not be overwritten (the caller holds snapshot_lock)
+int snapshot_shares_block(int block){
+    return snapshot_uses_block(block) && find_snapshot_copy(block) == -1;
+}
+
+//Putting block `block` of the snapshot table into the journal (the caller holds snapshot_table_lock)
+void journal_snapshot_table(int block){
+    char block_data[BLOCK_SIZE];
+    pthread_mutex_lock(&snapshot_lock);
+    memcpy(block_data, snapshot_table + (long)block * BLOCK_SIZE, BLOCK_SIZE);
+    pthread_mutex_unlock(&snapshot_lock);
+    journal_add_block(SNAPSHOT_TABLE_START + block, (void *)block_data);
+}
+
+//Block of the snapshot table that holds pair `pair`
+int snapshot_pair_block(int pair){
+    return (int)((sizeof(struct snapshot_header) + (long)pair * 2 * sizeof(uint32_t)) / BLOCK_SIZE);
+}
+
+/*
+Writing what `block` holds to the next block sfs_snapshot() set aside for copies if the snapshot still shares it, then putting the
+pair that records it into the journal (the caller holds snapshot_table_lock). sfs_snapshot() sets aside a block for every
+metadata block the snapshot could have to copy, so there is always one left (the write hook refuses the write otherwise).
+*/
+void copy_snapshot_block(int block){
+    if (__atomic_load_n(&snapshot_active, __ATOMIC_ACQUIRE) == 0){
+        return;
+    }
+    pthread_mutex_lock(&snapshot_lock);
+    struct snapshot_header *header = (struct snapshot_header *)snapshot_table;
+    int pair = snapshot_next_copy;
+    if (snapshot_shares_block(block) == 0 || pair == (int)header->copy_count){
+        pthread_mutex_unlock(&snapshot_lock);
+        return;
+    }
+    char block_data[BLOCK_SIZE];
+    int copy = (int)header->copies[2 * pair + 1];
+    cache_read_blocks(block, 1, (void *)block_data);
+    writing_snapshot_copies = 1;
+    cache_write_blocks(copy, 1, (void *)block_data);
+    writing_snapshot_copies = 0;
+    header->copies[2 * pair] = (uint32_t)block;
+    add_snapshot_copy(block, copy);
+    snapshot_next_copy++;
+    pthread_mutex_unlock(&snapshot_lock);
+    journal_snapshot_table(snapshot_pair_block(pair));
+}
+
+/*
+Metadata blocks go to the journal through here, so the copy the snapshot needs is written first and the pair that records it is
+in the journal ahead of the new content (a commit writes the copy before the transaction, see sfs_journal.c)
+*/
+void journal_metadata_block(int block, void *buffer){
+    pthread_mutex_lock(&snapshot_table_lock);
+    copy_snapshot_block(block);
+    journal_add_block(block, buffer);
+    pthread_mutex_unlock(&snapshot_table_lock);
+}
+
+//Write hook of the cache: -1 (the write is refused) if the run has a block that still holds what the snapshot has in it
+int check_snapshot_write(int start_address, int nblocks){
+    if (__atomic_load_n(&snapshot_active, __ATOMIC_ACQUIRE) == 0 || writing_snapshot_copies == 1){
+        return 0;
+    }
+    int result = 0;
+    pthread_mutex_lock(&snapshot_lock);
+    for (int block = start_address; block < start_address + nblocks && block < MAX_BLOCK && result == 0; block++){
+        if (snapshot_shares_block(block) == 1){
+            result = -1;
+        }
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+    return result;
+}
+
+//================================================BLOCK MAP=================================================
+
+void init_i_node(struct i_node *node, int flags){
+    node->file_size = 0;
+    node->flags = flags;
+
+    //Extent slots with a length of 0 are unused
+    memset(&node->map, 0, sizeof(node->map));
+
+    //Setting the pointers (direct and indirect) to -1 to show that they're unused
+    if ((flags & (I_NODE_FLAG_EXTENTS | I_NODE_FLAG_INLINE)) == 0){
+        for (int i = 0; i < 12; i++){
+            node->map.pointers.direct_pointer[i] = -1;
+        }
+        node->map.pointers.indirect_pointer = -1;
+        node->map.pointers.double_indirect_pointer = -1;
+        node->map.pointers.triple_indirect_pointer = -1;
+    }
+}
+
+/*
+Pointer blocks met on the way down the indirect pointer trees, one per depth (0 == the block a root pointer of the i-node points to).
+A walk over neighbouring blocks of the file finds the interior blocks it needs already here instead of reading them again,
+and a changed pointer block is only written back when the walk moves to another block at its depth or is released.
+*/
+struct pointer_path{
+    int block[3]; //Pointer block held at each depth, -1 == none
+    char dirty[3]; //1 == the held block changed since it was loaded
+    uint32_t *entries[3]; //POINTERS_PER_BLOCK pointers per depth
+    pthread_mutex_t lock; //Held during a walk, readers of one file share its block map
+};
+
+void path_init(struct pointer_path *path){
+    uint32_t *data = (uint32_t*)malloc((long)3 * BLOCK_SIZE);
+    for (int depth = 0; depth < 3; depth++){
+        path->block[depth] = -1;
+        path->dirty[depth] = 0;
+        path->entries[depth] = data + (long)depth * POINTERS_PER_BLOCK;
+    }
+    pthread_mutex_init(&path->lock, NULL);
+}
+
+//Flagging (or clearing) the block held at `depth`, a changed pointer block counts towards the running transaction
+void path_set_dirty(struct pointer_path *path, int depth, int dirty){
+    if (path->dirty[depth] == dirty){
+        return;
+    }
+    path->dirty[depth] = dirty;
+    __atomic_add_fetch(&dirty_pointer_blocks, dirty == 1 ? 1 : -1, __ATOMIC_RELAXED);
+    if (dirty == 1){
+        pthread_mutex_lock(&metadata_lock);
+        check_transaction_size_locked();
+        pthread_mutex_unlock(&metadata_lock);
+    }
+}
+
+//Pointer blocks are metadata, they go through the journal like the i-node table
+void path_write_back(struct pointer_path *path, int depth){
+    if (path->dirty[depth] == 1){
+        journal_metadata_block(path->block[depth], (void *)path->entries[depth]);
+        path_set_dirty(path, depth, 0);
+    }
+}
+
+//Reading a pointer block, the running journal transaction may hold a newer copy than its home block
+void read_pointer_block(int block, uint32_t *entries){
+    if (journal_read_block(block, (void *)entries) != 0){
+        cache_read_blocks(block, 1, (void *)entries);
+    }
+}
+
+void path_release(struct pointer_path *path){
+    for (int depth = 0; depth < 3; depth++){
+        path_write_back(path, depth);
+    }
+    free(path->entries[0]);
+    pthread_mutex_destroy(&path->lock);
+}
+
+/*
+Block map cache: every i-node that had its pointer trees walked keeps its pointer_path, so the pointer blocks it uses stay
+in memory for as long as the file is open. Changed pointer blocks only go to the journal when the walk moves on to
+another pointer block, when the file is closed or removed, and on every commit.
+*/
+struct pointer_path **block_maps = NULL; //One per i-node, NULL == none
+int block_map_count = 0;
+pthread_mutex_t block_map_lock = PTHREAD_MUTEX_INITIALIZER; //Creating and dropping block maps
+
+//Getting the block map of an i-node, making it on the first walk (the caller holds the i-node's lock)
+struct pointer_path *get_block_map(int i_node){
+    pthread_mutex_lock(&block_map_lock);
+    if (block_maps[i_node] == NULL){
+        block_maps[i_node] = (struct pointer_path*)malloc(sizeof(struct pointer_path));
+        path_init(block_maps[i_node]);
+    }
+    struct pointer_path *path = block_maps[i_node];
+    pthread_mutex_unlock(&block_map_lock);
+    return path;
+}
+
+//Writing back and forgetting the block map of an i-node (the caller holds the i-node's lock for writing)
+void drop_block_map(int i_node){
+    pthread_mutex_lock(&block_map_lock);
+    if (block_maps[i_node] != NULL){
+        path_release(block_maps[i_node]);
+        free(block_maps[i_node]);
+        block_maps[i_node] = NULL;
+    }
+    pthread_mutex_unlock(&block_map_lock);
+}
+
+//Writing every changed pointer block of the block maps to the journal
+void write_back_block_maps(){
+    pthread_mutex_lock(&block_map_lock);
+    for (int i = 0; i < block_map_count; i++){
+        if (block_maps[i] != NULL){
+            pthread_mutex_lock(&block_maps[i]->lock);
+            for (int depth = 0; depth < 3; depth++){
+                path_write_back(block_maps[i], depth);
+            }
+            pthread_mutex_unlock(&block_maps[i]->lock);
+        }
+    }
+    pthread_mutex_unlock(&block_map_lock);
+}
+
+//Making room for the block maps of the mounted disk, dropping the ones of the previous mount
+void reset_block_maps(){
+    for (int i = 0; i < block_map_count; i++){
+        if (block_maps[i] != NULL){
+            path_release(block_maps[i]);
+            free(block_maps[i]);
+        }
+    }
+    block_map_count = I_NODE_COUNT;
+    block_maps = (struct pointer_path**)realloc(block_maps, sizeof(struct pointer_path*) * block_map_count);
+    for (int i = 0; i < block_map_count; i++){
+        block_maps[i] = NULL;
+    }
+}
+
+//Getting the pointers of pointer block `block` at `depth` of the path
+uint32_t *path_load(struct pointer_path *path, int depth, int block){
+    if (path->block[depth] != block){
+        path_write_back(path, depth);
+        read_pointer_block(block, path->entries[depth]);
+        path->block[depth] = block;
+    }
+    return path->entries[depth];
+}
+
+//Making a new, empty pointer block the one held at `depth` (unused pointers are -1)
+void path_create(struct pointer_path *path, int depth, int block){
+    path_write_back(path, depth);
+    memset(path->entries[depth], 0xFF, BLOCK_SIZE);
+    path->block[depth] = block;
+    path_set_dirty(path, depth, 1);
+}
+
+/*
+Finding which root pointer of the i-node leads to block `file_block` (>= 12) of the file, how many levels of pointer blocks
+hang below that root, and the block's index among the ones that root covers. Returns NULL past the largest pointer file.
+*/
+uint32_t *pointer_root(struct i_node *node, int file_block, int *levels, long long *index){
+    long long block = file_block - 12;
+    long long covered = POINTERS_PER_BLOCK;
+
+    uint32_t *roots[3] = {&node->map.pointers.indirect_pointer, &node->map.pointers.double_indirect_pointer, &node->map.pointers.triple_indirect_pointer};
+    for (int level = 0; level < 3; level++){
+        if (block < covered){
+            *levels = level + 1;
+            *index = block;
+            return roots[level];
+        }
+        block = block - covered;
+        covered = covered * POINTERS_PER_BLOCK;
+    }
+    return NULL;
+}
+
+//Slot of the pointer block at `depth` (of `levels`) that leads to block `index` below a root
+int pointer_slot(long long index, int depth, int levels){
+    for (int i = depth + 1; i < levels; i++){
+        index = index / POINTERS_PER_BLOCK;
+    }
+    return (int)(index % POINTERS_PER_BLOCK);
+}
+
+//Disk block that holds block `file_block` of a pointer i-node, -1 if it is not allocated
+uint32_t lookup_pointer(struct i_node *node, int file_block, struct pointer_path *path){
+    if (file_block < 12){
+        return node->map.pointers.direct_pointer[file_block];
+    }
+
+    int levels;
+    long long index;
+    uint32_t *root = pointer_root(node, file_block, &levels, &index);
+    if (root == NULL){
+        return -1;
+    }
+
+    uint32_t block = *root;
+    for (int depth = 0; depth < levels && block != -1; depth++){
+        block = path_load(path, depth, block)[pointer_slot(index, depth, levels)];
+    }
+    return block;
+}
+
+//A pointer block allocated by set_pointer(), at `depth` on the way to block `file_block` of the file
+struct new_pointer_block{
+    int block;
+    int file_block;
+    int depth;
+};
+
+//Pointer blocks allocated while a block map changes, so a change that fails can give them back (see undo_pointer_blocks)
+struct pointer_undo{
+    struct new_pointer_block *blocks;
+    int count;
+    int capacity;
+};
+
+void record_pointer_block(struct pointer_undo *undo, int block, int file_block, int depth){
+    if (undo == NULL){
+        return;
+    }
+    if (undo->count == undo->capacity){
+        undo->capacity = undo->capacity == 0 ? 8 : undo->capacity * 2;
+        undo->blocks = (struct new_pointer_block*)realloc(undo->blocks, sizeof(struct new_pointer_block) * undo->capacity);
+    }
+    undo->blocks[undo->count].block = block;
+    undo->blocks[undo->count].file_block = file_block;
+    undo->blocks[undo->count].depth = depth;
+    undo->count++;
+}
+
+/*
+Storing `disk_block` as block `file_block` of a pointer i-node, allocating the missing pointer blocks on the way (they are added
+to `undo` unless it is NULL). -1 if the disk is full.
+*/
+int set_pointer(struct i_node *node, int file_block, uint32_t disk_block, struct pointer_path *path, struct pointer_undo *undo){
+    if (file_block < 12){
+        node->map.pointers.direct_pointer[file_block] = disk_block;
+        return 0;
+    }
+
+    int levels;
+    long long index;
+    uint32_t *root = pointer_root(node, file_block, &levels, &index);
+    if (root == NULL){
+        return -1;
+    }
+
+    //Case where the tree below this root does not exist yet
+    if (*root == -1){
+        int new_block = allocate_block();
+        if (new_block == -1){
+            return -1;
+        }
+        *root = new_block;
+        path_create(path, 0, new_block);
+        record_pointer_block(undo, new_block, file_block, 0);
+    }
+
+    uint32_t block = *root;
+    for (int depth = 0; depth < levels; depth++){
+        uint32_t *entries = path_load(path, depth, block);
+        int slot = pointer_slot(index, depth, levels);
+
+        //Case where this is the last level: the slot holds the data block itself
+        if (depth == levels - 1){
+            entries[slot] = disk_block;
+            path_set_dirty(path, depth, 1);
+            return 0;
+        }
+
+        //Case where the pointer block of the next level is missing
+        if (entries[slot] == -1){
+            int new_block = allocate_block();
+            if (new_block == -1){
+                return -1;
+            }
+            entries[slot] = new_block;
+            path_set_dirty(path, depth, 1);
+            path_create(path, depth + 1, new_block);
+            record_pointer_block(undo, new_block, file_block, depth + 1);
+        }
+        block = entries[slot];
+    }
+    return 0;
+}
+
+/*
+Finding the disk block that holds block `file_block` of the file. `run_length` gets how many blocks of the file (at most max_length)
+are stored one after the other on the disk starting there, so they can be read or written in a single call.
+Returns -1 if the block is not allocated, `run_length` is then the number of unallocated blocks in a row.
+*/
+int get_block_run(struct i_node *node, int file_block, int max_length, int *run_length){
+
+    //Case where the data is in the i-node, the file has no blocks
+    if (node->flags & I_NODE_FLAG_INLINE){
+        *run_length = max_length;
+        return -1;
+    }
+
+    //Case where the i-node describes its blocks with extents (sorted by file block, used slots first)
+    if (node->flags & I_NODE_FLAG_EXTENTS){
+        for (int i = 0; i < I_NODE_EXTENTS; i++){
+            struct extent *current = &node->map.extents[i];
+            if (current->length == 0){
+                break;
+            }
+
+            //Block falls inside this extent
+            if (file_block >= current->file_block && file_block < current->file_block + current->length){
+                int offset = file_block - current->file_block;
+                *run_length = current->length - offset;
+                if (*run_length > max_length){
+                    *run_length = max_length;
+                }
+                return current->disk_block + offset;
+            }
+
+            //Block falls in the gap before this extent
+            if (current->file_block > file_block){
+                *run_length = current->file_block - file_block;
+                if (*run_length > max_length){
+                    *run_length = max_length;
+                }
+                return -1;
+            }
+        }
+        *run_length = max_length;
+        return -1;
+    }
+
+    //Case where the i-node uses 12 direct pointers and the indirect pointer trees (walked through the i-node's block map)
+    struct pointer_path *path = get_block_map(node - i_node_table);
+    uint32_t first_pointer = -1;
+    int length = 0;
+
+    pthread_mutex_lock(&path->lock);
+    while (length < max_length){
+        uint32_t pointer = lookup_pointer(node, file_block + length, path);
+
+        //Run continues while the blocks stay unallocated or stay physically contiguous
+        if (length == 0){
+            first_pointer = pointer;
+        }
+        else if (first_pointer == -1 && pointer != -1){
+            break;
+        }
+        else if (first_pointer != -1 && pointer != first_pointer + length){
+            break;
+        }
+        length++;
+    }
+    pthread_mutex_unlock(&path->lock);
+
+    *run_length = length;
+    return (int)first_pointer;
+}
+
+/*
+Freeing the pointer blocks of `undo` from the `first` one on, newest first, and dropping them from the path (the caller holds its lock).
+With `detach`, the pointer to each one is cleared first. Their own pointers must all be -1 by then.
+*/
+void undo_pointer_blocks(struct i_node *node, struct pointer_path *path, struct pointer_undo *undo, int first, int detach){
+    for (int i = undo->count - 1; i >= first; i--){
+        struct new_pointer_block *created = &undo->blocks[i];
+
+        if (detach){
+            int levels;
+            long long index;
+            uint32_t *root = pointer_root(node, created->file_block, &levels, &index);
+            if (created->depth == 0){
+                *root = -1;
+            }
+            else{
+                uint32_t block = *root;
+                for (int depth = 0; depth < created->depth - 1; depth++){
+                    block = path_load(path, depth, block)[pointer_slot(index, depth, levels)];
+                }
+                path_load(path, created->depth - 1, block)[pointer_slot(index, created->depth - 1, levels)] = -1;
+                path_set_dirty(path, created->depth - 1, 1);
+            }
+        }
+
+        //The path must not write the block back once it is free
+        for (int depth = 0; depth < 3; depth++){
+            if (path->block[depth] == created->block){
+                path_set_dirty(path, depth, 0);
+                path->block[depth] = -1;
+            }
+        }
+        release_blocks(created->block, 1);
+    }
+    undo->count = first;
+}
+
+/*
+Storing `count` blocks of the file starting at `file_block` in the disk blocks starting at `disk_block` (pointer i-nodes). The
+pointer blocks allocated on the way are added to `undo` unless it is NULL. On failure, nothing of the run is left mapped, and
+the pointer blocks this call allocated are freed again.
+*/
+int map_pointer_blocks(int i_node, int file_block, int disk_block, int count, struct pointer_undo *undo){
+    struct i_node *node = &i_node_table[i_node];
+
+    //Case where the file would outgrow the triple indirect tree
+    if (file_block + count > MAX_POINTER_BLOCKS){
+        return -1;
+    }
+
+    struct pointer_undo local_undo = {NULL, 0, 0};
+    if (undo == NULL){
+        undo = &local_undo;
+    }
+    int first_new = undo->count;
+
+    //Changed pointer blocks stay in the i-node's block map, they are written back when the map moves on or is flushed
+    struct pointer_path *path = get_block_map(i_node);
+    pthread_mutex_lock(&path->lock);
+    int result = 0;
+    for (int i = 0; i < count; i++){
+
+        //Case where a pointer block could not be allocated, unmapping the part of the run already stored
+        if (set_pointer(node, file_block + i, disk_block + i, path, undo) != 0){
+            for (int j = 0; j < i; j++){
+                set_pointer(node, file_block + j, -1, path, NULL);
+            }
+            undo_pointer_blocks(node, path, undo, first_new, 1);
+            result = -1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&path->lock);
+    free(local_undo.blocks);
+    return result;
+}
+
+//Adding a run of blocks to an extent i-node, -1 if every extent slot is taken
+int add_extent(struct i_node *node, int file_block, int disk_block, int count){
+    int used = 0;
+
+    //Case where the run continues an existing extent both in the file and on the disk
+    for (int i = 0; i < I_NODE_EXTENTS && node->map.extents[i].length != 0; i++){
+        struct extent *current = &node->map.extents[i];
+        if (current->file_block + current->length == file_block && current->disk_block + current->length == disk_block){
+            current->length = current->length + count;
+            return 0;
+        }
+        used++;
+    }
+
+    if (used == I_NODE_EXTENTS){
+        return -1;
+    }
+
+    //Keeping the extents sorted by file block
+    int position = used;
+    while (position > 0 && node->map.extents[position - 1].file_block > file_block){
+        node->map.extents[position] = node->map.extents[position - 1];
+        position--;
+    }
+    node->map.extents[position].file_block = file_block;
+    node->map.extents[position].disk_block = disk_block;
+    node->map.extents[position].length = count;
+    return 0;
+}
+
+//Switching an extent i-node whose extent slots are all taken to direct/indirect pointers
+int convert_to_pointers(int i_node){
+    struct i_node *node = &i_node_table[i_node];
+    struct extent extents[I_NODE_EXTENTS];
+    memcpy(extents, node->map.extents, sizeof(extents));
+
+    //Every mapped block must fit within the direct pointers and the indirect pointer trees
+    for (int i = 0; i < I_NODE_EXTENTS; i++){
+        if (extents[i].length != 0 && extents[i].file_block + extents[i].length > MAX_POINTER_BLOCKS){
+            return -1;
+        }
+    }
+
+    uint32_t file_size = node->file_size;
+    uint32_t flags = node->flags;
+    init_i_node(node, flags & ~I_NODE_FLAG_EXTENTS);
+    node->file_size = file_size;
+
+    struct pointer_undo undo = {NULL, 0, 0};
+    for (int i = 0; i < I_NODE_EXTENTS; i++){
+        if (extents[i].length == 0){
+            continue;
+        }
+
+        //Case where the indirect pointer block could not be allocated, going back to the extents and freeing the pointer blocks
+        if (map_pointer_blocks(i_node, extents[i].file_block, extents[i].disk_block, extents[i].length, &undo) != 0){
+            node->flags = flags;
+            memcpy(node->map.extents, extents, sizeof(extents));
+            struct pointer_path *path = get_block_map(i_node);
+            pthread_mutex_lock(&path->lock);
+            undo_pointer_blocks(node, path, &undo, 0, 0);
+            pthread_mutex_unlock(&path->lock);
+            free(undo.blocks);
+            return -1;
+        }
+    }
+    free(undo.blocks);
+    return 0;
+}
+
+//Recording that `count` blocks of the file starting at `file_block` live in the disk blocks starting at `disk_block`
+int map_file_blocks(int i_node, int file_block, int disk_block, int count){
+    struct i_node *node = &i_node_table[i_node];
+
+    if (node->flags & I_NODE_FLAG_EXTENTS){
+        if (add_extent(node, file_block, disk_block, count) == 0){
+            mark_i_node_dirty(i_node);
+            return 0;
+        }
+
+        //Case where the extents are all used up, the file falls back to block pointers
+        if (convert_to_pointers(i_node) != 0){
+            return -1;
+        }
+    }
+
+    if (map_pointer_blocks(i_node, file_block, disk_block, count, NULL) != 0){
+        return -1;
+    }
+    mark_i_node_dirty(i_node);
+    return 0;
+}
+
+/*
+Making sure blocks [first_block, last_block] of the file are allocated. Each missing run is requested from the extent allocator
+as a whole, right after the block that precedes it when possible. Returns the number of blocks from first_block that are allocated,
+less than requested when the disk (or the block map) is full.
+*/
+int allocate_file_blocks(int i_node, int first_block, int last_block){
+    struct i_node *node = &i_node_table[i_node];
+    int file_block = first_block;
+
+    while (file_block <= last_block){
+        int run_length;
+        int disk_block = get_block_run(node, file_block, last_block - file_block + 1, &run_length);
+
+        //Case where this part of the file is already allocated
+        if (disk_block != -1){
+            file_block = file_block + run_length;
+            continue;
+        }
+
+        //Trying to place the new run right after the previous block of the file
+        int goal = -1;
+        if (file_block > 0){
+            int previous_length;
+            int previous_block = get_block_run(node, file_block - 1, 1, &previous_length);
+            if (previous_block != -1){
+                goal = previous_block + 1;
+            }
+        }
+
+        int allocated;
+        int start = allocate_extent(goal, run_length, &allocated);
+        if (start == -1){
+            break;
+        }
+
+        //Case where the block map cannot take the run, giving the blocks back
+        if (map_file_blocks(i_node, file_block, start, allocated) != 0){
+            release_blocks(start, allocated);
+            break;
+        }
+        file_block = file_block + allocated;
+    }
+
+    return file_block - first_block;
+}
+
+//Freeing a pointer block with `levels` levels of blocks below it (the last level being data blocks)
+void free_pointer_tree(uint32_t block, int levels){
+    if (block == -1){
+        return;
+    }
+
+    uint32_t *entries = (uint32_t*)malloc(BLOCK_SIZE);
+    read_pointer_block(block, entries);
+    for (int i = 0; i < POINTERS_PER_BLOCK; i++){
+        if (entries[i] == -1){
+            continue;
+        }
+        if (levels > 1){
+            free_pointer_tree(entries[i], levels - 1);
+        }
+        else{
+            release_blocks(entries[i], 1);
+        }
+    }
+    free(entries);
+
+    //Clearing the slot in the FBM for the pointer block itself
+    release_blocks(block, 1);
+}
+
+//Giving every block used by the file (data and indirect pointer blocks) back to the free bitmap
+void free_file_blocks(int i_node){
+    struct i_node *node = &i_node_table[i_node];
+
+    if (node->flags & I_NODE_FLAG_INLINE){
+        return;
+    }
+
+    if (node->flags & I_NODE_FLAG_EXTENTS){
+        for (int i = 0; i < I_NODE_EXTENTS; i++){
+            release_blocks(node->map.extents[i].disk_block, node->map.extents[i].length);
+        }
+        return;
+    }
+
+    //Pointer blocks changed in the block map must be in the journal before the trees are read
+    drop_block_map(i_node);
+
+    //Freeing the blocks used for the direct pointers
+    for (int i = 0; i < 12; i++){
+        if (node->map.pointers.direct_pointer[i] != -1){
+            release_blocks(node->map.pointers.direct_pointer[i], 1);
+        }
+    }
+
+    //Going over the block numbers shown in the indirect pointer trees and "freeing" them in the FBM
+    free_pointer_tree(node->map.pointers.indirect_pointer, 1);
+    free_pointer_tree(node->map.pointers.double_indirect_pointer, 2);
+    free_pointer_tree(node->map.pointers.triple_indirect_pointer, 3);
+}
+
+//============================================DIRECTORY INDEX===============================================
+
+/*
+In-memory hash index over the directory_table, built when the file system is mounted and updated on every create/remove.
+It uses open addressing with linear probing: every slot holds the index of a used directory entry or -1, and the table is
+kept at most half full so a lookup only probes a few slots no matter how many files exist.
+*/
+int *directory_index = NULL;
+int directory_index_size = 0;
+int directory_index_count = 0;
+
+//FNV-1a hash of a filename
+uint32_t hash_filename(const char *name){
+    uint32_t hash = 2166136261u;
+    while (*name != '\0'){
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+        name++;
+    }
+    return hash;
+}
+
+//Placing a directory entry in the index without any size check
+void directory_index_place(int entry){
+    int slot = hash_filename(directory_table[entry].filename) & (directory_index_size - 1);
+    while (directory_index[slot] != -1){
+        slot = (slot + 1) & (directory_index_size - 1);
+    }
+    directory_index[slot] = entry;
+}
+
+//Creating an empty index with room for `capacity` slots (rounded up to a power of two)
+void directory_index_reset(int capacity){
+    directory_index_size = 16;
+    while (directory_index_size < capacity){
+        directory_index_size = directory_index_size * 2;
+    }
+    free(directory_index);
+    directory_index = (int*)malloc(sizeof(int) * directory_index_size);
+    for (int i = 0; i < directory_index_size; i++){
+        directory_index[i] = -1;
+    }
+    directory_index_count = 0;
+}
+
+void directory_index_insert(int entry){
+
+    //Doubling the table (and re-placing every entry) when it would become more than half full
+    if (2 * (directory_index_count + 1) > directory_index_size){
+        int *old_index = directory_index;
+        int old_size = directory_index_size;
+        directory_index = NULL;
+        directory_index_reset(old_size * 2);
+        for (int i = 0; i < old_size; i++){
+            if (old_index[i] != -1){
+                directory_index_place(old_index[i]);
+                directory_index_count++;
+            }
+        }
+        free(old_index);
+    }
+
+    directory_index_place(entry);
+    directory_index_count++;
+}
+
+//Finding the directory entry of a file, -1 if the file does not exist
+int directory_lookup(const char *name){
+    if (directory_index == NULL){
+        return -1;
+    }
+
+    int slot = hash_filename(name) & (directory_index_size - 1);
+    while (directory_index[slot] != -1){
+        if (strcmp(directory_table[directory_index[slot]].filename, name) == 0){
+            return directory_index[slot];
+        }
+        slot = (slot + 1) & (directory_index_size - 1);
+    }
+    return -1;
+}
+
+void directory_index_remove(int entry){
+    int slot = hash_filename(directory_table[entry].filename) & (directory_index_size - 1);
+    while (directory_index[slot] != entry){
+        if (directory_index[slot] == -1){
+            return;
+        }
+        slot = (slot + 1) & (directory_index_size - 1);
+    }
+
+    //Backward shift deletion: pulling back the entries of the probe chain that would otherwise become unreachable
+    int hole = slot;
+    slot = (slot + 1) & (directory_index_size - 1);
+    while (directory_index[slot] != -1){
+        int home = hash_filename(directory_table[directory_index[slot]].filename) & (directory_index_size - 1);
+
+        //Entry can move into the hole if its home slot is not between the hole and its current slot
+        if (((slot - home) & (directory_index_size - 1)) >= ((slot - hole) & (directory_index_size - 1))){
+            directory_index[hole] = directory_index[slot];
+            hole = slot;
+        }
+        slot = (slot + 1) & (directory_index_size - 1);
+    }
+    directory_index[hole] = -1;
+    directory_index_count--;
+}
+
+//Indexing every used entry of the directory_table
+void build_directory_index(){
+    directory_index_reset(2 * directory_table_length);
+    for (int i = 0; i < directory_table_length; i++){
+        if (directory_table[i].entry_used == '1'){
+            directory_index_insert(i);
+        }
+    }
+}
+
+//============================================DIRECTORY FILE================================================
+
+/*
+The directory is the data of the root i-node 0. It is an array of directory entries packed DIRECTORY_ENTRIES_PER_BLOCK to a block
+(entries never straddle two blocks) and it grows one block at a time when every entry slot is taken. The whole directory is
+mirrored in directory_table, directory_free_map has one bit per entry slot (1 == free) so a free slot is found 64 slots at a time.
+*/
+
+//Growing the in-memory directory to `slots` entry slots, the new slots start out free
+void resize_directory_table(int slots){
+    int old_slots = directory_table_length;
+    int words = (slots + 63) / 64;
+
+    directory_table = (struct directory_entry*)realloc(directory_table, sizeof(struct directory_entry) * (slots > 0 ? slots : 1));
+    directory_free_map = (uint64_t*)realloc(directory_free_map, sizeof(uint64_t) * (words > 0 ? words : 1));
+    resize_dirty_blocks(&directory_table_dirty, old_slots / DIRECTORY_ENTRIES_PER_BLOCK, slots / DIRECTORY_ENTRIES_PER_BLOCK);
+
+    for (int i = (old_slots + 63) / 64; i < words; i++){
+        directory_free_map[i] = 0;
+    }
+    for (int i = old_slots; i < slots; i++){
+        memset(&directory_table[i], 0, sizeof(struct directory_entry));
+        directory_table[i].entry_used = '0'; // 0 == free | 1 == used
+        directory_free_map[i / 64] |= (uint64_t)1 << (i % 64);
+    }
+    directory_table_length = slots;
+}
+
+//Adding one block to the end of the directory file, -1 if the disk is full
+int grow_directory(){
+    int new_block = directory_table_length / DIRECTORY_ENTRIES_PER_BLOCK;
+
+    if (allocate_file_blocks(ROOT_DIRECTORY_I_NODE, new_block, new_block) != 1){
+        return -1;
+    }
+    i_node_table[ROOT_DIRECTORY_I_NODE].file_size = (new_block + 1) * BLOCK_SIZE;
+    mark_i_node_dirty(ROOT_DIRECTORY_I_NODE);
+
+    resize_directory_table((new_block + 1) * DIRECTORY_ENTRIES_PER_BLOCK);
+
+    //New block has to be written even if no entry of it gets used
+    mark_directory_dirty(new_block * DIRECTORY_ENTRIES_PER_BLOCK);
+    return 0;
+}
+
+//Taking the lowest free entry slot of the directory (growing it if needed), -1 if the directory cannot grow
+int allocate_directory_entry(){
+    int words = (directory_table_length + 63) / 64;
+
+    for (int i = directory_free_hint; i < words; i++){
+        if (directory_free_map[i] != 0){
+            int entry = i * 64 + __builtin_ctzll(directory_free_map[i]);
+            directory_free_map[i] &= ~((uint64_t)1 << (entry % 64));
+            directory_free_hint = i;
+            return entry;
+        }
+    }
+
+    //Case where every slot is taken, the new slot comes from a new directory block
+    directory_free_hint = words;
+    int first_new_entry = directory_table_length;
+    if (grow_directory() != 0){
+        return -1;
+    }
+    directory_free_map[first_new_entry / 64] &= ~((uint64_t)1 << (first_new_entry % 64));
+    directory_free_hint = first_new_entry / 64;
+    return first_new_entry;
+}
+
+void free_directory_entry(int entry){
+    directory_table[entry].entry_used = '0'; // 0 == free | 1 == used
+    directory_free_map[entry / 64] |= (uint64_t)1 << (entry % 64);
+    if (entry / 64 < directory_free_hint){
+        directory_free_hint = entry / 64;
+    }
+    mark_directory_dirty(entry);
+}
+
+//Reading the whole directory file into directory_table (one read per physically contiguous run of directory blocks)
+void load_directory(){
+    struct i_node *root = &i_node_table[ROOT_DIRECTORY_I_NODE];
+    int directory_blocks = root->file_size / BLOCK_SIZE;
+
+    directory_table_length = 0;
+    directory_free_hint = 0;
+    directory_table_dirty.count = 0;
+    resize_directory_table(directory_blocks * DIRECTORY_ENTRIES_PER_BLOCK);
+
+    char *block_data = (char*)malloc((long)(directory_blocks > 0 ? directory_blocks : 1) * BLOCK_SIZE);
+    int block = 0;
+    while (block < directory_blocks){
+        int run_length;
+        int disk_block = get_block_run(root, block, directory_blocks - block, &run_length);
+        if (disk_block != -1){
+            cache_read_blocks(disk_block, run_length, (void *)(block_data + (long)block * BLOCK_SIZE));
+        }
+        else{
+            memset(block_data + (long)block * BLOCK_SIZE, 0, (long)run_length * BLOCK_SIZE);
+        }
+        block = block + run_length;
+    }
+
+    //Unpacking the entries of every block and marking the used slots in the free map
+    for (int i = 0; i < directory_blocks; i++){
+        memcpy(&directory_table[i * DIRECTORY_ENTRIES_PER_BLOCK], block_data + (long)i * BLOCK_SIZE, DIRECTORY_ENTRIES_PER_BLOCK * sizeof(struct directory_entry));
+    }
+    for (int i = 0; i < directory_table_length; i++){
+        if (directory_table[i].entry_used == '1'){
+            directory_free_map[i / 64] &= ~((uint64_t)1 << (i % 64));
+        }
+    }
+    free(block_data);
+}
+
+//Writing one block of directory entries to its place in the directory file
+void write_directory_block(int block){
+    char block_data[BLOCK_SIZE];
+    int run_length;
+    int disk_block = get_block_run(&i_node_table[ROOT_DIRECTORY_I_NODE], block, 1, &run_length);
+
+    memset(block_data, 0, BLOCK_SIZE);
+    memcpy(block_data, &directory_table[block * DIRECTORY_ENTRIES_PER_BLOCK], DIRECTORY_ENTRIES_PER_BLOCK * sizeof(struct directory_entry));
+    journal_metadata_block(disk_block, (void *)block_data);
+}
+
+//================================================FILE DATA=================================================
+
+//Getting a block that a write only partly covers: its content if it holds data of the file, zeros if it is past the end of the file
+void load_partial_block(int disk_block, int file_block, int file_size, char *block_data){
+    if (file_block * BLOCK_SIZE < file_size){
+        cache_read_blocks(disk_block, 1, (void *)block_data);
+    }
+    else{
+        memset(block_data, 0, BLOCK_SIZE);
+    }
+}
+
+//Writing zeros to the allocated blocks of [first_block, last_block] of the file, holes are left alone
+void zero_file_blocks(int i_node, int first_block, int last_block){
+    struct i_node *node = &i_node_table[i_node];
+    char block_data[BLOCK_SIZE];
+    memset(block_data, 0, BLOCK_SIZE);
+
+    int file_block = first_block;
+    while (file_block <= last_block){
+        int run_length;
+        int disk_block = get_block_run(node, file_block, last_block - file_block + 1, &run_length);
+        if (disk_block != -1){
+            for (int i = 0; i < run_length; i++){
+                cache_write_blocks(disk_block + i, 1, (void *)block_data);
+            }
+        }
+        file_block = file_block + run_length;
+    }
+}
+
+//Moving the data of a file kept in its i-node to a block of its own, the file then grows like any other. -1 if the disk is full.
+int move_inline_data(int i_node){
+    struct i_node *node = &i_node_table[i_node];
+    char block_data[BLOCK_SIZE];
+    uint32_t file_size = node->file_size;
+    uint32_t flags = (node->flags & ~I_NODE_FLAG_INLINE) | I_NODE_FLAG_EXTENTS;
+
+    int disk_block = -1;
+    if (file_size > 0){
+        disk_block = allocate_block();
+        if (disk_block == -1){
+            return -1;
+        }
+        memset(block_data, 0, BLOCK_SIZE);
+        memcpy(block_data, node->map.inline_data, file_size);
+        cache_write_blocks(disk_block, 1, (void *)block_data);
+    }
+
+    init_i_node(node, flags);
+    node->file_size = file_size;
+    if (disk_block != -1){
+        add_extent(node, 0, disk_block, 1);
+    }
+    mark_i_node_dirty(i_node);
+    return 0;
+}
+
+/*
+Giving each block in [first_block, last_block] of the file that is shared with a clone (sfs_clone) or the snapshot a disk block of
+its own, so the write that follows leaves the other files alone. Only the first and last blocks are copied, the write covers the others whole.
+An extent i-node switches to pointers, since the copies break its runs. Returns the number of blocks from first_block that are
+not shared, less than requested when the disk is full.
+*/
+int unshare_file_blocks(int i_node, int first_block, int last_block){
+    struct i_node *node = &i_node_table[i_node];
+    char block_data[BLOCK_SIZE];
+    int goal = -1;
+
+    for (int file_block = first_block; file_block <= last_block; file_block++){
+        int run_length;
+        int disk_block = get_block_run(node, file_block, 1, &run_length);
+        if (disk_block == -1 || block_is_shared(disk_block) == 0){
+            continue;
+        }
+        if ((node->flags & I_NODE_FLAG_EXTENTS) && convert_to_pointers(i_node) != 0){
+            return file_block - first_block;
+        }
+
+        //Copies of consecutive blocks are kept next to each other
+        int allocated;
+        int new_block = allocate_extent(goal, 1, &allocated);
+        if (new_block == -1){
+            return file_block - first_block;
+        }
+        if (file_block == first_block || file_block == last_block){
+            cache_read_blocks(disk_block, 1, (void *)block_data);
+            cache_write_blocks(new_block, 1, (void *)block_data);
+        }
+        if (map_pointer_blocks(i_node, file_block, new_block, 1, NULL) != 0){
+            release_blocks(new_block, 1);
+            return file_block - first_block;
+        }
+        mark_i_node_dirty(i_node);
+        release_blocks(disk_block, 1);
+        goal = new_block + 1;
+    }
+    return last_block - first_block + 1;
+}
+
+//Whether a write to the file may have to give it blocks of its own first (it shares blocks with a clone, or a snapshot is kept)
+int file_shares_blocks(struct i_node *node){
+    return (node->flags & I_NODE_FLAG_SHARED) || __atomic_load_n(&snapshot_active, __ATOMIC_ACQUIRE) == 1;
+}
+
+/*
+Writing `length` bytes of buf at `position` of a file (a position past the end of the file leaves a hole up to the data).
+The caller holds the i-node's lock for writing. Returns the number of bytes written, *end is set to where they stop.
+*/
+int write_i_node(int i_node, int position, const char *buf, int length, int *end){
+    struct i_node *node = &i_node_table[i_node];
+
+    *end = position;
+    if (length <= 0 || position < 0){
+        return 0;
+    }
+
+    //Case where the data is in the i-node: it stays there while it fits, or moves to a block before the write
+    if (node->flags & I_NODE_FLAG_INLINE){
+        if ((long long)position + length <= I_NODE_INLINE_BYTES){
+
+            //A write past the end of the file leaves zeros between the two
+            if (position > node->file_size){
+                memset(node->map.inline_data + node->file_size, 0, position - node->file_size);
+            }
+            memcpy(node->map.inline_data + position, buf, length);
+            if (position + length > node->file_size){
+                node->file_size = position + length;
+            }
+            mark_i_node_dirty(i_node);
+            *end = position + length;
+            return length;
+        }
+        if (move_inline_data(i_node) != 0){
+            return 0;
+        }
+    }
+
+    //Case where the write would take the file past the largest size an int offset can reach
+    if ((long long)position + length > INT_MAX){
+        length = INT_MAX - position;
+        if (length <= 0){
+            return 0;
+        }
+    }
+
+    //Checking if writing 'length' bytes to a pointer i-node will exceed its max file size
+    if ((node->flags & I_NODE_FLAG_EXTENTS) == 0 && (long long)position + length > MAX_POINTER_BLOCKS * BLOCK_SIZE){
+
+        //Decreasing the number of bytes to write to avoid exceeding the limit
+        length = (int)(MAX_POINTER_BLOCKS * BLOCK_SIZE - position);
+        if (length <= 0){
+            return 0;
+        }
+    }
+
+    //Case where the write skips past the end of the file, the blocks sfs_fallocate() set aside in between still hold old data
+    if (position > node->file_size){
+        int first_zero = (node->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        int last_zero = position / BLOCK_SIZE - 1;
+        if (first_zero <= last_zero && file_shares_blocks(node) && unshare_file_blocks(i_node, first_zero, last_zero) < last_zero - first_zero + 1){
+            return 0;
+        }
+        zero_file_blocks(i_node, first_zero, last_zero);
+    }
+
+    /*
+    Blocks that are holes hold nothing of the file, so a partly written one starts as zeros like a block past the end of the file.
+    Only the first and last blocks of the write can be partly written (the last one only when the write is not cut short below).
+    */
+    int first_block = position / BLOCK_SIZE;
+    int last_block = (position + length - 1) / BLOCK_SIZE;
+    int run_length;
+    int first_size = get_block_run(node, first_block, 1, &run_length) == -1 ? 0 : node->file_size;
+    int last_size = get_block_run(node, last_block, 1, &run_length) == -1 ? 0 : node->file_size;
+
+    //Allocating every missing block of the write up front so the allocator sees the whole size at once
+    int allocated_blocks = allocate_file_blocks(i_node, first_block, last_block);
+
+    //Case where the disk filled up, only the part of the data that has blocks is written
+    if (first_block + allocated_blocks <= last_block){
+        length = (first_block + allocated_blocks) * BLOCK_SIZE - position;
+        if (length <= 0){
+            return 0;
+        }
+        last_block = (position + length - 1) / BLOCK_SIZE;
+    }
+
+    //Case where the file shares blocks with a clone or the snapshot, the shared blocks the write covers are copied first (same limit as above)
+    if (file_shares_blocks(node)){
+        int unshared_blocks = unshare_file_blocks(i_node, first_block, last_block);
+        if (first_block + unshared_blocks <= last_block){
+            length = (first_block + unshared_blocks) * BLOCK_SIZE - position;
+            if (length <= 0){
+                return 0;
+            }
+        }
+    }
+
+    //Creating a pointer to keep track of how much of the "buf" array has been written to the disk, initially nothing is written, so = 0
+    int temp_write_pointer = 0; 
+
+    //Writing one run of physically contiguous blocks per iteration
+    while (temp_write_pointer < length){
+        int file_offset = position + temp_write_pointer;
+        int file_block = file_offset / BLOCK_SIZE;
+        int block_offset = file_offset % BLOCK_SIZE;
+        int blocks_left = (position + length - 1) / BLOCK_SIZE - file_block + 1;
+
+        int run_length;
+        int disk_block = get_block_run(node, file_block, blocks_left, &run_length);
+
+        //Number of bytes of buf going into this run
+        int bytes_in_run = run_length * BLOCK_SIZE - block_offset;
+        if (bytes_in_run > length - temp_write_pointer){
+            bytes_in_run = length - temp_write_pointer;
+        }
+
+        char block_data[BLOCK_SIZE];
+        int bytes_done = 0; //Bytes of this run already written
+        int run_block = 0; //Block of the run being written
+
+        //Case where the first block is only partly overwritten, keeping what the file already has in it
+        if (block_offset != 0 || bytes_in_run < BLOCK_SIZE){
+            load_partial_block(disk_block, file_block, file_block == first_block ? first_size : last_size, block_data);
+            bytes_done = BLOCK_SIZE - block_offset;
+            if (bytes_done > bytes_in_run){
+                bytes_done = bytes_in_run;
+            }
+            memcpy(block_data + block_offset, buf + temp_write_pointer, bytes_done);
+            cache_write_blocks(disk_block, 1, (void *)block_data);
+            run_block = 1;
+        }
+
+        //Whole blocks are written straight from buf with a single call
+        int whole_blocks = (bytes_in_run - bytes_done) / BLOCK_SIZE;
+        if (whole_blocks > 0){
+            cache_write_blocks(disk_block + run_block, whole_blocks, (void *)(buf + temp_write_pointer + bytes_done));
+            bytes_done = bytes_done + whole_blocks * BLOCK_SIZE;
+            run_block = run_block + whole_blocks;
+        }
+
+        //Case where the last block is only partly overwritten
+        if (bytes_done < bytes_in_run){
+            load_partial_block(disk_block + run_block, file_block + run_block, last_size, block_data);
+            memcpy(block_data, buf + temp_write_pointer + bytes_done, bytes_in_run - bytes_done);
+            cache_write_blocks(disk_block + run_block, 1, (void *)block_data);
+        }
+
+        //Updating how much of the given data was written. 
+        temp_write_pointer = temp_write_pointer + bytes_in_run;
+    }
+
+    //Updating the size of the i-node, only the i-node's own block of the i_node_table changed
+    if (position + temp_write_pointer > node->file_size){
+        node->file_size = position + temp_write_pointer;
+    }
+    mark_i_node_dirty(i_node);
+
+    *end = position + temp_write_pointer;
+    return temp_write_pointer;
+}
+
+//==============================================WRITE BUFFERS===============================================
+
+/*
+Writes smaller than the write buffer are copied into the buffer of their file instead of going to its blocks. The file_size
+counts them right away, and read_i_node() lays the buffer over what the blocks hold. Blocks are only allocated when the buffer
+is written back: when it is full, when a write does not continue or overlap it, at sfs_fclose(), sfs_fsync() and sfs_sync().
+The allocator then sees all the buffered bytes at once. Every block the write-back may need is reserved when the bytes are
+buffered, so a write that sfs_fwrite() accepted cannot run out of space later. The caller holds the i-node's lock for all of these.
+*/
+
+//Number of pointer blocks a pointer i-node of `blocks` blocks uses
+int pointer_blocks_needed(int blocks){
+    long long pointers = POINTERS_PER_BLOCK;
+    long long left = (long long)blocks - 12;
+    int count = 0;
+
+    //Single indirect block
+    if (left > 0){
+        count = count + 1;
+        left = left - pointers;
+    }
+
+    //Double indirect block and its single indirect blocks
+    if (left > 0){
+        long long covered = left < pointers * pointers ? left : pointers * pointers;
+        count = count + 1 + (int)((covered + pointers - 1) / pointers);
+        left = left - pointers * pointers;
+    }
+
+    //Triple indirect block with its double and single indirect blocks
+    if (left > 0){
+        count = count + 1 + (int)((left + pointers * pointers - 1) / (pointers * pointers)) + (int)((left + pointers - 1) / pointers);
+    }
+    return count;
+}
+
+//Most blocks writing back a buffer of the bytes [start, end) of a file can allocate (data and pointer blocks)
+int write_back_blocks(struct i_node *node, int start, int end){
+    int first_block = start / BLOCK_SIZE;
+    int end_blocks = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    //Every hole of the range gets a block, and data kept in the i-node needs one when it moves out
+    int blocks = (node->flags & I_NODE_FLAG_INLINE) ? 1 : 0;
+    int file_block = first_block;
+    while (file_block < end_blocks){
+        int run_length;
+        if (get_block_run(node, file_block, end_blocks - file_block, &run_length) == -1){
+            blocks = blocks + run_length;
+        }
+        file_block = file_block + run_length;
+    }
+    if (blocks == 0){
+        return 0;
+    }
+
+    //An extent i-node may switch to pointers during the write-back, it then needs pointer blocks for the whole file
+    if (node->flags & (I_NODE_FLAG_EXTENTS | I_NODE_FLAG_INLINE)){
+        return blocks + pointer_blocks_needed(end_blocks);
+    }
+
+    //A pointer i-node needs the pointer blocks of the range, plus the ones of each level the range starts in
+    return blocks + pointer_blocks_needed(end_blocks) - pointer_blocks_needed(first_block) + 3;
+}
+
+//Writing the buffered bytes of an i-node to its blocks, the buffer is empty afterwards. Returns the bytes written.
+int flush_write_buffer(int i_node){
+    struct write_buffer *buffer = &write_buffers[i_node];
+    if (buffer->end == buffer->start){
+        return 0;
+    }
+
+    //Blocks past the size on the disk start as zeros, and the allocator lets this thread use the buffer's reservation
+    i_node_table[i_node].file_size = buffer->disk_size;
+    reservation_allowance = buffer->reserved;
+    int end;
+    int written = write_i_node(i_node, buffer->start, buffer->data, buffer->end - buffer->start, &end);
+    unreserve_blocks(reservation_allowance);
+    reservation_allowance = 0;
+
+    buffer->start = 0;
+    buffer->end = 0;
+    buffer->reserved = 0;
+    __atomic_fetch_and(&buffered_i_node_map[i_node / 64], ~((uint64_t)1 << (i_node % 64)), __ATOMIC_RELEASE);
+    return written;
+}
+
+//Forgetting the write buffer of an i-node (closed or removed file), its bytes are not written
+void drop_write_buffer(int i_node){
+    struct write_buffer *buffer = &write_buffers[i_node];
+    if (buffer->reserved > 0){
+        unreserve_blocks(buffer->reserved);
+    }
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->start = 0;
+    buffer->end = 0;
+    buffer->reserved = 0;
+    __atomic_fetch_and(&buffered_i_node_map[i_node / 64], ~((uint64_t)1 << (i_node % 64)), __ATOMIC_RELEASE);
+}
+
+//Emptying every write buffer (the disk is being mounted or unmounted, sfs_sync() already wrote them back)
+void reset_write_buffers(){
+    for (int i = 0; i < write_buffer_count; i++){
+        free(write_buffers[i].data);
+    }
+    write_buffer_count = I_NODE_COUNT;
+    write_buffers = (struct write_buffer*)realloc(write_buffers, sizeof(struct write_buffer) * write_buffer_count);
+    memset(write_buffers, 0, sizeof(struct write_buffer) * write_buffer_count);
+    buffered_i_node_map = (uint64_t*)realloc(buffered_i_node_map, sizeof(uint64_t) * ((write_buffer_count + 63) / 64));
+    memset(buffered_i_node_map, 0, sizeof(uint64_t) * ((write_buffer_count + 63) / 64));
+}
+
+//Same as write_i_node(), but small writes only go into the file's write buffer
+int buffer_write(int i_node, int position, const char *buf, int length, int *end){
+    struct write_buffer *buffer = &write_buffers[i_node];
+    struct i_node *node = &i_node_table[i_node];
+    int capacity = WRITE_BUFFER_BLOCKS * BLOCK_SIZE;
+
+    *end = position;
+    if (length <= 0 || position < 0){
+        return 0;
+    }
+
+    //Case where the write does not continue or overlap the buffered bytes, or does not fit with them
+    int buffered = buffer->end > buffer->start;
+    if (buffered == 1 && (position < buffer->start || position > buffer->end || (long long)position + length - buffer->start > capacity)){
+        flush_write_buffer(i_node);
+        buffered = 0;
+    }
+
+    /*
+    Case where the write is too large to be worth buffering, or close to the largest file size. Files that share blocks with a
+    clone or the snapshot are not buffered either, the blocks their write-back would copy are not reserved. Writes that stay inside the i-node
+    cost no more than buffering them, and a write past the end of the file first zeroes the blocks it skips (write_i_node()).
+    */
+    long long largest_file = MAX_POINTER_BLOCKS * BLOCK_SIZE < INT_MAX ? MAX_POINTER_BLOCKS * BLOCK_SIZE : INT_MAX;
+    int stays_inline = (node->flags & I_NODE_FLAG_INLINE) && (long long)position + length <= I_NODE_INLINE_BYTES;
+    if (length > capacity || (long long)position + length > largest_file || file_shares_blocks(node) || stays_inline || position > node->file_size){
+        flush_write_buffer(i_node);
+        return write_i_node(i_node, position, buf, length, end);
+    }
+
+    int start = buffered == 1 ? buffer->start : position;
+    int buffer_end = buffered == 1 && buffer->end > position + length ? buffer->end : position + length;
+    int disk_size = buffered == 1 ? buffer->disk_size : node->file_size;
+
+    //Case where the disk cannot take the buffered bytes, the write is done right away (and may come up short)
+    int needed = write_back_blocks(node, start, buffer_end);
+    if (needed > buffer->reserved){
+        if (reserve_blocks(needed - buffer->reserved) != 0){
+            flush_write_buffer(i_node);
+            return write_i_node(i_node, position, buf, length, end);
+        }
+        buffer->reserved = needed;
+    }
+
+    if (buffer->data == NULL){
+        buffer->data = (char*)malloc(capacity);
+    }
+    memcpy(buffer->data + (position - start), buf, length);
+    buffer->start = start;
+    buffer->end = buffer_end;
+    buffer->disk_size = disk_size;
+    __atomic_fetch_or(&buffered_i_node_map[i_node / 64], (uint64_t)1 << (i_node % 64), __ATOMIC_RELEASE);
+    if (buffer_end > node->file_size){
+        node->file_size = buffer_end;
+    }
+
+    //Case where the buffer is full, its blocks are allocated now
+    if (buffer->end - buffer->start == capacity){
+        flush_write_buffer(i_node);
+    }
+
+    *end = position + length;
+    return length;
+}
+
+//==============================================I-NODE TABLE================================================
+
+//Writing one block of i-nodes to its place in the i-node table (each i-node is copied under its lock)
+void write_i_node_block(int block){
+    char block_data[BLOCK_SIZE];
+    int first = block * I_NODES_PER_BLOCK;
+    int count = I_NODE_COUNT - first;
+    if (count > I_NODES_PER_BLOCK){
+        count = I_NODES_PER_BLOCK;
+    }
+
+    memset(block_data, 0, BLOCK_SIZE);
+    for (int i = 0; i < count; i++){
+        pthread_rwlock_rdlock(&i_node_locks[first + i]);
+        struct i_node copy = i_node_table[first + i];
+
+        //The disk gets the size the file's blocks describe, buffered bytes are not on the disk yet
+        if (write_buffers[first + i].end > write_buffers[first + i].start){
+            copy.file_size = write_buffers[first + i].disk_size;
+        }
+        memcpy(block_data + i * sizeof(struct i_node), &copy, sizeof(struct i_node));
+        pthread_rwlock_unlock(&i_node_locks[first + i]);
+    }
+    journal_metadata_block(I_NODE_TABLE_START + block, (void *)block_data);
+}
+
+//Flagging the free i-nodes of blocks [first, first + count) of the i-node table in the free i-node map (the caller holds allocator_lock)
+void mark_free_i_nodes(int first, int count){
+    int last = (first + count) * I_NODES_PER_BLOCK;
+    if (last > I_NODE_COUNT){
+        last = I_NODE_COUNT;
+    }
+
+    //An i-node is free when its file_size is -1
+    for (int i = first * I_NODES_PER_BLOCK; i < last; i++){
+        if (i_node_table[i].file_size == -1){
+            i_node_free_map[i / 64] |= (uint64_t)1 << (i % 64);
+            if (i / 64 < i_node_free_hint){
+                i_node_free_hint = i / 64;
+            }
+        }
+    }
+}
+
+/*
+Unpacking blocks [first, first + count) of the i-node table, read from the disk into `data`, into i_node_table (the caller holds
+allocator_lock). Blocks that were loaded meanwhile are skipped, their i-nodes may have changed since the disk copy was read.
+*/
+void unpack_i_node_blocks(int first, int count, char *data){
+    for (int i = 0; i < count; i++){
+        int block = first + i;
+        if (i_node_block_loaded[block] == 1){
+            continue;
+        }
+
+        int first_i_node = block * I_NODES_PER_BLOCK;
+        int i_nodes = I_NODE_COUNT - first_i_node;
+        if (i_nodes > I_NODES_PER_BLOCK){
+            i_nodes = I_NODES_PER_BLOCK;
+        }
+        memcpy(&i_node_table[first_i_node], data + (long)i * BLOCK_SIZE, i_nodes * sizeof(struct i_node));
+        mark_free_i_nodes(block, 1);
+
+        //Flag is set last, a thread that sees it without the lock also sees the i-nodes
+        __atomic_store_n(&i_node_block_loaded[block], 1, __ATOMIC_RELEASE);
+    }
+}
+
+//Reading blocks [first, first + count) of the i-node table into i_node_table, the disk is read before allocator_lock is taken
+void load_i_node_blocks(int first, int count){
+    char *data = (char*)malloc((long)count * BLOCK_SIZE);
+    cache_read_blocks(I_NODE_TABLE_START + first, count, (void *)data);
+
+    pthread_mutex_lock(&allocator_lock);
+    unpack_i_node_blocks(first, count, data);
+    pthread_mutex_unlock(&allocator_lock);
+    free(data);
+}
+
+//Making sure i-node `i_node` is in i_node_table before it is used (called without allocator_lock)
+void require_i_node(int i_node){
+    int block = i_node / I_NODES_PER_BLOCK;
+    if (__atomic_load_n(&i_node_block_loaded[block], __ATOMIC_ACQUIRE) == 0){
+        load_i_node_blocks(block, 1);
+    }
+}
+
+//Taking the lowest free i-node of the loaded part of the table, loading more of it while none is free, -1 if every i-node is used
+int allocate_i_node(){
+    int words = (I_NODE_COUNT + 63) / 64;
+
+    pthread_mutex_lock(&allocator_lock);
+    while (1){
+        for (int i = i_node_free_hint; i < words; i++){
+            if (i_node_free_map[i] != 0){
+                int i_node = i * 64 + __builtin_ctzll(i_node_free_map[i]);
+                i_node_free_map[i] &= ~((uint64_t)1 << i_node % 64);
+                i_node_free_hint = i;
+                pthread_mutex_unlock(&allocator_lock);
+                return i_node;
+            }
+        }
+        i_node_free_hint = words;
+
+        //Case where the whole table is loaded, so there really is no free i-node
+        while (i_node_load_cursor < I_NODE_TABLE_BLOCKS && i_node_block_loaded[i_node_load_cursor] == 1){
+            i_node_load_cursor++;
+        }
+        if (i_node_load_cursor == I_NODE_TABLE_BLOCKS){
+            pthread_mutex_unlock(&allocator_lock);
+            return -1;
+        }
+
+        //Loading the next blocks the background loader has not reached yet (under the lock, so no other thread loads them)
+        int blocks = I_NODE_TABLE_BLOCKS - i_node_load_cursor;
+        if (blocks > I_NODE_LOAD_BLOCKS){
+            blocks = I_NODE_LOAD_BLOCKS;
+        }
+        char *data = (char*)malloc((long)blocks * BLOCK_SIZE);
+        cache_read_blocks(I_NODE_TABLE_START + i_node_load_cursor, blocks, (void *)data);
+        unpack_i_node_blocks(i_node_load_cursor, blocks, data);
+        free(data);
+    }
+}
+
+void free_i_node(int i_node){
+    //Setting the file_size as empty to indicate that th i-node is no longer in use
+    i_node_table[i_node].file_size = -1;
+    mark_i_node_dirty(i_node);
+
+    pthread_mutex_lock(&allocator_lock);
+    i_node_free_map[i_node / 64] |= (uint64_t)1 << (i_node % 64);
+    if (i_node / 64 < i_node_free_hint){
+        i_node_free_hint = i_node / 64;
+    }
+    pthread_mutex_unlock(&allocator_lock);
+}
+
+//Writing one block of the free bitmap, the freed blocks this commit seals are written as free (they reach the allocator once it is on the disk)
+void write_free_bit_map_block(int block){
+    uint64_t block_data[BLOCK_SIZE / 8];
+    long first = (long)block * (BLOCK_SIZE / 8);
+    for (int i = 0; i < BLOCK_SIZE / 8; i++){
+        block_data[i] = free_bit_map[first + i] | freed_block_map[first + i];
+    }
+    journal_metadata_block(FREE_BIT_MAP_BLOCK + block, (void *)block_data);
+}
+
+void write_reference_count_block(int block){
+    journal_metadata_block(REFERENCE_COUNT_START + block, (void *)((char *)reference_counts + (long)block * BLOCK_SIZE));
+}
+
+//Writing every flagged block of a metadata table with the given function
+void flush_dirty_blocks(struct dirty_blocks *dirty, void (*write_block)(int)){
+    for (int i = 0; i < dirty->count; i++){
+        write_block(dirty->list[i]);
+        dirty->flags[dirty->list[i]] = 0;
+    }
+    dirty->count = 0;
+}
+
+//Taking the blocks off a dirty block tracker, returns a copy of the list to write them from without holding metadata_lock
+int *take_dirty_blocks(struct dirty_blocks *dirty, int *count){
+    pthread_mutex_lock(&metadata_lock);
+    *count = dirty->count;
+    int *blocks = (int*)malloc(sizeof(int) * (*count + 1));
+    for (int i = 0; i < *count; i++){
+        blocks[i] = dirty->list[i];
+        dirty->flags[blocks[i]] = 0;
+    }
+    dirty->count = 0;
+    pthread_mutex_unlock(&metadata_lock);
+    return blocks;
+}
+
+
+/*
+Committing the metadata blocks that changed since the last flush as one journal transaction (the caller holds commit_lock).
+Returns the blocks synced, or -1 if the transaction could not be written (its blocks are then committed by the next flush).
+*/
+int commit_metadata(){
+
+    //Directory (and the root i-node) must not change while the blocks are copied
+    pthread_rwlock_rdlock(&directory_lock);
+
+    //Blocks freed so far are written as free by this transaction, the changes that freed them are copied below
+    pthread_mutex_lock(&allocator_lock);
+    seal_freed_blocks();
+    pthread_mutex_unlock(&allocator_lock);
+
+    /*
+    The i-node blocks are taken off their list first, since copying an i-node waits for its lock (which comes before metadata_lock).
+    A writer flags its i-node's block again after every change, so a change made meanwhile is written by the next flush.
+    */
+    int i_node_block_count;
+    int *i_node_blocks = take_dirty_blocks(&i_node_table_dirty, &i_node_block_count);
+    for (int i = 0; i < i_node_block_count; i++){
+        write_i_node_block(i_node_blocks[i]);
+    }
+    free(i_node_blocks);
+
+    //Pointer blocks the copied i-nodes lead to
+    write_back_block_maps();
+
+    //Directory blocks are found through the root i-node's block map (which comes before allocator_lock), only a directory writer flags them
+    int directory_block_count;
+    int *directory_blocks = take_dirty_blocks(&directory_table_dirty, &directory_block_count);
+    for (int i = 0; i < directory_block_count; i++){
+        write_directory_block(directory_blocks[i]);
+    }
+    free(directory_blocks);
+
+    /*
+    Bitmap and reference counts must not change while their blocks are copied. The transaction is sealed before the allocator is
+    let go, so every block its i-nodes and pointer blocks use is flagged as used in it.
+    */
+    pthread_mutex_lock(&allocator_lock);
+    pthread_mutex_lock(&metadata_lock);
+    flush_dirty_blocks(&free_bit_map_dirty, write_free_bit_map_block);
+    flush_dirty_blocks(&reference_count_dirty, write_reference_count_block);
+    journal_seal();
+    pthread_mutex_unlock(&metadata_lock);
+    pthread_mutex_unlock(&allocator_lock);
+    pthread_rwlock_unlock(&directory_lock);
+
+    //Writing the copied blocks to the journal, they reach their home blocks once the transaction is on the disk
+    int written = journal_commit();
+
+    //Changes made meanwhile may already call for the next commit
+    pthread_mutex_lock(&metadata_lock);
+    __atomic_store_n(&commit_wanted, 0, __ATOMIC_RELEASE);
+    check_transaction_size_locked();
+    pthread_mutex_unlock(&metadata_lock);
+
+    //The freed blocks are no longer used by anything on the disk. A replay would still write the image of one that is in the log
+    //(a pointer block), so the log starts over before it can hold file data.
+    if (written >= 0 && sealed_blocks_logged() == 1 && journal_checkpoint() < 0){
+        written = -1;
+    }
+    if (written >= 0){
+        pthread_mutex_lock(&allocator_lock);
+        release_sealed_blocks();
+        pthread_mutex_unlock(&allocator_lock);
+    }
+    return written;
+}
+
+//Committing the metadata blocks that changed since the last flush, returns the blocks synced (-1 if the commit failed)
+int flush_metadata(){
+    if (disk_mounted == 0){
+        return 0;
+    }
+    pthread_mutex_lock(&commit_lock);
+    int written = commit_metadata();
+    pthread_mutex_unlock(&commit_lock);
+    return written;
+}
+
+//Committing at the end of an operation once the running transaction is half the journal (called without any lock)
+void commit_if_needed(){
+    if (__atomic_load_n(&commit_wanted, __ATOMIC_ACQUIRE) == 1){
+        flush_metadata();
+    }
+}
+
+/*
+Writing back the buffer of every file that has bytes buffered, each under its i-node's lock (the caller holds no lock). Each
+write-back is an operation of its own, so the transaction is committed between two files once it is half the journal.
+*/
+void flush_write_buffers(){
+    for (int word = 0; word < (write_buffer_count + 63) / 64; word++){
+        uint64_t bits = __atomic_load_n(&buffered_i_node_map[word], __ATOMIC_ACQUIRE);
+        while (bits != 0){
+            int i_node = word * 64 + __builtin_ctzll(bits);
+            bits = bits & (bits - 1);
+            pthread_rwlock_wrlock(&i_node_locks[i_node]);
+            flush_write_buffer(i_node);
+            pthread_rwlock_unlock(&i_node_locks[i_node]);
+            commit_if_needed();
+        }
+    }
+}
+
+//Committing when blocks freed since the last commit are waiting for it, so the allocator gets them. Returns 1 if it did (called without any lock)
+int reclaim_freed_blocks(){
+    pthread_mutex_lock(&allocator_lock);
+    int pending = freed_count;
+    pthread_mutex_unlock(&allocator_lock);
+    if (pending == 0){
+        return 0;
+    }
+    return flush_metadata() < 0 ? 0 : 1;
+}
+
+//===============================================LAZY MOUNT=================================================
+
+/*
+mksfs(0) only reads the super block and replays the journal, so mounting a large disk does not wait for its whole i-node table,
+directory and free bitmap. Each call loads the part it needs first (require_*), and a background thread loads the rest so the
+calls soon stop finding anything missing. The directory is loaded under directory_lock, the i-node table and the free bitmap under
+allocator_lock, and a loaded flag is only set once its data is in place.
+*/
+pthread_t metadata_loader;
+int metadata_loader_running = 0;
+int metadata_loader_stop = 0; //Set by sfs_unmount(), the loader gives up between two reads
+struct timespec mount_time; //When mksfs() was called
+long first_open_time = -1; //Microseconds from mount_time to the end of the first sfs_fopen(), -1 == no file opened yet
+
+//Making sure the free bitmap and the reference counts are loaded before blocks are allocated or released (called without allocator_lock)
+void require_free_bit_map(){
+    if (__atomic_load_n(&free_bit_map_loaded, __ATOMIC_ACQUIRE) == 1){
+        return;
+    }
+    pthread_mutex_lock(&allocator_lock);
+    if (free_bit_map_loaded == 0){
+        cache_read_blocks(FREE_BIT_MAP_BLOCK, FREE_BIT_MAP_BLOCKS, free_bit_map);
+        cache_read_blocks(REFERENCE_COUNT_START, REFERENCE_COUNT_BLOCKS, reference_counts);
+        count_free_blocks();
+        __atomic_store_n(&free_bit_map_loaded, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&allocator_lock);
+}
+
+//Making sure the directory and its index are loaded before it is looked at (called without directory_lock)
+void require_directory(){
+    if (__atomic_load_n(&directory_loaded, __ATOMIC_ACQUIRE) == 1){
+        return;
+    }
+    pthread_rwlock_wrlock(&directory_lock);
+    if (directory_loaded == 0){
+        require_i_node(ROOT_DIRECTORY_I_NODE);
+        load_directory();
+        build_directory_index();
+        __atomic_store_n(&directory_loaded, 1, __ATOMIC_RELEASE);
+    }
+    pthread_rwlock_unlock(&directory_lock);
+}
+
+//Background thread: the directory and the free bitmap first (every open and write needs them), then the i-node table
+void *load_metadata(void *arg){
+    (void)arg;
+    require_directory();
+    require_free_bit_map();
+
+    for (int block = 0; block < I_NODE_TABLE_BLOCKS; block = block + I_NODE_LOAD_BLOCKS){
+        if (__atomic_load_n(&metadata_loader_stop, __ATOMIC_ACQUIRE) == 1){
+            break;
+        }
+        int blocks = I_NODE_TABLE_BLOCKS - block;
+        if (blocks > I_NODE_LOAD_BLOCKS){
+            blocks = I_NODE_LOAD_BLOCKS;
+        }
+
+        //Skipping the reads of chunks the calls already loaded
+        int missing = 0;
+        for (int i = 0; i < blocks; i++){
+            if (__atomic_load_n(&i_node_block_loaded[block + i], __ATOMIC_ACQUIRE) == 0){
+                missing = 1;
+                break;
+            }
+        }
+        if (missing == 1){
+            load_i_node_blocks(block, blocks);
+        }
+    }
+    return NULL;
+}
+
+void start_metadata_loader(){
+    __atomic_store_n(&metadata_loader_stop, 0, __ATOMIC_RELEASE);
+    if (pthread_create(&metadata_loader, NULL, load_metadata, NULL) == 0){
+        metadata_loader_running = 1;
+    }
+}
+
+void stop_metadata_loader(){
+    if (metadata_loader_running == 1){
+        __atomic_store_n(&metadata_loader_stop, 1, __ATOMIC_RELEASE);
+        pthread_join(metadata_loader, NULL);
+        metadata_loader_running = 0;
+    }
+}
+
+//Microseconds since the mount, for the first successful sfs_fopen()
+void record_first_open(){
+    if (__atomic_load_n(&first_open_time, __ATOMIC_ACQUIRE) != -1){
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed = (now.tv_sec - mount_time.tv_sec) * 1000000L + (now.tv_nsec - mount_time.tv_nsec) / 1000;
+    long unset = -1;
+    __atomic_compare_exchange_n(&first_open_time, &unset, elapsed, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+//================================================SNAPSHOT==================================================
+
+/*
+A snapshot is the image the disk holds right after sfs_snapshot() commits the metadata. Only one is kept at a time, in the
+snapshot table at SNAPSHOT_TABLE_START: its header says whether there is one and lists the blocks set aside for its copies. Which
+blocks the snapshot uses comes from its free bitmap (the copy of each block of it, or the block itself while it has none), so
+snapshot_bit_map is rebuilt from the disk when it is mounted again. Those blocks stay out of the allocator until the snapshot is
+deleted, data blocks are never overwritten (a write gives the file new blocks) and metadata blocks are copied once before they
+change (see SNAPSHOT COPIES). A write that would need a new block when the disk has none left fails like any write to a full disk.
+sfs_snapshot_export() writes the snapshot out as a disk image of its own.
+*/
+
+/*
+Filling snapshot_bit_map from the free bitmap of the snapshot, leaving out the journal and the snapshot table, which are not part
+of it (the caller holds allocator_lock and snapshot_lock)
+*/
+void read_snapshot_bit_map(){
+    for (int i = 0; i < FREE_BIT_MAP_BLOCKS; i++){
+        int copy = find_snapshot_copy(FREE_BIT_MAP_BLOCK + i);
+        cache_read_blocks(copy != -1 ? copy : FREE_BIT_MAP_BLOCK + i, 1, (void *)((char *)snapshot_bit_map + (long)i * BLOCK_SIZE));
+    }
+    for (int word = 0; word < FREE_BIT_MAP_WORDS; word++){
+        snapshot_bit_map[word] = ~snapshot_bit_map[word] & ~word_range_mask(word, JOURNAL_START, SNAPSHOT_TABLE_START + SNAPSHOT_TABLE_BLOCKS)
+                                 & ~word_range_mask(word, MAX_BLOCK, FREE_BIT_MAP_WORDS * 64);
+    }
+}
+
+//Forgetting the snapshot kept in memory, the table on the disk is left as it is
+void reset_snapshot(){
+    __atomic_store_n(&snapshot_active, 0, __ATOMIC_RELEASE);
+    free(snapshot_copies);
+    snapshot_copies = NULL;
+    snapshot_copy_size = 0;
+    snapshot_copy_count = 0;
+    snapshot_next_copy = 0;
+    snapshot_held_blocks = 0;
+    memset(snapshot_table, 0, (long)SNAPSHOT_TABLE_BLOCKS * BLOCK_SIZE);
+}
+
+//Reading the snapshot table of a disk being mounted (after its journal is replayed), a snapshot it keeps is used again
+void load_snapshot(){
+    cache_read_blocks(SNAPSHOT_TABLE_START, SNAPSHOT_TABLE_BLOCKS, (void *)snapshot_table);
+    struct snapshot_header *header = (struct snapshot_header *)snapshot_table;
+    if (header->magic != SNAPSHOT_MAGIC){
+        return;
+    }
+
+    //Copies are used in the order of the table, the first pair without one is where the next copy goes
+    pthread_mutex_lock(&allocator_lock);
+    pthread_mutex_lock(&snapshot_lock);
+    while (snapshot_next_copy < (int)header->copy_count && header->copies[2 * snapshot_next_copy] != (uint32_t)-1){
+        add_snapshot_copy((int)header->copies[2 * snapshot_next_copy], (int)header->copies[2 * snapshot_next_copy + 1]);
+        snapshot_next_copy++;
+    }
+    read_snapshot_bit_map();
+    __atomic_store_n(&snapshot_active, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&snapshot_lock);
+    pthread_mutex_unlock(&allocator_lock);
+}
+
+//Pointer blocks of the tree below `block`, which has `levels` levels of blocks below it (the last level being data blocks)
+int count_pointer_tree(uint32_t block, int levels){
+    if (block == -1){
+        return 0;
+    }
+    int count = 1;
+    if (levels > 1){
+        uint32_t *entries = (uint32_t*)malloc(BLOCK_SIZE);
+        cache_read_blocks(block, 1, (void *)entries);
+        for (int i = 0; i < POINTERS_PER_BLOCK; i++){
+            if (entries[i] != -1){
+                count = count + count_pointer_tree(entries[i], levels - 1);
+            }
+        }
+        free(entries);
+    }
+    return count;
+}
+
+/*
+Blocks the snapshot may have to copy, since they change where they are: the i-node table, free bitmap and reference counts, the
+directory blocks and every pointer block. They are counted from the disk right after a checkpoint (the caller holds commit_lock),
+which is what the snapshot holds whatever the calls changed in memory since.
+*/
+int count_metadata_blocks(){
+    int count = I_NODE_TABLE_BLOCKS + FREE_BIT_MAP_BLOCKS + REFERENCE_COUNT_BLOCKS;
+    char *data = (char*)malloc((long)I_NODE_LOAD_BLOCKS * BLOCK_SIZE);
+    for (int block = 0; block < I_NODE_TABLE_BLOCKS; block = block + I_NODE_LOAD_BLOCKS){
+        int blocks = I_NODE_TABLE_BLOCKS - block;
+        if (blocks > I_NODE_LOAD_BLOCKS){
+            blocks = I_NODE_LOAD_BLOCKS;
+        }
+        cache_read_blocks(I_NODE_TABLE_START + block, blocks, (void *)data);
+        for (int i = 0; i < blocks * I_NODES_PER_BLOCK && block * I_NODES_PER_BLOCK + i < I_NODE_COUNT; i++){
+            struct i_node *node = (struct i_node *)(data + (long)(i / I_NODES_PER_BLOCK) * BLOCK_SIZE) + i % I_NODES_PER_BLOCK;
+            if (block * I_NODES_PER_BLOCK + i == ROOT_DIRECTORY_I_NODE){
+                count = count + (node->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            }
+            if (node->file_size != -1 && (node->flags & (I_NODE_FLAG_EXTENTS | I_NODE_FLAG_INLINE)) == 0){
+                count = count + count_pointer_tree(node->map.pointers.indirect_pointer, 1);
+                count = count + count_pointer_tree(node->map.pointers.double_indirect_pointer, 2);
+                count = count + count_pointer_tree(node->map.pointers.triple_indirect_pointer, 3);
+            }
+        }
+    }
+    free(data);
+    return count;
+}
+
+/*
+Forgetting the snapshot. The cleared table and the blocks set aside for copies are committed together, then the blocks the
+snapshot used go back to the allocator.
+*/
+int sfs_snapshot_delete(){
+    if (__atomic_load_n(&snapshot_active, __ATOMIC_ACQUIRE) == 0){
+        return -1;
+    }
+    require_free_bit_map();
+
+    pthread_mutex_lock(&commit_lock);
+    struct snapshot_header *header = (struct snapshot_header *)snapshot_table;
+    pthread_mutex_lock(&snapshot_table_lock);
+    pthread_mutex_lock(&snapshot_lock);
+    int active = snapshot_active;
+    header->magic = 0;
+    pthread_mutex_unlock(&snapshot_lock);
+    if (active == 1){
+        journal_snapshot_table(0);
+    }
+    pthread_mutex_unlock(&snapshot_table_lock);
+    if (active == 0){
+        pthread_mutex_unlock(&commit_lock);
+        return -1;
+    }
+    for (int i = 0; i < (int)header->copy_count; i++){
+        release_blocks((int)header->copies[2 * i + 1], 1);
+    }
+
+    //Case where the commit fails, the running transaction still holds the cleared table for the next one
+    int result = commit_metadata() < 0 ? -1 : 0;
+    pthread_mutex_lock(&allocator_lock);
+    pthread_mutex_lock(&snapshot_lock);
+    reset_snapshot();
+    pthread_mutex_unlock(&snapshot_lock);
+    pthread_mutex_unlock(&allocator_lock);
+    pthread_mutex_unlock(&commit_lock);
+    return result;
+}
+
+/*
+Taking a snapshot of the disk as it is once the metadata is committed, a previous snapshot is deleted first. -1 if the table or
+the disk has no room for a copy of every metadata block.
+*/
+int sfs_snapshot(){
+    if (disk_mounted == 0){
+        return -1;
+    }
+    sfs_snapshot_delete();
+    require_free_bit_map();
+
+    //Getting the buffered bytes in place, then every metadata block (changed pointer blocks too) to its home
+    flush_write_buffers();
+    pthread_mutex_lock(&commit_lock);
+    if (commit_metadata() < 0 || journal_checkpoint() < 0){
+        pthread_mutex_unlock(&commit_lock);
+        return -1;
+    }
+
+    //Blocks for the copies are taken before the snapshot's blocks are known, they are free in the bitmap it is taken with
+    struct snapshot_header *header = (struct snapshot_header *)snapshot_table;
+    int copy_count = count_metadata_blocks();
+    int set_aside = 0;
+    while (set_aside < copy_count && copy_count <= SNAPSHOT_COPY_CAPACITY){
+        int allocated;
+        int start = allocate_extent(-1, copy_count - set_aside, &allocated);
+        if (start == -1){
+            break;
+        }
+        for (int i = 0; i < allocated; i++){
+            header->copies[2 * (set_aside + i)] = -1;
+            header->copies[2 * (set_aside + i) + 1] = start + i;
+        }
+        set_aside = set_aside + allocated;
+    }
+    if (set_aside < copy_count){
+        for (int i = 0; i < set_aside; i++){
+            release_blocks((int)header->copies[2 * i + 1], 1);
+        }
+        pthread_mutex_unlock(&commit_lock);
+        return -1;
+    }
+
+    /*
+    The snapshot uses the blocks the free bitmap on the disk has as used (the blocks allocated since the checkpoint are left out).
+    From here on the allocator leaves them alone, even once they are freed.
+    */
+    pthread_mutex_lock(&allocator_lock);
+    pthread_mutex_lock(&snapshot_lock);
+    header->magic = SNAPSHOT_MAGIC;
+    header->copy_count = copy_count;
+    read_snapshot_bit_map();
+    __atomic_store_n(&snapshot_active, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&snapshot_lock);
+    count_free_blocks();
+    pthread_mutex_unlock(&allocator_lock);
+
+    //Metadata blocks that went into the journal while it was taken are copied like the ones that come later, then the table goes in
+    pthread_mutex_lock(&snapshot_table_lock);
+    int running_count;
+    int *running = journal_running_blocks(&running_count);
+    for (int i = 0; i < running_count; i++){
+        copy_snapshot_block(running[i]);
+    }
+    free(running);
+    for (int block = 0; block <= snapshot_pair_block(copy_count - 1); block++){
+        journal_snapshot_table(block);
+    }
+    pthread_mutex_unlock(&snapshot_table_lock);
+
+    int result = commit_metadata() < 0 ? -1 : 0;
+    pthread_mutex_unlock(&commit_lock);
+    return result;
+}
+
+//Writing the snapshot to the host file `path` as a disk image (blocks it does not use are zeros), -1 if there is no snapshot
+int sfs_snapshot_export(const char *path){
+    int chunk_blocks = 64;
+    if (__atomic_load_n(&snapshot_active, __ATOMIC_ACQUIRE) == 0){
+        return -1;
+    }
+    FILE *image = fopen(path, "wb");
+    if (image == NULL){
+        return -1;
+    }
+    char *chunk_data = (char*)malloc((long)chunk_blocks * BLOCK_SIZE);
+    int result = 0;
+
+    //Writers only wait for the chunk being read
+    for (int block = 0; block < MAX_BLOCK && result == 0; block = block + chunk_blocks){
+        int blocks = MAX_BLOCK - block;
+        if (blocks > chunk_blocks){
+            blocks = chunk_blocks;
+        }
+
+        pthread_mutex_lock(&snapshot_lock);
+        if (snapshot_active == 0){
+            pthread_mutex_unlock(&snapshot_lock);
+            result = -1;
+            break;
+        }
+        cache_read_blocks(block, blocks, (void *)chunk_data);
+
+        //Blocks that changed come from their copy, the ones the snapshot does not use are zeros (its journal is empty)
+        for (int i = block; i < block + blocks; i++){
+            char *block_data = chunk_data + (long)(i - block) * BLOCK_SIZE;
+            int copy = find_snapshot_copy(i);
+            if (snapshot_uses_block(i) == 0){
+                memset(block_data, 0, BLOCK_SIZE);
+            }
+            else if (copy != -1){
+                cache_read_blocks(copy, 1, (void *)block_data);
+            }
+        }
+        pthread_mutex_unlock(&snapshot_lock);
+
+        if (fwrite(chunk_data, BLOCK_SIZE, blocks, image) != (size_t)blocks){
+            result = -1;
+        }
+    }
+    free(chunk_data);
+    if (fclose(image) != 0){
+        result = -1;
+    }
+    return result;
+}
 
-//Pointer for sfs_getnextfilename
-int current_file_read; 
+void sfs_unmount(){
+    if (disk_mounted == 1){
+        stop_metadata_loader();
+        sfs_sync();
+
+        //Home blocks are brought up to date so the next mount has nothing to replay
+        journal_checkpoint();
+        journal_close();
+        reset_block_maps();
+        reset_write_buffers();
+        cache_destroy();
+        async_disk_close();
+        close_disk();
+        disk_mounted = 0;
+    }
+}
 
-void mksfs(int fresh){ 
+//Filling the super block with the layout of a disk of `block_count` blocks of `block_size` bytes
+void compute_layout(struct super_node *super, int block_size, int block_count){
+    int i_nodes_per_block = block_size / sizeof(struct i_node);
+    int bits_per_block = block_size * 8;
+
+    super->magic_number = SFS_MAGIC;
+    super->block_size = block_size;
+    super->file_system_size = block_count;
+    super->root_directory_node = ROOT_DIRECTORY_I_NODE;
+
+    //Super block [0], then the i-node table right after it
+    super->i_node_table_length = block_count / BLOCKS_PER_I_NODE;
+    super->i_node_table_start = 1;
+    super->i_node_table_blocks = (super->i_node_table_length + i_nodes_per_block - 1) / i_nodes_per_block;
+
+    //Free bitmap takes the last blocks of the disk
+    super->free_bit_map_blocks = (block_count + bits_per_block - 1) / bits_per_block;
+    super->free_bit_map_start = block_count - super->free_bit_map_blocks;
+
+    //Reference counts (two bytes per block) come right before the free bitmap
+    super->reference_count_blocks = (block_count * (int)sizeof(uint16_t) + block_size - 1) / block_size;
+    super->reference_count_start = super->free_bit_map_start - super->reference_count_blocks;
+
+    //Journal comes right after the i-node table. A transaction is committed once it is half the journal, and one call changes at most
+    //about one metadata block per 85 blocks it maps (pointer blocks, reference counts, bitmap at 512 B blocks), so it fits in the other half
+    super->journal_start = super->i_node_table_start + super->i_node_table_blocks;
+    super->journal_blocks = block_count / 32;
+    if (super->journal_blocks < MIN_JOURNAL_BLOCKS){
+        super->journal_blocks = MIN_JOURNAL_BLOCKS;
+    }
 
-    //Starting up the pointer for sfs_getnextfilename
-    current_file_read = 0; 
+    //Snapshot table comes right after the journal, with a pair for every 8 blocks (sfs_snapshot() fails when the disk has more metadata blocks)
+    super->snapshot_table_start = super->journal_start + super->journal_blocks;
+    long table_bytes = sizeof(struct snapshot_header) + (long)(block_count / 8 + 32) * 2 * sizeof(uint32_t);
+    super->snapshot_table_blocks = (table_bytes + block_size - 1) / block_size;
+}
 
-    //Some arbitrary 'filename' for the disk 
-    char *disk_name = "current_disk"; 
+//Sizing the in-memory copies of the metadata tables for the geometry in super_block
+void allocate_tables(){
+    i_node_table = (struct i_node*)realloc(i_node_table, sizeof(struct i_node) * I_NODE_COUNT);
+    i_node_free_map = (uint64_t*)realloc(i_node_free_map, sizeof(uint64_t) * ((I_NODE_COUNT + 63) / 64));
+    free_bit_map = (uint64_t*)realloc(free_bit_map, (long)FREE_BIT_MAP_BLOCKS * BLOCK_SIZE);
+    snapshot_bit_map = (uint64_t*)realloc(snapshot_bit_map, (long)FREE_BIT_MAP_BLOCKS * BLOCK_SIZE);
+    snapshot_table = (char*)realloc(snapshot_table, (long)SNAPSHOT_TABLE_BLOCKS * BLOCK_SIZE);
+    reference_counts = (uint16_t*)realloc(reference_counts, (long)REFERENCE_COUNT_BLOCKS * BLOCK_SIZE);
+    freed_block_map = (uint64_t*)realloc(freed_block_map, (long)FREE_BIT_MAP_BLOCKS * BLOCK_SIZE);
+    memset(freed_block_map, 0, (long)FREE_BIT_MAP_BLOCKS * BLOCK_SIZE);
+    freed_count = 0;
+    freed_sealed = 0;
+    i_node_block_loaded = (char*)realloc(i_node_block_loaded, I_NODE_TABLE_BLOCKS);
+    init_i_node_locks();
+    reset_block_maps();
+    reset_write_buffers();
+    i_node_descriptor = (int*)realloc(i_node_descriptor, sizeof(int) * I_NODE_COUNT);
 
     /*
     For every slot in the FDT, i set the i_node_number attribute to -1 to indicate that it is free and no i-node 
     is stored in the given slot currently. When a file will be opened, the corresponding i_node_number will be >= 0. 
     */
-    for (int i = 0; i < 10; i++){ 
-        file_descriptor_table[i].i_node_number = -1; 
+    reset_descriptor_table();
+
+    //Freshly loaded (or freshly written) metadata matches the disk
+    resize_dirty_blocks(&i_node_table_dirty, 0, I_NODE_TABLE_BLOCKS);
+    resize_dirty_blocks(&free_bit_map_dirty, 0, FREE_BIT_MAP_BLOCKS);
+    resize_dirty_blocks(&reference_count_dirty, 0, REFERENCE_COUNT_BLOCKS);
+    i_node_table_dirty.count = 0;
+    free_bit_map_dirty.count = 0;
+    reference_count_dirty.count = 0;
+    free_bit_map_cursor = 0;
+    free_block_count = 0;
+    reserved_blocks = 0;
+    reset_snapshot();
+
+    //Nothing is loaded yet, so no i-node is free until its block is
+    memset(i_node_block_loaded, 0, I_NODE_TABLE_BLOCKS);
+    memset(i_node_free_map, 0, sizeof(uint64_t) * ((I_NODE_COUNT + 63) / 64));
+    i_node_free_hint = 0;
+    i_node_load_cursor = 0;
+    free_bit_map_loaded = 0;
+    directory_loaded = 0;
+}
+
+void mksfs(int fresh){ 
+    mksfs_geometry(fresh, DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_COUNT);
+}
+
+int mksfs_geometry(int fresh, int block_size, int block_count){ 
+
+    //Making sure the cached blocks reach the disk when the program exits, and that blocks a snapshot still uses are never overwritten
+    if (exit_handler_registered == 0){
+        atexit(sfs_unmount);
+        cache_set_write_hook(check_snapshot_write);
+        exit_handler_registered = 1;
     }
 
+    //A previous mount must reach the disk before the disk file is reopened
+    sfs_unmount();
+    clock_gettime(CLOCK_MONOTONIC, &mount_time);
+    first_open_time = -1;
+
+    //Starting up the pointer for sfs_getnextfilename (before the first entry of the directory)
+    current_file_read = -1; 
+
+    //Some arbitrary 'filename' for the disk 
+    char *disk_name = "current_disk"; 
+
     //Case where a new file system is requested
     if (fresh == 1){ 
 
-        //Creating a new disk
-        init_fresh_disk(disk_name, BLOCK_SIZE, MAX_BLOCK); 
+        //Checking the geometry: power of two block size and enough blocks for the metadata
+        if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0 || block_count < MIN_BLOCK_COUNT){
+            return -1;
+        }
 
         //==========================================SUPER BLOCK======================================================
 
         //Set up the Super Block
-        struct super_node *superNode = (struct super_node*)malloc(sizeof(struct super_node));
-        superNode->magic_number = 1; 
-        superNode->block_size = BLOCK_SIZE; //1024 bytes per block 
-        superNode->file_system_size = MAX_BLOCK; //1024 blocks in the system 
-        superNode->i_node_table_length = 114; //114 files can be made at most
-        superNode->root_directory_node = 0; 
+        compute_layout(&super_block, block_size, block_count);
+
+        //Creating a new disk
+        if (init_fresh_disk(disk_name, BLOCK_SIZE, MAX_BLOCK) != 0){
+            return -1;
+        }
+        cache_init(cache_size_setting, BLOCK_SIZE, cache_policy_setting);
+        async_disk_open(ASYNC_QUEUE_DEPTH, BLOCK_SIZE);
+        disk_mounted = 1;
+        allocate_tables();
 
         //Writing the Super Block to the disk
-        write_blocks(0, 1, superNode); 
+        //(copied into a whole block since the full block is written to the disk)
+        char *super_block_data = (char*)calloc(1, BLOCK_SIZE);
+        memcpy(super_block_data, &super_block, sizeof(struct super_node));
+        cache_write_blocks(0, 1, (void *)super_block_data); 
+        free(super_block_data);
 
         //=========================================I-NODE TABLE======================================================
 
@@ -94,78 +3017,165 @@ void mksfs(int fresh){
         when a new file must be created, and an I-Node must be stored. When a slot of the I-Node Table is in use, then the file_size 
         will be >= 0. 
         */
-        for (int i = 0; i<114; i++){
+        memset(i_node_table, 0, sizeof(struct i_node) * I_NODE_COUNT);
+        for (int i = 0; i < I_NODE_COUNT; i++){
             i_node_table[i].file_size = -1; // -1 == free | x >= 0 == used
         }
 
         //Creating an I-node for the root directory
-        i_node_table[0].file_size = 0; 
+        init_i_node(&i_node_table[ROOT_DIRECTORY_I_NODE], I_NODE_FLAG_EXTENTS); 
 
-        //Setting the pointers to -1 to indicate that they're not allocated/used yet
-        for(int i = 0; i<12; i++){
-            i_node_table[0].direct_pointer[i] = -1; 
+        //Writing the I-Node table to the disk right after the Super Block
+        for (int i = 0; i < I_NODE_TABLE_BLOCKS; i++){
+            write_i_node_block(i);
         }
-        i_node_table[0].indirect_pointer = -1; 
-
-        //Writing the I-Node table to the disk at disk blocks [1, 6]
-        write_blocks(1, 6, i_node_table); 
+        memset(i_node_block_loaded, 1, I_NODE_TABLE_BLOCKS);
+        i_node_load_cursor = I_NODE_TABLE_BLOCKS;
+        mark_free_i_nodes(0, I_NODE_TABLE_BLOCKS);
 
-        //========================================DIRECTORY TABLE====================================================
+        //==========================================FREE BITMAP======================================================
 
-        /* 
-        For every slot of the directory table, whenever a slot is not in use, the entry_used attribute will be set to 0. This will be used 
-        when a new directory is being created, and it must be stored somewhere in the table. When a slot of the Directory Table is in used, 
-        the attribute entry_used will be equal 1.
+        /*
+        For every bit in the free bitmap, whenever a corresponding block is not in use, it will be equal to 1. When a block is being used 
+        by something, then it will be equal to 0. Bits past the end of the disk stay 0 so they are never handed out.
         */
-        for (int i = 0; i < 96; i++){
-            directory_table[i].entry_used = '0'; // 0 == free | 1 == used
+        memset(free_bit_map, 0, (long)FREE_BIT_MAP_BLOCKS * BLOCK_SIZE);
+        for(int i = 0; i < MAX_BLOCK; i++){
+            set_block_free(i); // 1 == free | 0 == used
+        }
+
+        //Updating Free Bitmap for the Super Block, the I-Node Table, the Journal and the Snapshot Table
+        for(int i = 0; i < SNAPSHOT_TABLE_START + SNAPSHOT_TABLE_BLOCKS; i++){
+            set_block_used(i); 
+        }
+        for(int i = 0; i < FREE_BIT_MAP_BLOCKS; i++){
+            set_block_used(FREE_BIT_MAP_BLOCK + i); //for the Free Bitmap itself! 
+        }
+        for(int i = 0; i < REFERENCE_COUNT_BLOCKS; i++){
+            set_block_used(REFERENCE_COUNT_START + i);
         }
 
-        //Creating a directory for the root (??) 
-        directory_table[0].entry_used = '1'; 
-        char temp_file_name[] = "root"; 
-        strcpy(directory_table[0].filename, temp_file_name); 
-        directory_table[0].i_node_number = 0; 
+        // Writing the Free Bitmap to the last blocks of the disk
+        flush_dirty_blocks(&free_bit_map_dirty, write_free_bit_map_block);
 
-        // Writing the Directory Table to the disk at disk blocks [7, 8]
-        write_blocks(7, 2, directory_table); 
+        //No block is shared yet, the reference counts right before the Free Bitmap start at 0
+        memset(reference_counts, 0, (long)REFERENCE_COUNT_BLOCKS * BLOCK_SIZE);
+        for(int i = 0; i < REFERENCE_COUNT_BLOCKS; i++){
+            write_reference_count_block(i);
+        }
+        free_bit_map_loaded = 1;
 
-        //==========================================FREE BITMAP======================================================
+        //No snapshot is kept yet (reset_snapshot() cleared the table)
+        journal_add_block(SNAPSHOT_TABLE_START, (void *)snapshot_table);
 
-        /*
-        For every slot in the free bitmap, whenever a corresponding block is not in use, it will be equal to '1'. When a block is being used 
-        by something, then it will be equal to '0'. 
+        //========================================DIRECTORY TABLE====================================================
+
+        /* 
+        The directory starts empty: it is the data of the root i-node, which has no blocks yet. A block of entries is added
+        to it whenever a new file finds every entry slot in use.
         */
-        for(int i = 0; i < 1024; i++){
-            free_bit_map[i] = '1'; // '1' == free | '0' == used
-        }
+        load_directory();
+        build_directory_index();
+        directory_loaded = 1;
 
-        //Updating Free Bitmap for Super Block [0], I-Node Table [1-6] and Directory Table [7-8] 
-        for(int i = 0; i < 9; i++){
-            free_bit_map[i] = '0'; 
-        }
-        free_bit_map[1023] = '0'; //for the Free Bitmap itself! 
+        //=============================================JOURNAL=======================================================
 
-        // Writing the Free Bitmap to the disk at blocks [1023]
-        write_blocks(1023, 1, free_bit_map);
- 
+        //Every metadata change from now on goes through the journal, which starts empty
+        journal_open(JOURNAL_START, JOURNAL_BLOCKS, BLOCK_SIZE);
+        journal_format();
     }
 
     //Case where an existing file system is requested 
     else{
 
+        //Reading the Super Block first, the rest of the geometry comes from it
+        if (init_disk(disk_name, sizeof(struct super_node), 1) != 0){
+            return -1;
+        }
+        read_blocks(0, 1, (void *)&super_block);
+        close_disk();
+
+        //Case where the disk was not formatted by this file system
+        if (super_block.magic_number != SFS_MAGIC){
+            return -1;
+        }
+
         //Opening existing filesystem
-        init_disk(disk_name, BLOCK_SIZE, MAX_BLOCK); 
+        if (init_disk(disk_name, BLOCK_SIZE, MAX_BLOCK) != 0){
+            return -1;
+        }
+        cache_init(cache_size_setting, BLOCK_SIZE, cache_policy_setting);
+        async_disk_open(ASYNC_QUEUE_DEPTH, BLOCK_SIZE);
+        disk_mounted = 1;
+        allocate_tables();
+
+        //Replaying the metadata transactions that were committed but may not have reached their home blocks
+        journal_open(JOURNAL_START, JOURNAL_BLOCKS, BLOCK_SIZE);
+        journal_recover();
+
+        //A snapshot the disk keeps is used again, the blocks it uses stay out of the allocator
+        load_snapshot();
+
+        //I-Node table, Free Bit Map and Directory Table are loaded by the first calls that need them and in the background
+        start_metadata_loader();
+    }
+    return 0;
+}
+
+void sfs_configure_cache(int capacity, int policy){
+
+    //Settings are picked up by the next mksfs()
+    cache_size_setting = capacity;
+    cache_policy_setting = policy;
+}
+
+void sfs_configure_readahead(int max_blocks){
+
+    //Largest readahead window of a descriptor, 0 turns readahead off
+    readahead_setting = max_blocks > 0 ? max_blocks : 0;
+}
+
+void sfs_configure_disk(int backend){
+
+    //Setting is picked up by the next mksfs(), when the disk file is opened
+    set_disk_backend(backend);
+}
+
+int sfs_disk_backend(){
+
+    //Backend of the mounted disk, which differs from the configured one when the file could not be opened that way
+    return get_disk_backend();
+}
+
+long sfs_time_to_first_open(){
 
-        //Getting I-Node table from disk
-        read_blocks(1, 6, i_node_table); 
+    //Microseconds between the last mksfs() and the end of the first sfs_fopen() after it, -1 if no file was opened since
+    return __atomic_load_n(&first_open_time, __ATOMIC_ACQUIRE);
+}
 
-        //Getting Directory Table from disk
-        read_blocks(7, 2, directory_table); 
+int sfs_fsync(int fileID){
 
-        //Getting Free Bit Map from disk
-        read_blocks(1023, 1, free_bit_map);
+    //Giving the file's buffered bytes their blocks, then writing everything back to the disk
+    int read_write_pointer;
+    int i_node = lock_descriptor_i_node(fileID, 1, &read_write_pointer);
+    if (i_node == -1){
+        return -1;
     }
+    flush_write_buffer(i_node);
+    pthread_rwlock_unlock(&i_node_locks[i_node]);
+
+    return sfs_sync() < 0 ? -1 : 0;
+}
+
+int sfs_sync(){
+
+    //Giving the buffered bytes of every open file their blocks, then committing the changed pointer and metadata blocks and
+    //writing every dirty cached block back to the disk
+    flush_write_buffers();
+
+    //Committing the metadata also makes every written block durable (msync for a mapped disk), -1 if a write failed
+    int written = flush_metadata();
+    return written;
 }
 
 int sfs_fopen(char *name){
@@ -180,34 +3190,40 @@ int sfs_fopen(char *name){
     }
 
     //Checking whether the file already exsists on the system (exists inside of the Directory Table)
-    for (int i = 0; i < 96; i++){
-        if (directory_table[i].entry_used == '1' && strcmp(directory_table[i].filename, name) == 0){
-            existing_i_node_number = directory_table[i].i_node_number; 
-            existing_file_found = 1; 
-            break; 
-        }
+    require_directory();
+    pthread_rwlock_rdlock(&directory_lock);
+    int existing_entry = directory_lookup(name);
+
+    //Case where the file is missing: creating it needs the directory to itself, and another thread may have created it meanwhile
+    if (existing_entry == -1){
+        pthread_rwlock_unlock(&directory_lock);
+        pthread_rwlock_wrlock(&directory_lock);
+        existing_entry = directory_lookup(name);
+    }
+    int existing_file_size = 0;
+    if (existing_entry != -1){
+        existing_i_node_number = directory_table[existing_entry].i_node_number; 
+        existing_file_found = 1; 
+
+        require_i_node(existing_i_node_number);
+        pthread_rwlock_rdlock(&i_node_locks[existing_i_node_number]);
+        existing_file_size = i_node_table[existing_i_node_number].file_size;
+        pthread_rwlock_unlock(&i_node_locks[existing_i_node_number]);
     }
 
     //Case 1: File already exists, need to check if it's open or not
     if (existing_file_found == 1){
 
-        //Case 1.A: File exist, need to check if it's open (can be found in the FDT) 
-        for (int i = 0; i < 10; i++){
+        pthread_mutex_lock(&descriptor_lock);
 
-            //File was found in the FDT
-            if (file_descriptor_table[i].i_node_number == existing_i_node_number){
-                return i; 
-            }
-        }
+        //Case 1.A: File exist, need to check if it's open (can be found in the FDT) 
+        file_descriptor_index = i_node_descriptor[existing_i_node_number];
 
         //Case 1.B: File exists, but it is not open, need to add it to the FDT
-        for (int i = 0; i < 10; i++){
-            if (file_descriptor_table[i].i_node_number == -1){
-                file_descriptor_table[i].i_node_number = existing_i_node_number; 
-                file_descriptor_table[i].read_write_pointer = i_node_table[existing_i_node_number].file_size;
-                return i; 
-            }
+        if (file_descriptor_index == -1){
+            file_descriptor_index = open_descriptor(existing_i_node_number, existing_file_size);
         }
+        pthread_mutex_unlock(&descriptor_lock);
     }
 
     //Case 2: File does not exist, need to create it from scratch
@@ -217,29 +3233,35 @@ int sfs_fopen(char *name){
         //Allocate and initialize an I-Node 
         struct i_node *temp_i_node = (struct i_node*)malloc(sizeof(struct i_node));
 
-        //Set I-Node file size to 0 
-        temp_i_node->file_size = 0; 
+        //Set I-Node file size to 0, new files keep their data in the i-node until it outgrows it
+        init_i_node(temp_i_node, I_NODE_FLAG_INLINE); 
 
-        //Setting the pointers (direct and indirect) to -1 to show that they're unused 
-        for(int i = 0; i<12; i++){
-            temp_i_node->direct_pointer[i] = -1; 
-        }
-        temp_i_node->indirect_pointer = -1; 
+        //The directory may need a new block
+        require_free_bit_map();
 
         //Find empty slot for the new node inside of the i_node_table
-        int index_of_i_node = -1; 
-        for (int i = 0; i < 114; i++){ 
+        int index_of_i_node = allocate_i_node(); 
+
+        //Find empty slot for the new directory inside of the directory_table (the directory grows if they are all used)
+        int index_of_entry = -1;
+        if (index_of_i_node != -1){
+            index_of_entry = allocate_directory_entry();
+        }
 
-            //Found a slot on the i_node_table
-            if (i_node_table[i].file_size == -1){
-                i_node_table[i] = *temp_i_node; //Storing the new i-node inside the table
-                index_of_i_node = i; 
-                break; 
+        //Case where there is no i-node or no room in the directory left for the file
+        if (index_of_entry == -1){
+            if (index_of_i_node != -1){
+                free_i_node(index_of_i_node);
             }
+            free(temp_i_node);
+            pthread_rwlock_unlock(&directory_lock);
+            return -1;
         }
+        i_node_table[index_of_i_node] = *temp_i_node; //Storing the new i-node inside the table
+        free(temp_i_node);
 
-        //Updating the i_node_table on the disk
-        write_blocks(1, 6, i_node_table);
+        //Flagging the i-node's block of the i_node_table, it is written at the next flush
+        mark_i_node_dirty(index_of_i_node);
 
         //============================================DIRECTORY=====================================================
 
@@ -249,504 +3271,707 @@ int sfs_fopen(char *name){
         strcpy(temp_directory->filename, name); 
         temp_directory->i_node_number = index_of_i_node; 
 
-        //Find empty slot for the new directory inside of the directory_table 
-        for (int i = 0; i < 96; i++){
-
-            //Found a slot in the directory_table
-            if (directory_table[i].entry_used == '0'){
-                directory_table[i] = *temp_directory; 
-                break; 
-            }
-        }
-
-        //Updating the directory_table on the disk
-        write_blocks(7, 2, directory_table); 
+        //Storing the entry in the slot found above
+        directory_table[index_of_entry] = *temp_directory; 
+        free(temp_directory);
+        mark_directory_dirty(index_of_entry);
+        directory_index_insert(index_of_entry);
 
         //=======================================FILE DESCRIPTOR TABLE==============================================
 
-        //Create a File Descriptor Entry for the file_descriptor_table
-        struct file_descriptor_entry *temp_descriptor_entry = (struct file_descriptor_entry*)malloc(sizeof(struct file_descriptor_entry)); 
-        temp_descriptor_entry->i_node_number = index_of_i_node; 
-        temp_descriptor_entry->read_write_pointer = 0; //new file, so pointer is at the start of the file 
-
-        //Find empty slot for the new file descriptor entry in the file_descriptor_table
-        for (int i = 0; i < 10; i++){
-            
-            //Found a slot in the file_descriptor_table
-            if (file_descriptor_table[i].i_node_number == -1){
-                file_descriptor_table[i] = *temp_descriptor_entry;
-                file_descriptor_index = i; 
-                break; 
-            }
-        }
+        //Taking a descriptor off the free list for the new file (new file, so pointer is at the start of the file)
+        pthread_mutex_lock(&descriptor_lock);
+        file_descriptor_index = open_descriptor(index_of_i_node, 0);
+        pthread_mutex_unlock(&descriptor_lock);
     } 
+    pthread_rwlock_unlock(&directory_lock);
+    record_first_open();
+    commit_if_needed();
     return file_descriptor_index; 
 }
 
 int sfs_fclose(int fileID){
 
     //Case where we're trying to close a file that is not open in the first place
-    if (file_descriptor_table[fileID].i_node_number == -1){
+    pthread_mutex_lock(&descriptor_lock);
+    if (descriptor_i_node(fileID) == -1){
+        pthread_mutex_unlock(&descriptor_lock);
         return -1; 
     }
 
-    //Case where the file is open, and we now close it
+    //Case where the file is open, and we now close it (the descriptor goes back on the free list)
     else{
-        file_descriptor_table[fileID].i_node_number = -1; //-1 signifies that the slot is not in use! 
+        int i_node = file_descriptor_table[fileID].i_node_number;
+        release_descriptor(fileID);
+        pthread_mutex_unlock(&descriptor_lock);
+
+        //Buffered bytes get their blocks, the write buffer and block map only stay in memory while the file is open
+        //(it may have been opened again meanwhile)
+        pthread_rwlock_wrlock(&i_node_locks[i_node]);
+        flush_write_buffer(i_node);
+        pthread_mutex_lock(&descriptor_lock);
+        int reopened = i_node_descriptor[i_node] != -1;
+        pthread_mutex_unlock(&descriptor_lock);
+        if (reopened == 0 && i_node != ROOT_DIRECTORY_I_NODE){
+            drop_write_buffer(i_node);
+            drop_block_map(i_node);
+        }
+        pthread_rwlock_unlock(&i_node_locks[i_node]);
+
+        commit_if_needed();
         return 0; 
     }
 }
  
-int sfs_fwrite(int fileID, const char *buf, int length){
-    //Getting the amount of bytes left to write initially
-    int bytes_left_to_write = length; 
+//Writing at the read_write_pointer of a descriptor and moving it past the written bytes (sfs_fwrite()), a pointer past the end of the file leaves a hole
+int write_descriptor(int fileID, const char *buf, int length){
+    int read_write_pointer;
 
-    //Getting the i_node_number using fileID from the FDT
-    int i_node = file_descriptor_table[fileID].i_node_number;
+    //Getting the i_node_number using fileID from the FDT, writers of the same file go one at a time
+    require_free_bit_map();
+    int i_node = lock_descriptor_i_node(fileID, 1, &read_write_pointer);
     
     //Checking if the file we are trying to write to is open
     if (i_node == -1){
         return 0; 
     }
 
-    //Getting the current file size 
-    int current_i_node_size = i_node_table[i_node].file_size; 
-    int i_node_file_size_before = i_node_table[i_node].file_size; 
-
-    //Checking if writing 'length' bytes to this file will exceed the established max file size
-    if (i_node_table[i_node].file_size + length >= 274432){
+    //Writes start at the read_write_pointer, even when sfs_fseek() moved it past the end of the file
+    int end;
+    int written = buffer_write(i_node, read_write_pointer, buf, length, &end);
 
-        //Decreasing the number of bytes to write to avoid exceeding the limit
-        bytes_left_to_write = 274431 - i_node_table[i_node].file_size;
+    //Moving the read_write_pointer in FDT to the end of the written data
+    if (written > 0){
+        pthread_mutex_lock(&descriptor_lock);
+        if (descriptor_i_node(fileID) == i_node){
+            file_descriptor_table[fileID].read_write_pointer = end;
+        }
+        pthread_mutex_unlock(&descriptor_lock);
     }
 
-    //Identifying the block that will be used to write at each iteration (0-11 means direct pointer blocks and 12-268 means indirect pointer blocks)
-    int current_block_pointer = file_descriptor_table[fileID].read_write_pointer / 1024; 
-
-    //Creating a pointer to keep track of how much of the "buf" array has been written to the disk, initially nothing is written, so = 0
-    int temp_write_pointer = 0; 
-
-    //Case where the read_write_pointer of the file points to a location that is within the direct pointer blocks (between 0 and 11)
-    if (current_block_pointer <= 11){
-
-        //Starting from the current direct pointer, filling up the direct pointer blocks until we exceed the direct block limit (0 to 12288)
-        for (int i = current_block_pointer; i < 12; i++){
-
-            //Calculating the number of free bytes that can be written to the current direct block i 
-            int remaining_bytes_in_block = (1024 * (i + 1)) - current_i_node_size; 
-            int bytes_already_in_block = remaining_bytes_in_block;
-
-            //Special case where no bytes can be written at all 
-            if (remaining_bytes_in_block == 0){
-                continue; 
-            }
-            else{
-                //The i_node table never allocated this direct_pointer, must find slot in the FBM
-                if (i_node_table[i_node].direct_pointer[i] == -1){
-
-                    //Search bitmap to find next empty block and set the current direct_pointer to that block
-                    for (int j = 0; j < 1024; j++){
-                        if (free_bit_map[j] == '1'){
-                            free_bit_map[j] = '0'; 
-                            i_node_table[i_node].direct_pointer[i] = j;
-                            break;  
-                        }
-                    }
-                }
-
-                //Initializing char array to hold the content from the disk block
-                char block_data[1024];
-
-                //Reading the data of the current block from the disk
-                read_blocks(i_node_table[i_node].direct_pointer[i], 1, (void *)block_data); 
-
-                //Case where the data coming in doesn't completely fill up the block 
-                if (remaining_bytes_in_block >= bytes_left_to_write){
-                    remaining_bytes_in_block = bytes_left_to_write; 
-                }
-
-                //Updating the size of the i-node 
-                current_i_node_size = current_i_node_size + remaining_bytes_in_block; 
-
-                //Copying a part of the data in buf into the block
-                //(1024-bytes_already_in_block) ensures that we don't overwrite data that was previously written
-                memcpy(block_data + (1024-bytes_already_in_block), buf + temp_write_pointer, remaining_bytes_in_block); 
+    pthread_rwlock_unlock(&i_node_locks[i_node]);
+    commit_if_needed();
+    return written;
+}
 
-                //Updating how much of the given data was written. 
-                temp_write_pointer = temp_write_pointer + remaining_bytes_in_block;
+int sfs_fwrite(int fileID, const char *buf, int length){
+    int written = write_descriptor(fileID, buf, length);
 
-                //Write the new block back into the disk
-                write_blocks(i_node_table[i_node].direct_pointer[i], 1, (void *)block_data);
+    //Case where the disk filled up while freed blocks wait for a commit, the rest is written once they are free
+    if (written >= 0 && written < length && reclaim_freed_blocks() == 1){
+        written = written + write_descriptor(fileID, buf + written, length - written);
+    }
+    return written;
+}
 
-                //Updating the number of bytes left to write
-                bytes_left_to_write = bytes_left_to_write - remaining_bytes_in_block; 
 
-                //All the data from buf has been copied into the disk
-                if (bytes_left_to_write == 0){
-                    i_node_table[i_node].file_size = current_i_node_size;
-                    current_block_pointer = i; 
-                    break; 
-                }
-            }     
+//Reading up to `length` bytes of a file starting at `read_write_pointer`, the caller holds the i-node's lock. Returns the bytes read.
+int read_i_node(int i_node, int read_write_pointer, char *buf, int length){
+    int total_bytes_read = 0; 
+    struct i_node *node = &i_node_table[i_node];
 
-            //Needed for the indirect pointer indexation 
-            current_block_pointer = i; 
-        }
+    //Case where it's trying to read more bytes than the i-node contains - adjusting it
+    if (read_write_pointer >= node->file_size || length <= 0){
+        return 0;
+    }
+    if (length > node->file_size - read_write_pointer){
+        length = node->file_size - read_write_pointer;
     }
 
-    //Case where we need to use the indirect pointer blocks (either read_write_pointer starts here, or direct blocks were not sufficient)
-    if (temp_write_pointer < length){
-
-        //Fixing the current_pointer_block if direct pointer blocks were previously written to
-        if (current_block_pointer == 11){
-            current_block_pointer = 12; 
+    //Case where the data is in the i-node, nothing is read from the disk (bytes past it can only be in the write buffer)
+    if (node->flags & I_NODE_FLAG_INLINE){
+        int inline_bytes = I_NODE_INLINE_BYTES - read_write_pointer;
+        if (inline_bytes > length){
+            inline_bytes = length;
         }
+        if (inline_bytes < 0){
+            inline_bytes = 0;
+        }
+        memcpy(buf, node->map.inline_data + read_write_pointer, inline_bytes);
+        memset(buf + inline_bytes, 0, length - inline_bytes);
+        total_bytes_read = length;
+    }
 
-        //Creating an array for the indirect pointer block with block numbers 
-        uint32_t indirect_block[1024];
+    //Keep reading while there's something to read, one run of physically contiguous blocks at a time
+    while (total_bytes_read < length){
+        int file_offset = read_write_pointer + total_bytes_read;
+        int file_block = file_offset / BLOCK_SIZE;
+        int block_offset = file_offset % BLOCK_SIZE;
+        int blocks_left = (read_write_pointer + length - 1) / BLOCK_SIZE - file_block + 1;
 
-        // Case where the indirect pointer hasn't been used before, need to find free block in FBM
-        if (i_node_table[i_node].indirect_pointer == -1){
+        int run_length;
+        int disk_block = get_block_run(node, file_block, blocks_left, &run_length);
 
-            //Search bitmap to find next empty block and set the pointer to that
-            for (int j = 0; j < 1024; j++){
-                if (free_bit_map[j] == '1'){
-                    free_bit_map[j] = '0'; 
-                    i_node_table[i_node].indirect_pointer = j;
-                    break;  
-                }
-            }
+        //Number of bytes of this run that go into buf
+        int bytes_in_run = run_length * BLOCK_SIZE - block_offset;
+        if (bytes_in_run > length - total_bytes_read){
+            bytes_in_run = length - total_bytes_read;
         }
 
-        // Case where the indirect pointer has been used before, need to fetch it from memory
+        //Case where the blocks were never allocated, they read as zeros
+        if (disk_block == -1){
+            memset(buf + total_bytes_read, 0, bytes_in_run);
+        }
         else{
-            read_blocks(i_node_table[i_node].indirect_pointer, 1, (void *)indirect_block); 
-        }
-        
-        //Will hold specific block numbers stored inside the indirect pointer block
-        int block_index = -1;
-        //Will hold the content of each specific block number stored inside the indirect pointer block
-        char indirect_block_data[1024]; 
-
-        //Keep iterating while there are still bytes to be written
-        while(bytes_left_to_write != 0){
-            
-            //Calculating the number of free bytes that can be written to the current indirect block
-            int remaining_bytes_in_block = (1024 * (current_block_pointer + 1)) - current_i_node_size;
-            int bytes_already_in_block = remaining_bytes_in_block;
-
-            //This indirect block has not been written to before, need to find it in the FBM 
-            if (current_i_node_size <= (1024 * current_block_pointer)){
-                for (int j = 0; j < 1024; j++){
-                    if (free_bit_map[j] == '1'){
-                        free_bit_map[j] = '0'; 
-                        indirect_block[current_block_pointer-12] = j; 
-                        block_index = j;
-                        break;  
-                    }
+            char block_data[BLOCK_SIZE];
+            int bytes_done = 0; //Bytes of this run already copied into buf
+            int run_block = 0; //Block of the run being read
+
+            //Case where the read starts in the middle of the first block (or ends before it does)
+            if (block_offset != 0 || bytes_in_run < BLOCK_SIZE){
+                cache_read_blocks(disk_block, 1, (void *)block_data);
+                bytes_done = BLOCK_SIZE - block_offset;
+                if (bytes_done > bytes_in_run){
+                    bytes_done = bytes_in_run;
                 }
+                memcpy(buf + total_bytes_read, block_data + block_offset, bytes_done);
+                run_block = 1;
             }
 
-            //This indirect block has been written to before, need to fetch it from the disk
-            else{
-                block_index = indirect_block[current_block_pointer-12];
-                read_blocks(block_index, 1, (void *)indirect_block_data);
+            //Whole blocks are read straight into buf with a single call (queued, so the runs of a fragmented file are read together)
+            int whole_blocks = (bytes_in_run - bytes_done) / BLOCK_SIZE;
+            if (whole_blocks > 0){
+                cache_submit_read_blocks(disk_block + run_block, whole_blocks, (void *)(buf + total_bytes_read + bytes_done));
+                bytes_done = bytes_done + whole_blocks * BLOCK_SIZE;
+                run_block = run_block + whole_blocks;
             }
 
-            //Case where the data coming in doesn't completely fill up the block 
-            if (remaining_bytes_in_block >= bytes_left_to_write){
-                remaining_bytes_in_block = bytes_left_to_write; 
+            //Case where the read ends in the middle of the last block
+            if (bytes_done < bytes_in_run){
+                cache_read_blocks(disk_block + run_block, 1, (void *)block_data);
+                memcpy(buf + total_bytes_read + bytes_done, block_data, bytes_in_run - bytes_done);
             }
+        }
 
-            //Updating the size of the i-node 
-            current_i_node_size = current_i_node_size + remaining_bytes_in_block; 
+        total_bytes_read = total_bytes_read + bytes_in_run;
+    }
 
-            //Copying a part of the data in buf into the block
-            //(1024-bytes_already_in_block) ensures that we don't overwrite data that was previously written
-            memcpy(indirect_block_data + (1024 - bytes_already_in_block), buf + temp_write_pointer, remaining_bytes_in_block); 
+    //Every queued run must have landed in buf before returning
+    cache_wait_reads();
 
-            //Updating how much of the given data was written. 
-            temp_write_pointer = temp_write_pointer + remaining_bytes_in_block;
+    //Bytes still in the file's write buffer are newer than its blocks
+    struct write_buffer *buffer = &write_buffers[i_node];
+    int overlap_start = buffer->start > read_write_pointer ? buffer->start : read_write_pointer;
+    int overlap_end = buffer->end < read_write_pointer + total_bytes_read ? buffer->end : read_write_pointer + total_bytes_read;
+    if (overlap_start < overlap_end){
+        memcpy(buf + (overlap_start - read_write_pointer), buffer->data + (overlap_start - buffer->start), overlap_end - overlap_start);
+    }
 
-            //Write the new block back into the disk
-            write_blocks(block_index, 1, (void *)indirect_block_data);
-            //Write the indirect pointer block back into the disk
-            write_blocks(i_node_table[i_node].indirect_pointer, 1, (void *)indirect_block); 
+    return total_bytes_read;
+}
 
-            //Updating the number of bytes left to write
-            bytes_left_to_write = bytes_left_to_write - remaining_bytes_in_block; 
-            
-            //Going to the next block in the indirect pointer 
-            current_block_pointer = current_block_pointer + 1; 
+//=================================================READAHEAD================================================
 
-            //All the data from buf has been copied into the disk
-            if (bytes_left_to_write == 0){
-                i_node_table[i_node].file_size = current_i_node_size;
-                break; 
-            }
-        }
+/*
+A descriptor whose sfs_fread() calls each start where the previous one stopped reads sequentially. Its window then doubles on
+every read and the file blocks up to one window past the read_write_pointer are handed to cache_prefetch_blocks(), which reads
+them into the block cache on its own thread. A read anywhere else (after a seek or a write) closes the window again,
+sfs_pread() leaves it alone.
+*/
+
+//Updating the readahead state of a descriptor after a read of [position, position + length), gives the file blocks to prefetch
+//(the caller holds descriptor_lock)
+void update_readahead(struct file_descriptor_entry *entry, int position, int length, int file_size, int *first, int *last){
+    int first_block = position / BLOCK_SIZE;
+    int next_block = (position + length) / BLOCK_SIZE;
+    int file_blocks = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    *first = 0;
+    *last = 0;
+
+    //Case where the read does not continue the previous one
+    if (first_block != entry->readahead_next || readahead_setting == 0){
+        entry->readahead_window = 0;
+        entry->readahead_end = 0;
+        entry->readahead_next = next_block;
+        return;
+    }
+    entry->readahead_next = next_block;
+
+    //Window never holds more than a quarter of the cache, blocks past that would be evicted before they are read
+    int max_window = readahead_setting;
+    if (max_window > cache_size_setting / 4){
+        max_window = cache_size_setting / 4;
+    }
+    if (entry->readahead_window == 0){
+        entry->readahead_window = MIN_READAHEAD_BLOCKS;
+    }
+    else if (entry->readahead_window * 2 <= max_window){
+        entry->readahead_window = entry->readahead_window * 2;
+    }
+    else{
+        entry->readahead_window = max_window;
+    }
+    if (entry->readahead_window > max_window){
+        entry->readahead_window = max_window;
+    }
+    if (entry->readahead_window <= 0){
+        entry->readahead_window = 0;
+        return;
     }
 
-    //Updating the i_node_table on the disk  
-    write_blocks(1, 6, i_node_table); 
-    //Updating the free_bit_map on the disk
-    write_blocks(1023, 1, free_bit_map); 
+    //Case where more than half a window is still prefetched, prefetching waits so requests stay large
+    if (entry->readahead_end - next_block > entry->readahead_window / 2){
+        return;
+    }
 
-    //Moving the read_write_pointer in FDT to its prev_value + bytes written
-    file_descriptor_table[fileID].read_write_pointer = file_descriptor_table[fileID].read_write_pointer + (i_node_table[i_node].file_size - i_node_file_size_before);
-    
-    return (i_node_table[i_node].file_size - i_node_file_size_before);
+    *first = next_block > entry->readahead_end ? next_block : entry->readahead_end;
+    *last = next_block + entry->readahead_window;
+    if (*last > file_blocks){
+        *last = file_blocks;
+    }
+    if (*first < *last){
+        entry->readahead_end = *last;
+    }
 }
 
+//Queueing the disk blocks of file blocks [first, last) for prefetching, one request per run (the caller holds the i-node's lock)
+void prefetch_file_blocks(int i_node, int first, int last){
+    struct i_node *node = &i_node_table[i_node];
+    int file_block = first;
+    while (file_block < last){
+        int run_length;
+        int disk_block = get_block_run(node, file_block, last - file_block, &run_length);
+
+        //Case where the blocks were never allocated, there is nothing to read
+        if (disk_block != -1){
+            cache_prefetch_blocks(disk_block, run_length);
+        }
+        file_block = file_block + run_length;
+    }
+}
 
 int sfs_fread(int fileID, char *buf, int length){
-    int total_bytes_read = 0; 
 
-    //Need to get the read/write pointer from FDT
-    int read_write_pointer = file_descriptor_table[fileID].read_write_pointer;
-
-    //Get the i-node using fileID from the file_descriptor_table 
-    int i_node = file_descriptor_table[fileID].i_node_number;
+    //Get the i-node and the read/write pointer using fileID from the file_descriptor_table, readers share the i-node
+    int read_write_pointer;
+    int i_node = lock_descriptor_i_node(fileID, 0, &read_write_pointer);
 
     //Checking if the file we are trying to read from is open
     if (i_node == -1){
         return -1; 
     }
 
-    //Getting the current size of the i-node
-    int i_node_size = i_node_table[i_node].file_size; 
+    int total_bytes_read = read_i_node(i_node, read_write_pointer, buf, length);
 
-    //Calculating which block the read_write_pointer is pointing to
-    int pointed_block = read_write_pointer / 1024; 
-    
-    //Used to adjust the reading process if it's not started from the beginning of a block (updated for each block)
-    int read_write_offset = read_write_pointer - (pointed_block * 1024); 
+    //Updating the read_write_pointer and the readahead window
+    int prefetch_first = 0;
+    int prefetch_last = 0;
+    pthread_mutex_lock(&descriptor_lock);
+    if (descriptor_i_node(fileID) == i_node){
+        file_descriptor_table[fileID].read_write_pointer = read_write_pointer + total_bytes_read; 
+        if (total_bytes_read > 0){
+            update_readahead(&file_descriptor_table[fileID], read_write_pointer, total_bytes_read, i_node_table[i_node].file_size, &prefetch_first, &prefetch_last);
+        }
+    }
+    pthread_mutex_unlock(&descriptor_lock);
+
+    //Blocks that sequential reads will want next are read into the cache in the background
+    if (prefetch_first < prefetch_last){
+        prefetch_file_blocks(i_node, prefetch_first, prefetch_last);
+    }
 
-    //Getting the number of blocks to read
-    int number_of_block_to_read = length / 1024; 
+    pthread_rwlock_unlock(&i_node_locks[i_node]);
+    return total_bytes_read;
+}
 
-    int block_index = -1; 
-    uint32_t block_indices[1024];
+int sfs_pread(int fileID, char *buf, int length, int offset){
 
-    //Case where indirect blocks are needed, fetch indirect pointer block from disk
-    if (number_of_block_to_read >= 12){
-        block_index = i_node_table[i_node].indirect_pointer;
-        read_blocks(block_index, 1, (void *)block_indices); 
+    //Same as sfs_fread at `offset`, the read_write_pointer is neither used nor moved
+    int read_write_pointer;
+    int i_node = lock_descriptor_i_node(fileID, 0, &read_write_pointer);
+    if (i_node == -1){
+        return -1;
     }
 
-    int remaining_bytes_to_read = length; 
-
-    //Case where it's trying to read more bytes than the i-node contains - adjusting it
-    if (i_node_size < length){
-        remaining_bytes_to_read = i_node_size; 
+    int total_bytes_read = 0;
+    if (offset >= 0){
+        total_bytes_read = read_i_node(i_node, offset, buf, length);
     }
 
-    //Keep reading while there's something to read
-    while (remaining_bytes_to_read > 0){
-        char block_data[1024];
+    pthread_rwlock_unlock(&i_node_locks[i_node]);
+    return offset >= 0 ? total_bytes_read : -1;
+}
 
-        //Case where the read_write_pointer is somewhere between 0 and 12288 (within the bounds of direct pointers)
-        if (pointed_block <= 11){
-            //Getting the direct block from the disk
-            block_index = i_node_table[i_node].direct_pointer[pointed_block];
-            read_blocks(block_index, 1, (void *)block_data); 
+//Writing at `offset` of a descriptor's file (sfs_pwrite())
+int pwrite_descriptor(int fileID, const char *buf, int length, int offset){
 
-            //Case where the entire content of the block can be read (copied) into buf
-            if (remaining_bytes_to_read >= 1024){
-                //Copying the data into buf 
-                memcpy(buf + total_bytes_read, block_data + read_write_offset, 1024 - read_write_offset); 
-                remaining_bytes_to_read = remaining_bytes_to_read - (1024 - read_write_offset); 
-                total_bytes_read = total_bytes_read + (1024 - read_write_offset); 
-                read_write_offset = 0; 
-            }
+    //Same as sfs_fwrite at `offset`, the read_write_pointer is neither used nor moved
+    int read_write_pointer;
+    require_free_bit_map();
+    int i_node = lock_descriptor_i_node(fileID, 1, &read_write_pointer);
+    if (i_node == -1){
+        return -1;
+    }
 
-            //Case where we have less than 1024 bytes left to read
-            else{
-                
-                //Case where the data cannot be copied fully into the block! will need another read
-                if (read_write_offset + remaining_bytes_to_read > 1024){
-                    memcpy(buf + total_bytes_read, block_data + read_write_offset, (1024 - read_write_offset));  
-                    remaining_bytes_to_read = remaining_bytes_to_read - (1024 - read_write_offset); 
-                    total_bytes_read = total_bytes_read + (1024 - read_write_offset);
-                }
+    int written = 0;
+    if (offset >= 0){
+        int end;
+        written = buffer_write(i_node, offset, buf, length, &end);
+    }
 
-                //Case where the data can be fully copied into the block
-                else{
-                    memcpy(buf + total_bytes_read, block_data + read_write_offset, remaining_bytes_to_read); 
-                    total_bytes_read = total_bytes_read + remaining_bytes_to_read;
-                    remaining_bytes_to_read = 0; 
-                }
-                
-                //Resetting the offset for the next block
-                read_write_offset = 0; 
-            }
-        }
+    pthread_rwlock_unlock(&i_node_locks[i_node]);
+    commit_if_needed();
+    return offset >= 0 ? written : -1;
+}
 
-        //Case where we need to access the indirect blocks (either read_write_pointer points there or need to read beyond direct blocks)
-        else{
-            block_index = block_indices[pointed_block-12];
-            read_blocks(block_index, 1, (void *)block_data);
+int sfs_pwrite(int fileID, const char *buf, int length, int offset){
+    int written = pwrite_descriptor(fileID, buf, length, offset);
 
-            //Case where the entire content of the block can be read (copied) into buf
-            if (remaining_bytes_to_read >= 1024){
-                memcpy(buf + total_bytes_read, block_data + read_write_offset, 1024 - read_write_offset); 
-                remaining_bytes_to_read = remaining_bytes_to_read - (1024 - read_write_offset);
-                total_bytes_read = total_bytes_read + (1024 - read_write_offset);
-                read_write_offset = 0;
-                
-            }
+    //Case where the disk filled up while freed blocks wait for a commit, the rest is written once they are free (a bad descriptor or offset is -1)
+    if (written >= 0 && written < length && reclaim_freed_blocks() == 1){
+        int more = pwrite_descriptor(fileID, buf + written, length - written, offset + written);
+        if (more > 0){
+            written = written + more;
+        }
+    }
+    return written;
+}
 
-            //Case where we have less than 1024 bytes left to read
-            else{
+/*
+Allocating the blocks of bytes [offset, offset + length) of a file that are holes, without writing them (sfs_fallocate()). Each
+missing run is requested from the allocator as a whole, so the file is laid out contiguously when it grows into them. The file
+size does not change, only the holes below the end of the file are zeroed since they are part of its data. Returns 0, or -1 if
+not every block could be allocated.
+*/
+int preallocate_i_node(int i_node, int offset, int length){
+    struct i_node *node = &i_node_table[i_node];
 
-                //Case where the data cannot be copied fully into the block! will need another read
-                if (read_write_offset + remaining_bytes_to_read > 1024){
-                    memcpy(buf + total_bytes_read, block_data + read_write_offset, (1024 - read_write_offset));  //CHANGE, WATCHOUT**********************************
-                    remaining_bytes_to_read = remaining_bytes_to_read - (1024 - read_write_offset); 
-                    total_bytes_read = total_bytes_read + (1024 - read_write_offset);
-                }
+    if (offset < 0 || length <= 0 || (long long)offset + length > INT_MAX){
+        return -1;
+    }
 
-                //Case where the data can be fully copied into the block
-                else{
-                    memcpy(buf + total_bytes_read, block_data + read_write_offset, remaining_bytes_to_read);  //CHANGE, WATCHOUT**********************************
-                    total_bytes_read = total_bytes_read + remaining_bytes_to_read;
-                    remaining_bytes_to_read = 0; 
-                }
+    //Buffered bytes get their blocks first, and data kept in the i-node moves to a block so the file can have more
+    flush_write_buffer(i_node);
+    if ((node->flags & I_NODE_FLAG_INLINE) && move_inline_data(i_node) != 0){
+        return -1;
+    }
 
-                //Resetting the offset for the next block
-                read_write_offset = 0;
+    //Case where a pointer i-node cannot reach the end of the range
+    if ((node->flags & I_NODE_FLAG_EXTENTS) == 0 && (long long)offset + length > MAX_POINTER_BLOCKS * BLOCK_SIZE){
+        return -1;
+    }
+
+    int first_block = offset / BLOCK_SIZE;
+    int last_block = (offset + length - 1) / BLOCK_SIZE;
+    int size_blocks = (node->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    //Holes inside the file, one run at a time
+    int file_block = first_block;
+    while (file_block <= last_block && file_block < size_blocks){
+        int run_end = last_block < size_blocks - 1 ? last_block : size_blocks - 1;
+        int run_length;
+        int disk_block = get_block_run(node, file_block, run_end - file_block + 1, &run_length);
+        if (disk_block == -1){
+            int allocated_blocks = allocate_file_blocks(i_node, file_block, file_block + run_length - 1);
+            zero_file_blocks(i_node, file_block, file_block + allocated_blocks - 1);
+            if (allocated_blocks < run_length){
+                return -1;
             }
         }
+        file_block = file_block + run_length;
+    }
+
+    //Blocks past the end of the file, they continue the file's last run when the disk allows it
+    if (file_block <= last_block && allocate_file_blocks(i_node, file_block, last_block) < last_block - file_block + 1){
+        return -1;
+    }
+    return 0;
+}
 
-        pointed_block = pointed_block + 1; 
+//Allocating a range of a descriptor's file (sfs_fallocate())
+int fallocate_descriptor(int fileID, int offset, int length){
+
+    //Same locking as sfs_fwrite, the blocks are allocated but nothing is written to them
+    int read_write_pointer;
+    require_free_bit_map();
+    int i_node = lock_descriptor_i_node(fileID, 1, &read_write_pointer);
+    if (i_node == -1){
+        return -1;
     }
 
-    //Updating the read_write_pointer
-    file_descriptor_table[fileID].read_write_pointer = file_descriptor_table[fileID].read_write_pointer + total_bytes_read; 
+    int result = preallocate_i_node(i_node, offset, length);
 
-    return total_bytes_read;
+    pthread_rwlock_unlock(&i_node_locks[i_node]);
+    commit_if_needed();
+    return result;
+}
+
+int sfs_fallocate(int fileID, int offset, int length){
+    int result = fallocate_descriptor(fileID, offset, length);
+
+    //Case where the disk filled up while freed blocks wait for a commit, the blocks still missing are allocated once they are free
+    if (result != 0 && reclaim_freed_blocks() == 1){
+        result = fallocate_descriptor(fileID, offset, length);
+    }
+    return result;
 }
 
 int sfs_fseek(int fileID, int loc){
+    int result = 0;
 
     //Checking whether the current fileID points to an i-node that is use (AKA file exists) 
-    if (file_descriptor_table[fileID].i_node_number == -1){
-        return -1; 
+    pthread_mutex_lock(&descriptor_lock);
+    if (descriptor_i_node(fileID) == -1){
+        result = -1; 
     }
     //Case where the i-node is valid and exists
     else{
         file_descriptor_table[fileID].read_write_pointer = loc; 
-        return 0; 
+    }
+    pthread_mutex_unlock(&descriptor_lock);
+    return result;
+
+}
+
+/*
+First byte at or after `offset` that holds data (want_data = 1) or is in a hole (want_data = 0), the caller holds the i-node's lock.
+Bytes in the write buffer are data, and the end of the file counts as a hole. Returns -1 if there is no such byte in the file.
+*/
+int find_data_or_hole(int i_node, int offset, int want_data){
+    struct i_node *node = &i_node_table[i_node];
+    struct write_buffer *buffer = &write_buffers[i_node];
+    int file_size = node->file_size;
+    int file_blocks = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    if (offset < 0 || offset >= file_size){
+        return -1;
+    }
+
+    //Case where the data is in the i-node, the file has no holes
+    if (node->flags & I_NODE_FLAG_INLINE){
+        return want_data ? offset : file_size;
+    }
+
+    int position = offset;
+    while (position < file_size){
+
+        //Case where the byte is in the write buffer
+        if (position >= buffer->start && position < buffer->end){
+            if (want_data){
+                return position;
+            }
+            position = buffer->end;
+            continue;
+        }
+
+        int file_block = position / BLOCK_SIZE;
+        int run_length;
+        int is_data = get_block_run(node, file_block, file_blocks - file_block, &run_length) != -1;
+        if (is_data == want_data){
+            return position;
+        }
+
+        //Skipping the run, a hole ends early where the write buffer starts
+        int next = (file_block + run_length) * BLOCK_SIZE;
+        if (want_data && buffer->end > buffer->start && buffer->start > position && buffer->start < next){
+            next = buffer->start;
+        }
+        position = next;
+    }
+    return want_data ? -1 : file_size;
+}
+
+//Moving the read_write_pointer to the next data (want_data = 1) or hole at or after `offset`, returns the new position or -1
+int seek_data_or_hole(int fileID, int offset, int want_data){
+    int read_write_pointer;
+    int i_node = lock_descriptor_i_node(fileID, 0, &read_write_pointer);
+    if (i_node == -1){
+        return -1;
     }
 
+    int position = find_data_or_hole(i_node, offset, want_data);
+    if (position != -1){
+        pthread_mutex_lock(&descriptor_lock);
+        if (descriptor_i_node(fileID) == i_node){
+            file_descriptor_table[fileID].read_write_pointer = position;
+        }
+        pthread_mutex_unlock(&descriptor_lock);
+    }
+
+    pthread_rwlock_unlock(&i_node_locks[i_node]);
+    return position;
+}
+
+int sfs_seek_data(int fileID, int offset){
+    return seek_data_or_hole(fileID, offset, 1);
+}
+
+int sfs_seek_hole(int fileID, int offset){
+    return seek_data_or_hole(fileID, offset, 0);
 }
 
 int sfs_getfilesize(const char* path){
     int filesize = -1; 
 
     //Looking for the file in the Directory Table
-    for (int i = 0; i < 96; i++){
-        if (directory_table[i].entry_used == '1' && strcmp(directory_table[i].filename, path) == 0){
-            filesize = i_node_table[directory_table[i].i_node_number].file_size;
-            break; 
-        }
+    require_directory();
+    pthread_rwlock_rdlock(&directory_lock);
+    int entry = directory_lookup(path);
+    if (entry != -1){
+        int i_node = directory_table[entry].i_node_number;
+        require_i_node(i_node);
+        pthread_rwlock_rdlock(&i_node_locks[i_node]);
+        filesize = i_node_table[i_node].file_size;
+        pthread_rwlock_unlock(&i_node_locks[i_node]);
     }
+    pthread_rwlock_unlock(&directory_lock);
 
     return filesize;
 }
 
 int sfs_getnextfilename(char *fname){
 
+    int found = 0;
+
     //Looking for the next file in the Directory Table and updating the `current_file_read` pointer
-    for (int i = (current_file_read + 1); i < 96; i++){
+    require_directory();
+    pthread_rwlock_wrlock(&directory_lock);
+    for (int i = (current_file_read + 1); i < directory_table_length; i++){
         if (directory_table[i].entry_used == '1'){
             current_file_read = i; 
             strcpy(fname, directory_table[i].filename); 
-            return 1; 
+            found = 1; 
+            break;
         }
     }
+    pthread_rwlock_unlock(&directory_lock);
     
-    return 0; 
+    return found; 
 }
 
 int sfs_remove(char *file){
     int i_node = -1; 
-    int node_filesize = -1; 
 
-    //Get the inode from the directory table and set it as unused
-    for (int i = 0; i < 96; i++){
-        if (strcmp(directory_table[i].filename, file) == 0){
-            i_node = directory_table[i].i_node_number;
-            directory_table[i].entry_used = '0'; // 0 == free | 1 == used
-            break; 
-        }
+    //Get the inode from the directory table and set it as unused (its blocks go back to the free bitmap)
+    require_directory();
+    require_free_bit_map();
+    pthread_rwlock_wrlock(&directory_lock);
+    int entry = directory_lookup(file);
+    if (entry != -1){
+        i_node = directory_table[entry].i_node_number;
+        require_i_node(i_node);
+        directory_index_remove(entry);
+        free_directory_entry(entry);
     }
 
     //If the file doesn't exist, we cannot remove it from the system
     if (i_node == -1){
+        pthread_rwlock_unlock(&directory_lock);
         return -1; 
     }
 
-    //Update the Directory Table on the disk 
-    write_blocks(7, 2, directory_table); 
+    //Waiting for the readers and writers of the file to finish
+    pthread_rwlock_wrlock(&i_node_locks[i_node]);
 
     //If the file was open, close (remove from FDT) 
-    for (int i = 0; i < 10; i++){
-        if (file_descriptor_table[i].i_node_number == i_node){
-            file_descriptor_table[i].i_node_number = -1; 
-            break; 
-        }
+    pthread_mutex_lock(&descriptor_lock);
+    if (i_node_descriptor[i_node] != -1){
+        release_descriptor(i_node_descriptor[i_node]);
     }
+    pthread_mutex_unlock(&descriptor_lock);
 
-    node_filesize = i_node_table[i_node].file_size;
-
-    //Setting the file_size as empty to indicate that th i-node is no longer in use
-    i_node_table[i_node].file_size = -1; 
-    
-    //Getting the number of blocks used for this file
-    int number_of_blocks = node_filesize / 1024; 
-
-    int block_index = 0; 
+    //Giving the file's blocks back to the free bitmap, its buffered bytes are dropped
+    drop_write_buffer(i_node);
+    free_file_blocks(i_node);
 
-    //Cas ewhere the file was not empty
-    if (node_filesize != 0){
-        //Free the blocks used for the direct pointers 
-        while (1){
-            
-            //Freeing the block used for the direct pointer
-            free_bit_map[i_node_table[i_node].direct_pointer[block_index]] = '1'; 
+    //Marking the i-node as no longer in use, its block of the I-Node Table is written with the next fclose/sync
+    free_i_node(i_node);
 
-            //Case where we finished clearing all the used indirect blocks -> exit loop
-            if (block_index == number_of_blocks || block_index == 11){
-                break; 
-            }
+    pthread_rwlock_unlock(&i_node_locks[i_node]);
+    pthread_rwlock_unlock(&directory_lock);
+    commit_if_needed();
+    return 0; 
+}
+int sfs_clone(char *source, char *destination){
 
-            block_index++; 
+    //Checking if the new name is too long (exceeds 15 characters + '\0')
+    if (strlen(destination) > 15){
+        return -1;
+    }
+    require_directory();
+    require_free_bit_map();
+
+    //The source must exist and the destination must not, both are checked with the directory to ourselves
+    pthread_rwlock_wrlock(&directory_lock);
+    int source_entry = directory_lookup(source);
+    if (source_entry == -1 || directory_lookup(destination) != -1){
+        pthread_rwlock_unlock(&directory_lock);
+        return -1;
+    }
+    int source_i_node = directory_table[source_entry].i_node_number;
+    require_i_node(source_i_node);
+
+    //Taking an i-node and a directory entry for the clone, the same way sfs_fopen() creates a file
+    int clone_i_node = allocate_i_node();
+    int clone_entry = -1;
+    if (clone_i_node != -1){
+        clone_entry = allocate_directory_entry();
+    }
+    if (clone_entry == -1){
+        if (clone_i_node != -1){
+            free_i_node(clone_i_node);
         }
+        pthread_rwlock_unlock(&directory_lock);
+        return -1;
+    }
+    init_i_node(&i_node_table[clone_i_node], I_NODE_FLAG_EXTENTS | I_NODE_FLAG_SHARED);
+
+    //Buffered bytes of the source get their blocks first, so every byte of the file is in a block the clone can share
+    pthread_rwlock_wrlock(&i_node_locks[source_i_node]);
+    flush_write_buffer(source_i_node);
+    struct i_node *node = &i_node_table[source_i_node];
+    int blocks = (node->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    //Case where the data is in the i-node, the clone gets a copy of it
+    if (node->flags & I_NODE_FLAG_INLINE){
+        i_node_table[clone_i_node] = *node;
+        blocks = 0;
+    }
 
-        //Case where there are more than 12 blocks, then the indirect pointer is involved
-        if (number_of_blocks >= 12) {
-            block_index = 12; 
-            uint32_t indirect_block[1024];
-
-            //Getting the indirect block from the disk
-            read_blocks(i_node_table[i_node].indirect_pointer, 1, (void *)indirect_block);
-
-            //Clearing the slot in the FBM for the indirect index block 
-            free_bit_map[i_node_table[i_node].indirect_pointer] = '1'; 
+    //Every run of the source is mapped into the clone with one more reference on its blocks (holes stay holes)
+    int file_block = 0;
+    while (file_block < blocks){
+        int run_length;
+        int disk_block = get_block_run(node, file_block, blocks - file_block, &run_length);
+        if (disk_block != -1){
 
-            //Going over the block numbers shown in the indirect pointer and "freeing" them in the FBM
-            while (block_index <= number_of_blocks){
-                free_bit_map[indirect_block[block_index-12]] = '1'; 
-                block_index++; 
+            //Case where the clone cannot be built (too many references or no room for its block map), undoing it
+            if (add_block_references(disk_block, run_length) != 0){
+                break;
+            }
+            if (map_file_blocks(clone_i_node, file_block, disk_block, run_length) != 0){
+                release_blocks(disk_block, run_length);
+                break;
             }
         }
-        //Update the FBM  on the disk 
-        write_blocks(1023, 1, free_bit_map);
+        file_block = file_block + run_length;
+    }
+    if (file_block < blocks){
+        pthread_rwlock_unlock(&i_node_locks[source_i_node]);
+        free_file_blocks(clone_i_node);
+        drop_block_map(clone_i_node);
+        free_i_node(clone_i_node);
+        free_directory_entry(clone_entry);
+        pthread_rwlock_unlock(&directory_lock);
+        return -1;
     }
 
-    //Update the I-Node Table on the disk 
-    write_blocks(1, 6, i_node_table); 
-
-    return 0; 
-}
\ No newline at end of file
+    //Writes to either file now copy the blocks they share first
+    i_node_table[clone_i_node].file_size = node->file_size;
+    if (blocks > 0){
+        node->flags = node->flags | I_NODE_FLAG_SHARED;
+    }
+    mark_i_node_dirty(source_i_node);
+    mark_i_node_dirty(clone_i_node);
+    pthread_rwlock_unlock(&i_node_locks[source_i_node]);
+
+    directory_table[clone_entry].entry_used = '1';
+    strcpy(directory_table[clone_entry].filename, destination);
+    directory_table[clone_entry].i_node_number = clone_i_node;
+    mark_directory_dirty(clone_entry);
+    directory_index_insert(clone_entry);
+
+    pthread_rwlock_unlock(&directory_lock);
+    commit_if_needed();
+    return 0;
+}
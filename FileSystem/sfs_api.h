@@ -1,8 +1,42 @@
 #ifndef SFS_API_H
 #define SFS_API_H
 
+//Eviction policies for the block cache
+#define SFS_CACHE_LRU 0
+#define SFS_CACHE_CLOCK 1
+
+//Backends for the disk file (same values as DISK_BACKEND_* in disk_emu.h)
+#define SFS_DISK_STDIO 0
+#define SFS_DISK_MMAP 1
+#define SFS_DISK_PREAD 2
+#define SFS_DISK_DIRECT 3
+
 void mksfs(int);
 
+int mksfs_geometry(int, int, int);
+
+void sfs_configure_cache(int, int);
+
+void sfs_configure_disk(int);
+
+int sfs_disk_backend();
+
+void sfs_configure_readahead(int);
+
+long sfs_time_to_first_open();
+
+int sfs_sync();
+
+//A snapshot is kept on the disk until it is deleted, so it survives unmounts and crashes. While it is kept, a write that
+//has no free block left for the data the snapshot still holds fails. sfs_snapshot_export() writes it out as a disk image.
+int sfs_snapshot();
+
+int sfs_snapshot_export(const char*);
+
+int sfs_snapshot_delete();
+
+int sfs_fsync(int);
+
 int sfs_getnextfilename(char*);
 
 int sfs_getfilesize(const char*);
@@ -15,8 +49,20 @@ int sfs_fwrite(int, const char*, int);
 
 int sfs_fread(int, char*, int);
 
+int sfs_pwrite(int, const char*, int, int);
+
+int sfs_pread(int, char*, int, int);
+
+int sfs_fallocate(int, int, int);
+
 int sfs_fseek(int, int);
 
+int sfs_seek_data(int, int);
+
+int sfs_seek_hole(int, int);
+
 int sfs_remove(char*);
 
+int sfs_clone(char*, char*);
+
 #endif
@@ -0,0 +1,618 @@
+#include "sfs_cache.h"
+#include "sfs_api.h"
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<pthread.h>
+#include "disk_emu.h"
+#include "disk_async.h"
+
+/*
+Notes:
+1. The cache sits between sfs_api.c and disk_emu.c, every block goes through cache_read_blocks/cache_write_blocks
+2. Writes are write-back: a block is only sent to the disk when it gets evicted or when cache_sync() is called. A block whose
+   write fails stays dirty, and cache_sync() returns -1 until it reaches the disk
+3. Eviction is either LRU (doubly linked list of slots) or CLOCK (one reference bit per slot), chosen at cache_init()
+4. Consecutive missing blocks are fetched with one read_blocks call, and transfers larger than half the cache skip it entirely
+5. cache_sync() and cache_submit_read_blocks() queue their disk transfers on disk_async.c so several are in flight at once
+6. Every call of the cache API holds cache_lock, so the file system can call it from several threads
+7. cache_prefetch_blocks() only queues the blocks, a prefetch thread reads them into the cache while the caller moves on
+8. The function set with cache_set_write_hook() is called before cache_lock is taken by every cache_write_blocks(), so the file
+   system can refuse a write to blocks that must not change (the ones a snapshot still uses), cache_write_blocks() then returns -1
+*/
+
+//Most prefetch requests waiting for the prefetch thread, later ones are dropped
+#define PREFETCH_QUEUE_LENGTH 16
+
+struct cache_slot{
+    int block_number; //-1 == free slot | x >= 0 == disk block x is cached here
+    char dirty; //1 == the cached copy is newer than the disk
+    char referenced; //Reference bit for the CLOCK policy
+    int lru_prev; //Neighbours in the LRU list (-1 == none)
+    int lru_next;
+    int hash_next; //Next slot in the same hash bucket (-1 == end of chain)
+};
+
+struct cache_slot *cache_slots = NULL;
+char *cache_data = NULL; //capacity * block_size bytes, slot i owns [i*block_size, (i+1)*block_size)
+int *cache_buckets = NULL;
+
+int cache_capacity = 0;
+int cache_block_size = 0;
+int cache_policy = SFS_CACHE_LRU;
+int cache_bucket_count = 0;
+
+//LRU list: head is the most recently used slot, tail is the next victim
+int lru_head = -1;
+int lru_tail = -1;
+
+//CLOCK hand: next slot to be examined for eviction
+int clock_hand = 0;
+
+//Held by every cache API call (slots, LRU list and hash chains change on reads too)
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Called with the blocks of every cache_write_blocks() before they change, -1 == the write is refused (NULL == none)
+int (*write_hook)(int start_address, int nblocks) = NULL;
+
+//Number of times the cache wrote blocks to the disk, a prefetch that overlaps one of these writes is thrown away
+unsigned int disk_write_count = 0;
+
+//Prefetch requests (runs of disk blocks) waiting for the prefetch thread, a circular queue
+struct prefetch_request{
+    int start_address;
+    int nblocks;
+};
+struct prefetch_request prefetch_queue[PREFETCH_QUEUE_LENGTH];
+int prefetch_head = 0;
+int prefetch_count = 0;
+int prefetch_running = 0; //1 == the prefetch thread was started
+int prefetch_stopping = 0; //1 == the prefetch thread must exit
+pthread_t prefetch_thread;
+pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t prefetch_ready = PTHREAD_COND_INITIALIZER;
+
+//=============================================HELPERS======================================================
+
+int hash_block(int block_number){
+    return (int)(((unsigned int)block_number * 2654435761u) & (unsigned int)(cache_bucket_count - 1));
+}
+
+void lru_unlink(int slot){
+    if (cache_slots[slot].lru_prev != -1){
+        cache_slots[cache_slots[slot].lru_prev].lru_next = cache_slots[slot].lru_next;
+    }
+    else{
+        lru_head = cache_slots[slot].lru_next;
+    }
+
+    if (cache_slots[slot].lru_next != -1){
+        cache_slots[cache_slots[slot].lru_next].lru_prev = cache_slots[slot].lru_prev;
+    }
+    else{
+        lru_tail = cache_slots[slot].lru_prev;
+    }
+    cache_slots[slot].lru_prev = -1;
+    cache_slots[slot].lru_next = -1;
+}
+
+void lru_push_front(int slot){
+    cache_slots[slot].lru_prev = -1;
+    cache_slots[slot].lru_next = lru_head;
+    if (lru_head != -1){
+        cache_slots[lru_head].lru_prev = slot;
+    }
+    lru_head = slot;
+    if (lru_tail == -1){
+        lru_tail = slot;
+    }
+}
+
+//Marking a slot as just used (moving it to the front of the LRU list or setting its CLOCK reference bit)
+void touch_slot(int slot){
+    if (cache_policy == SFS_CACHE_LRU){
+        lru_unlink(slot);
+        lru_push_front(slot);
+    }
+    else{
+        cache_slots[slot].referenced = 1;
+    }
+}
+
+//Finding the slot that holds a given disk block, -1 if the block is not cached
+int find_slot(int block_number){
+    int slot = cache_buckets[hash_block(block_number)];
+    while (slot != -1){
+        if (cache_slots[slot].block_number == block_number){
+            return slot;
+        }
+        slot = cache_slots[slot].hash_next;
+    }
+    return -1;
+}
+
+void hash_insert(int slot){
+    int bucket = hash_block(cache_slots[slot].block_number);
+    cache_slots[slot].hash_next = cache_buckets[bucket];
+    cache_buckets[bucket] = slot;
+}
+
+void hash_remove(int slot){
+    int bucket = hash_block(cache_slots[slot].block_number);
+    int *link = &cache_buckets[bucket];
+    while (*link != -1){
+        if (*link == slot){
+            *link = cache_slots[slot].hash_next;
+            break;
+        }
+        link = &cache_slots[*link].hash_next;
+    }
+    cache_slots[slot].hash_next = -1;
+}
+
+//Picking the slot to recycle according to the eviction policy
+int choose_victim(){
+    //LRU: least recently used slot is the tail of the list
+    if (cache_policy == SFS_CACHE_LRU){
+        return lru_tail;
+    }
+
+    //CLOCK: sweep the hand, giving referenced slots a second chance
+    while (1){
+        int slot = clock_hand;
+        clock_hand = (clock_hand + 1) % cache_capacity;
+        if (cache_slots[slot].block_number == -1 || cache_slots[slot].referenced == 0){
+            return slot;
+        }
+        cache_slots[slot].referenced = 0;
+    }
+}
+
+/*
+Getting a slot for a block that is not cached yet, writing back whatever was evicted to make room. Returns -1 if the victim could
+not be written back, it then stays cached and dirty so the next cache_sync() tries again (and reports the error).
+*/
+int claim_slot(int block_number){
+    int slot = choose_victim();
+
+    if (cache_slots[slot].block_number != -1){
+        //Dirty victim must reach the disk before its slot is reused
+        if (cache_slots[slot].dirty == 1){
+            if (write_blocks(cache_slots[slot].block_number, 1, cache_data + (long)slot * cache_block_size) < 0){
+                touch_slot(slot);
+                return -1;
+            }
+            disk_write_count++;
+        }
+        hash_remove(slot);
+    }
+
+    cache_slots[slot].block_number = block_number;
+    cache_slots[slot].dirty = 0;
+    cache_slots[slot].referenced = 1;
+    hash_insert(slot);
+    touch_slot(slot);
+    return slot;
+}
+
+//=============================================CACHE API====================================================
+
+void cache_init(int capacity, int block_size, int policy){
+
+    //Dropping any previous cache (contents must have been synced by the caller)
+    cache_destroy();
+
+    if (capacity < 1){
+        capacity = 1;
+    }
+    cache_capacity = capacity;
+    cache_block_size = block_size;
+    cache_policy = policy;
+
+    //Number of hash buckets is the first power of two >= 2 * capacity
+    cache_bucket_count = 1;
+    while (cache_bucket_count < 2 * capacity){
+        cache_bucket_count = cache_bucket_count * 2;
+    }
+
+    cache_slots = (struct cache_slot*)malloc(sizeof(struct cache_slot) * capacity);
+    cache_data = (char*)malloc((long)capacity * block_size);
+    cache_buckets = (int*)malloc(sizeof(int) * cache_bucket_count);
+
+    for (int i = 0; i < cache_bucket_count; i++){
+        cache_buckets[i] = -1;
+    }
+
+    //Every slot starts free and sits in the LRU list, so free slots are handed out first
+    lru_head = -1;
+    lru_tail = -1;
+    clock_hand = 0;
+    for (int i = 0; i < capacity; i++){
+        cache_slots[i].block_number = -1;
+        cache_slots[i].dirty = 0;
+        cache_slots[i].referenced = 0;
+        cache_slots[i].hash_next = -1;
+        cache_slots[i].lru_prev = -1;
+        cache_slots[i].lru_next = -1;
+        lru_push_front(i);
+    }
+}
+
+void cache_destroy(){
+
+    //Prefetch thread must be done with the slots before they are freed
+    if (prefetch_running == 1){
+        pthread_mutex_lock(&prefetch_lock);
+        prefetch_stopping = 1;
+        pthread_cond_signal(&prefetch_ready);
+        pthread_mutex_unlock(&prefetch_lock);
+        pthread_join(prefetch_thread, NULL);
+        prefetch_running = 0;
+        prefetch_stopping = 0;
+        prefetch_count = 0;
+    }
+
+    free(cache_slots);
+    free(cache_data);
+    free(cache_buckets);
+    cache_slots = NULL;
+    cache_data = NULL;
+    cache_buckets = NULL;
+    cache_capacity = 0;
+}
+
+//Transfers of more blocks than this go straight between the disk and the caller's buffer
+int bypass_threshold(){
+    return cache_capacity / 2;
+}
+
+int read_blocks_locked(int start_address, int nblocks, void *buffer){
+
+    //Cache was never set up, going straight to the disk
+    if (cache_slots == NULL){
+        return read_blocks(start_address, nblocks, buffer);
+    }
+
+    //Case where the read is too large to be worth caching: one disk read, then the cached copies (which may be newer) on top
+    if (nblocks > bypass_threshold()){
+        if (read_blocks(start_address, nblocks, buffer) < 0){
+            return -1;
+        }
+        for (int i = 0; i < nblocks; i++){
+            int slot = find_slot(start_address + i);
+            if (slot != -1){
+                memcpy((char*)buffer + (long)i * cache_block_size, cache_data + (long)slot * cache_block_size, cache_block_size);
+            }
+        }
+        return nblocks;
+    }
+
+    int i = 0;
+    while (i < nblocks){
+        int slot = find_slot(start_address + i);
+
+        //Case where the block is cached
+        if (slot != -1){
+            touch_slot(slot);
+            memcpy((char*)buffer + (long)i * cache_block_size, cache_data + (long)slot * cache_block_size, cache_block_size);
+            i++;
+            continue;
+        }
+
+        //Case where the block is not cached, fetching it together with the missing blocks that follow it in one read
+        int missing = 1;
+        while (i + missing < nblocks && find_slot(start_address + i + missing) == -1){
+            missing++;
+        }
+
+        if (read_blocks(start_address + i, missing, (char*)buffer + (long)i * cache_block_size) < 0){
+            return -1;
+        }
+
+        //Keeping a copy of every block that was just read (a block is not kept when no slot could be freed for it)
+        for (int j = 0; j < missing; j++){
+            slot = claim_slot(start_address + i + j);
+            if (slot == -1){
+                continue;
+            }
+            memcpy(cache_data + (long)slot * cache_block_size, (char*)buffer + (long)(i + j) * cache_block_size, cache_block_size);
+        }
+        i = i + missing;
+    }
+    return nblocks;
+}
+
+int cache_read_blocks(int start_address, int nblocks, void *buffer){
+    pthread_mutex_lock(&cache_lock);
+    int result = read_blocks_locked(start_address, nblocks, buffer);
+    pthread_mutex_unlock(&cache_lock);
+    return result;
+}
+
+int cache_submit_read_blocks(int start_address, int nblocks, void *buffer){
+    pthread_mutex_lock(&cache_lock);
+
+    //Reads that go through the cache are served right away
+    if (cache_slots == NULL || nblocks <= bypass_threshold()){
+        int result = read_blocks_locked(start_address, nblocks, buffer);
+        pthread_mutex_unlock(&cache_lock);
+        return result;
+    }
+
+    //Cached copies that are newer than the disk are written back first, so the disk read returns the latest data
+    for (int i = 0; i < nblocks; i++){
+        int slot = find_slot(start_address + i);
+        if (slot != -1 && cache_slots[slot].dirty == 1){
+            if (write_blocks(start_address + i, 1, cache_data + (long)slot * cache_block_size) < 0){
+                pthread_mutex_unlock(&cache_lock);
+                return -1;
+            }
+            cache_slots[slot].dirty = 0;
+            disk_write_count++;
+        }
+    }
+
+    //Disk read is queued, buffer is only filled once cache_wait_reads() returns
+    int result = submit_read_blocks(start_address, nblocks, buffer);
+    pthread_mutex_unlock(&cache_lock);
+    return result < 0 ? -1 : nblocks;
+}
+
+int cache_wait_reads(){
+    return wait_blocks() < 0 ? -1 : 0;
+}
+
+int write_blocks_locked(int start_address, int nblocks, void *buffer){
+
+    //Cache was never set up, going straight to the disk
+    if (cache_slots == NULL){
+        return write_blocks(start_address, nblocks, buffer);
+    }
+
+    //Case where the write is too large to be worth caching: one disk write, cached copies are refreshed and now match the disk
+    if (nblocks > bypass_threshold()){
+        if (write_blocks(start_address, nblocks, buffer) < 0){
+            return -1;
+        }
+        disk_write_count++;
+        for (int i = 0; i < nblocks; i++){
+            int slot = find_slot(start_address + i);
+            if (slot != -1){
+                memcpy(cache_data + (long)slot * cache_block_size, (char*)buffer + (long)i * cache_block_size, cache_block_size);
+                cache_slots[slot].dirty = 0;
+            }
+        }
+        return nblocks;
+    }
+
+    for (int i = 0; i < nblocks; i++){
+        int slot = find_slot(start_address + i);
+
+        //Whole block is overwritten, so a miss does not need to read the old content first
+        if (slot == -1){
+            slot = claim_slot(start_address + i);
+        }
+        else{
+            touch_slot(slot);
+        }
+
+        //Case where no slot could be freed, the block goes straight to the disk
+        if (slot == -1){
+            if (write_blocks(start_address + i, 1, (char*)buffer + (long)i * cache_block_size) < 0){
+                return -1;
+            }
+            disk_write_count++;
+            continue;
+        }
+
+        memcpy(cache_data + (long)slot * cache_block_size, (char*)buffer + (long)i * cache_block_size, cache_block_size);
+        cache_slots[slot].dirty = 1;
+    }
+    return nblocks;
+}
+
+void cache_set_write_hook(int (*hook)(int start_address, int nblocks)){
+    write_hook = hook;
+}
+
+int cache_write_blocks(int start_address, int nblocks, void *buffer){
+    if (write_hook != NULL && write_hook(start_address, nblocks) < 0){
+        return -1;
+    }
+    pthread_mutex_lock(&cache_lock);
+    int result = write_blocks_locked(start_address, nblocks, buffer);
+    pthread_mutex_unlock(&cache_lock);
+    return result;
+}
+
+int compare_slots_by_block(const void *a, const void *b){
+    return cache_slots[*(const int*)a].block_number - cache_slots[*(const int*)b].block_number;
+}
+
+//Writing every dirty block to the disk. Returns the number of blocks written, or -1 if a write failed (the blocks then stay dirty).
+int cache_sync(){
+    int written = 0;
+    int failed = 0;
+
+    pthread_mutex_lock(&cache_lock);
+    if (cache_slots == NULL){
+        pthread_mutex_unlock(&cache_lock);
+        return 0;
+    }
+
+    //Collecting the dirty slots and sorting them by block number so the disk is written front to back
+    int *dirty_slots = (int*)malloc(sizeof(int) * cache_capacity);
+    int dirty_count = 0;
+    for (int i = 0; i < cache_capacity; i++){
+        if (cache_slots[i].block_number != -1 && cache_slots[i].dirty == 1){
+            dirty_slots[dirty_count] = i;
+            dirty_count++;
+        }
+    }
+    qsort(dirty_slots, dirty_count, sizeof(int), compare_slots_by_block);
+
+    //Queueing each run of consecutive dirty blocks as a single vectored write straight from the slots
+    void **run_buffers = (void**)malloc(sizeof(void*) * cache_capacity);
+    int i = 0;
+    while (i < dirty_count){
+        int run_start = cache_slots[dirty_slots[i]].block_number;
+        int run_length = 0;
+
+        while (i + run_length < dirty_count && cache_slots[dirty_slots[i + run_length]].block_number == run_start + run_length){
+            run_buffers[run_length] = cache_data + (long)dirty_slots[i + run_length] * cache_block_size;
+            run_length++;
+        }
+
+        if (submit_write_blocks_vector(run_start, run_length, run_buffers) < 0){
+            failed = 1;
+        }
+        written = written + run_length;
+        i = i + run_length;
+    }
+
+    //Slots must not change before every write of the runs has completed, they are only clean once all of them made it
+    if (wait_blocks() < 0){
+        failed = 1;
+    }
+    if (failed == 0){
+        for (int j = 0; j < dirty_count; j++){
+            cache_slots[dirty_slots[j]].dirty = 0;
+        }
+    }
+    if (written > 0){
+        disk_write_count++;
+    }
+
+    free(run_buffers);
+    free(dirty_slots);
+    pthread_mutex_unlock(&cache_lock);
+    return failed ? -1 : written;
+}
+
+//=============================================PREFETCH=====================================================
+
+//Reading a run of disk blocks into the cache, the disk read is done without holding cache_lock
+void prefetch_blocks(int start_address, int nblocks, char *buffer){
+    pthread_mutex_lock(&cache_lock);
+    if (cache_slots == NULL){
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+
+    //Blocks that are already cached at either end of the run are not read again
+    while (nblocks > 0 && find_slot(start_address) != -1){
+        start_address++;
+        nblocks--;
+    }
+    while (nblocks > 0 && find_slot(start_address + nblocks - 1) != -1){
+        nblocks--;
+    }
+    if (nblocks == 0){
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+
+    //Case where the disk has no asynchronous path, the blocks are read and kept in one go so no reader misses them in between
+    if (async_disk_enabled() == 0){
+        read_blocks_locked(start_address, nblocks, buffer);
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+
+    //Disk read is queued under cache_lock like every other transfer, then waited for without it
+    unsigned int writes_before = disk_write_count;
+    int result = submit_read_blocks(start_address, nblocks, buffer);
+    pthread_mutex_unlock(&cache_lock);
+    if (wait_blocks() < 0 || result < 0){
+        return;
+    }
+
+    //Case where the cache wrote to the disk during the read, the blocks that were read may already be out of date
+    pthread_mutex_lock(&cache_lock);
+    if (cache_slots != NULL && disk_write_count == writes_before){
+
+        //Cached copies are never replaced, they are at least as new as the disk. They are picked before any slot is claimed,
+        //since claiming one may write back and evict a cached block of the run, whose copy in buffer is then out of date
+        char *missing = (char*)malloc(nblocks);
+        for (int i = 0; i < nblocks; i++){
+            missing[i] = find_slot(start_address + i) == -1;
+        }
+        for (int i = 0; i < nblocks; i++){
+            if (missing[i] == 1){
+                int slot = claim_slot(start_address + i);
+                if (slot == -1){
+                    continue;
+                }
+                memcpy(cache_data + (long)slot * cache_block_size, buffer + (long)i * cache_block_size, cache_block_size);
+            }
+        }
+        free(missing);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void *prefetch_main(void *argument){
+    (void)argument;
+    char *buffer = (char*)malloc((long)cache_block_size * (bypass_threshold() > 0 ? bypass_threshold() : 1));
+
+    pthread_mutex_lock(&prefetch_lock);
+    while (1){
+        while (prefetch_count == 0 && prefetch_stopping == 0){
+            pthread_cond_wait(&prefetch_ready, &prefetch_lock);
+        }
+        if (prefetch_stopping == 1){
+            break;
+        }
+
+        struct prefetch_request request = prefetch_queue[prefetch_head];
+        prefetch_head = (prefetch_head + 1) % PREFETCH_QUEUE_LENGTH;
+        prefetch_count--;
+
+        pthread_mutex_unlock(&prefetch_lock);
+        prefetch_blocks(request.start_address, request.nblocks, buffer);
+        pthread_mutex_lock(&prefetch_lock);
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+
+    free(buffer);
+    return NULL;
+}
+
+int cache_prefetch_blocks(int start_address, int nblocks){
+
+    //Prefetching more than the cache keeps around would only evict the blocks it read first
+    if (cache_slots == NULL || nblocks <= 0){
+        return 0;
+    }
+    if (nblocks > bypass_threshold()){
+        nblocks = bypass_threshold();
+    }
+    if (nblocks <= 0){
+        return 0;
+    }
+
+    pthread_mutex_lock(&prefetch_lock);
+
+    //Prefetch thread is started by the first request
+    if (prefetch_running == 0){
+        if (pthread_create(&prefetch_thread, NULL, prefetch_main, NULL) != 0){
+            pthread_mutex_unlock(&prefetch_lock);
+            return -1;
+        }
+        prefetch_running = 1;
+    }
+
+    //Case where the prefetch thread is behind, the request is only a hint so it is dropped
+    if (prefetch_count == PREFETCH_QUEUE_LENGTH){
+        pthread_mutex_unlock(&prefetch_lock);
+        return 0;
+    }
+
+    int tail = (prefetch_head + prefetch_count) % PREFETCH_QUEUE_LENGTH;
+    prefetch_queue[tail].start_address = start_address;
+    prefetch_queue[tail].nblocks = nblocks;
+    prefetch_count++;
+    pthread_cond_signal(&prefetch_ready);
+    pthread_mutex_unlock(&prefetch_lock);
+    return nblocks;
+}
@@ -0,0 +1,22 @@
+#ifndef SFS_CACHE_H
+#define SFS_CACHE_H
+
+void cache_init(int capacity, int block_size, int policy);
+
+void cache_destroy();
+
+int cache_read_blocks(int start_address, int nblocks, void *buffer);
+
+int cache_submit_read_blocks(int start_address, int nblocks, void *buffer);
+
+int cache_wait_reads();
+
+int cache_prefetch_blocks(int start_address, int nblocks);
+
+int cache_write_blocks(int start_address, int nblocks, void *buffer);
+
+void cache_set_write_hook(int (*hook)(int start_address, int nblocks));
+
+int cache_sync();
+
+#endif
@@ -0,0 +1,503 @@
+#include "sfs_journal.h"
+#include<stdio.h>
+#include<stdlib.h>
+#include<stdint.h>
+#include<string.h>
+#include<pthread.h>
+#include "disk_emu.h"
+#include "sfs_cache.h"
+
+/*
+Notes:
+1. The journal is a region of the disk that metadata blocks are written to before they go to their own place (write-ahead log)
+2. journal_add_block() only copies a block into the running transaction, journal_commit() writes the whole transaction as one
+   run of blocks: a header (sequence number, home block of every image, checksum) followed by the block images. The home block
+   numbers of a large transaction spill over several header blocks
+3. A transaction is only written once every dirty cached block (the data its metadata points to) is on the disk, and it is committed
+   once its own blocks are there too (cache_sync() + sync_disk() each time). The images are then written to their home blocks
+   through the cache, which sends them to the disk whenever it likes
+4. Transactions are appended one after the other. When the next one does not fit, every home block is synced first and the log
+   starts over at the beginning of the region (checkpoint)
+5. journal_recover() replays, in order, every transaction after the last checkpoint whose checksum is right, then checkpoints
+6. Before journal_open() (while a disk is being formatted) journal_add_block() writes straight through the cache
+7. A block added again before it is sealed replaces its image, and journal_read_block() hands out the newest image of a block that
+   has not been committed yet (pointer blocks are read back from the running transaction, their home copy is older)
+8. journal_commit() only writes the images added before the last journal_seal(), later ones wait for the next transaction. When a
+   write fails nothing is advanced and the images stay in the running transaction, so the next commit tries them again
+9. A transaction is never split: one with more images than journal_capacity() is refused. Callers commit at the end of an operation
+   once the running transaction is half that size, and the region is sized so that one operation fits in the other half
+10. journal_logged() tells whether a block has an image in the log since the last checkpoint. A replay writes that image again, so
+    such a block must not be reused for file data (which is not journaled) before the next checkpoint
+*/
+
+//Identifies the first block of the region and the header of each transaction
+#define JOURNAL_MAGIC 0x4A524E4C
+#define TRANSACTION_MAGIC 0x5452414E
+
+//First block of the journal region: where replay starts
+struct journal_super{
+    uint32_t magic;
+    uint32_t sequence; //Sequence number of the first transaction written after the last checkpoint
+};
+
+//First block of each transaction, home[] fills the rest of the block and the blocks after it (header_blocks())
+struct transaction_header{
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t count; //Number of block images that follow the header
+    uint32_t checksum; //Of the home block numbers and the images
+    uint32_t home[];
+};
+
+int journal_start = -1; //-1 == no journal is open
+int journal_blocks = 0;
+int journal_block_size = 0;
+int journal_head = 1; //Block of the region the next transaction is written at
+uint32_t journal_sequence = 1; //Sequence number of the next transaction
+
+//Running transaction: image i is the new content of disk block home[i], running_room blocks stay free at the front of the images
+int *running_home = NULL;
+char *running_images = NULL;
+int running_count = 0;
+int running_capacity = 0;
+int running_room = 0; //Header blocks of a transaction of running_capacity images, the header is built right before the images
+int running_sealed = 0; //Images [0, running_sealed) are the ones journal_commit() writes
+
+//Open addressing table: home block -> index of its newest image in the running transaction, -1 == empty slot
+int *running_index = NULL;
+int running_index_size = 0;
+
+//Open addressing set of the home blocks with an image committed since the last checkpoint, -1 == empty slot
+int *logged_blocks = NULL;
+int logged_size = 0;
+int logged_count = 0;
+
+//Held while the running transaction changes or is committed
+pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//=============================================HELPERS======================================================
+
+//Blocks the header of a transaction of `count` images takes
+int header_blocks(int count){
+    long length = (long)sizeof(struct transaction_header) + (long)count * sizeof(uint32_t);
+    return (int)((length + journal_block_size - 1) / journal_block_size);
+}
+
+//Most images one transaction can hold: the super block, its header and its images must fit in the region
+int transaction_limit(){
+    int limit = journal_blocks - 2;
+    while (limit > 0 && 1 + header_blocks(limit) + limit > journal_blocks){
+        limit--;
+    }
+    return limit;
+}
+
+//Where image `image` of the running transaction is kept
+char *image_data(int image){
+    return running_images + (long)(running_room + image) * journal_block_size;
+}
+
+//FNV-1a over a run of bytes, continuing from `hash`
+uint32_t checksum_bytes(uint32_t hash, const void *data, long length){
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (long i = 0; i < length; i++){
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+uint32_t transaction_checksum(struct transaction_header *header, const char *images){
+    uint32_t hash = checksum_bytes(2166136261u, &header->sequence, sizeof(uint32_t));
+    hash = checksum_bytes(hash, header->home, (long)header->count * sizeof(uint32_t));
+    return checksum_bytes(hash, images, (long)header->count * journal_block_size);
+}
+
+//Slot of running_index that holds `block_number`, or the empty slot where it would go (caller holds journal_lock)
+int index_slot(int block_number){
+    unsigned int slot = ((unsigned int)block_number * 2654435761u) & (running_index_size - 1);
+    while (running_index[slot] != -1 && running_home[running_index[slot]] != block_number){
+        slot = (slot + 1) & (running_index_size - 1);
+    }
+    return (int)slot;
+}
+
+//Building running_index again for the images in the running transaction, it is kept at most half full
+void rebuild_index(){
+    if (running_index_size < 2 * running_capacity){
+        running_index_size = 32;
+        while (running_index_size < 2 * running_capacity){
+            running_index_size = running_index_size * 2;
+        }
+        running_index = (int*)realloc(running_index, sizeof(int) * running_index_size);
+    }
+    for (int i = 0; i < running_index_size; i++){
+        running_index[i] = -1;
+    }
+    for (int i = 0; i < running_count; i++){
+        running_index[index_slot(running_home[i])] = i;
+    }
+}
+
+//Removing the first `count` images from the running transaction once they are committed (caller holds journal_lock)
+void drop_images(int count){
+    if (count == 0){
+        return;
+    }
+    memmove(running_home, running_home + count, sizeof(int) * (running_count - count));
+    memmove(image_data(0), image_data(count), (long)(running_count - count) * journal_block_size);
+    running_count = running_count - count;
+    running_sealed = running_sealed - count;
+    rebuild_index();
+}
+
+//Slot of logged_blocks that holds `block_number`, or the empty slot where it would go (caller holds journal_lock)
+int logged_slot(int block_number){
+    unsigned int slot = ((unsigned int)block_number * 2654435761u) & (logged_size - 1);
+    while (logged_blocks[slot] != -1 && logged_blocks[slot] != block_number){
+        slot = (slot + 1) & (logged_size - 1);
+    }
+    return (int)slot;
+}
+
+//Remembering that a committed transaction holds an image of `block_number`, the set is kept at most half full
+void add_logged_block(int block_number){
+    if (2 * (logged_count + 1) > logged_size){
+        int *old_blocks = logged_blocks;
+        int old_size = logged_size;
+        logged_size = logged_size == 0 ? 64 : logged_size * 2;
+        logged_blocks = (int*)malloc(sizeof(int) * logged_size);
+        for (int i = 0; i < logged_size; i++){
+            logged_blocks[i] = -1;
+        }
+        for (int i = 0; i < old_size; i++){
+            if (old_blocks[i] != -1){
+                logged_blocks[logged_slot(old_blocks[i])] = old_blocks[i];
+            }
+        }
+        free(old_blocks);
+    }
+    int slot = logged_slot(block_number);
+    if (logged_blocks[slot] == -1){
+        logged_blocks[slot] = block_number;
+        logged_count++;
+    }
+}
+
+//Writing every dirty cached block and making the disk durable, -1 if either one fails
+int sync_all(){
+    int written = cache_sync();
+    if (written < 0 || sync_disk() != 0){
+        return -1;
+    }
+    return written;
+}
+
+//Writing the first block of the region, replay starts at `sequence` from then on
+int write_journal_super(uint32_t sequence){
+    char *block_data = (char*)calloc(1, journal_block_size);
+    struct journal_super *super = (struct journal_super *)block_data;
+    super->magic = JOURNAL_MAGIC;
+    super->sequence = sequence;
+    int result = cache_write_blocks(journal_start, 1, block_data);
+    free(block_data);
+    return result < 0 ? -1 : 0;
+}
+
+//Making every home block durable, so the log can start over at the front of the region (caller holds journal_lock)
+int checkpoint_locked(){
+    int written = sync_all();
+    if (written < 0){
+        return -1;
+    }
+
+    //The super block must be on the disk before a transaction overwrites the old ones
+    if (write_journal_super(journal_sequence) < 0){
+        return -1;
+    }
+    int synced = sync_all();
+    if (synced < 0){
+        return -1;
+    }
+    journal_head = 1;
+
+    //No transaction is replayed any more
+    for (int i = 0; i < logged_size; i++){
+        logged_blocks[i] = -1;
+    }
+    logged_count = 0;
+    return written + synced;
+}
+
+/*
+Writing the first `count` images of the running transaction as one transaction and committing it (caller holds journal_lock).
+Returns -1 when a write fails, journal_head and journal_sequence are then left as they were.
+*/
+int commit_images(int count){
+    int written = 0;
+    int headers = header_blocks(count);
+    if (journal_head + headers + count > journal_blocks){
+        written = checkpoint_locked();
+        if (written < 0){
+            return -1;
+        }
+    }
+
+    //Blocks the transaction points to must be on the disk before it is, a replayed transaction never leads to stale data
+    int synced = sync_all();
+    if (synced < 0){
+        return -1;
+    }
+    written = written + synced;
+
+    //The header goes in the blocks right before the images, so the transaction is written with a single call
+    char *transaction = image_data(-headers);
+    memset(transaction, 0, (long)headers * journal_block_size);
+
+    struct transaction_header *header = (struct transaction_header *)transaction;
+    header->magic = TRANSACTION_MAGIC;
+    header->sequence = journal_sequence;
+    header->count = count;
+    for (int i = 0; i < count; i++){
+        header->home[i] = running_home[i];
+    }
+    header->checksum = transaction_checksum(header, image_data(0));
+    if (cache_write_blocks(journal_start + journal_head, headers + count, transaction) < 0){
+        return -1;
+    }
+
+    //Commit point: the transaction is durable
+    synced = sync_all();
+    if (synced < 0){
+        return -1;
+    }
+    written = written + synced;
+    journal_head = journal_head + headers + count;
+    journal_sequence++;
+    for (int i = 0; i < count; i++){
+        add_logged_block(running_home[i]);
+    }
+
+    //Images can now go to their home blocks, one that fails keeps its image in the running transaction for the next commit
+    int result = 0;
+    for (int i = 0; i < count; i++){
+        if (cache_write_blocks(running_home[i], 1, image_data(i)) < 0){
+            result = -1;
+        }
+    }
+    return result < 0 ? -1 : written;
+}
+
+//=============================================JOURNAL API==================================================
+
+void journal_open(int start_address, int nblocks, int block_size){
+    journal_close();
+    journal_start = start_address;
+    journal_blocks = nblocks;
+    journal_block_size = block_size;
+    journal_head = 1;
+    journal_sequence = 1;
+}
+
+void journal_close(){
+    free(running_home);
+    free(running_images);
+    free(running_index);
+    free(logged_blocks);
+    running_home = NULL;
+    running_images = NULL;
+    running_index = NULL;
+    running_count = 0;
+    running_capacity = 0;
+    running_sealed = 0;
+    running_room = 0;
+    running_index_size = 0;
+    logged_blocks = NULL;
+    logged_size = 0;
+    logged_count = 0;
+    journal_start = -1;
+}
+
+int journal_format(){
+    pthread_mutex_lock(&journal_lock);
+    journal_head = 1;
+    journal_sequence = 1;
+    int result = write_journal_super(journal_sequence);
+    pthread_mutex_unlock(&journal_lock);
+    return result;
+}
+
+int journal_recover(){
+    int replayed = 0;
+    pthread_mutex_lock(&journal_lock);
+
+    char *block_data = (char*)malloc(journal_block_size);
+    cache_read_blocks(journal_start, 1, block_data);
+    struct journal_super *super = (struct journal_super *)block_data;
+
+    //Case where the region was never formatted, there is nothing to replay
+    if (super->magic != JOURNAL_MAGIC){
+        free(block_data);
+        journal_sequence = 1;
+        checkpoint_locked();
+        pthread_mutex_unlock(&journal_lock);
+        return 0;
+    }
+    uint32_t sequence = super->sequence;
+    int position = 1;
+    char *transaction = (char*)malloc((long)journal_blocks * journal_block_size);
+    struct transaction_header *header = (struct transaction_header *)transaction;
+
+    //Replaying transactions until one is missing, out of sequence or torn
+    while (position + 1 < journal_blocks){
+        cache_read_blocks(journal_start + position, 1, transaction);
+        if (header->magic != TRANSACTION_MAGIC || header->sequence != sequence || header->count == 0
+            || (int)header->count > transaction_limit()){
+            break;
+        }
+        int headers = header_blocks(header->count);
+        if (position + headers + (int)header->count > journal_blocks){
+            break;
+        }
+        cache_read_blocks(journal_start + position + 1, headers - 1 + header->count, transaction + journal_block_size);
+        char *images = transaction + (long)headers * journal_block_size;
+        if (transaction_checksum(header, images) != header->checksum){
+            break;
+        }
+
+        for (int i = 0; i < (int)header->count; i++){
+            cache_write_blocks(header->home[i], 1, images + (long)i * journal_block_size);
+        }
+        replayed++;
+        position = position + headers + header->count;
+        sequence++;
+    }
+    free(transaction);
+    free(block_data);
+
+    //Replayed blocks reach their home before the log starts over
+    journal_sequence = sequence;
+    checkpoint_locked();
+    pthread_mutex_unlock(&journal_lock);
+    return replayed;
+}
+
+void journal_add_block(int block_number, void *buffer){
+
+    //Case where no journal is open (the disk is being formatted), the block goes straight to the cache
+    if (journal_start == -1){
+        cache_write_blocks(block_number, 1, buffer);
+        return;
+    }
+
+    pthread_mutex_lock(&journal_lock);
+
+    //Case where the block already has an image that is not sealed, the new content replaces it
+    if (running_count > 0){
+        int image = running_index[index_slot(block_number)];
+        if (image >= running_sealed){
+            memcpy(image_data(image), buffer, journal_block_size);
+            pthread_mutex_unlock(&journal_lock);
+            return;
+        }
+    }
+
+    //Images start running_room blocks into running_images, the blocks in front of them are where the header is built
+    if (running_count == running_capacity){
+        int room = running_room;
+        running_capacity = running_capacity == 0 ? 16 : running_capacity * 2;
+        running_room = header_blocks(running_capacity);
+        running_home = (int*)realloc(running_home, sizeof(int) * running_capacity);
+        running_images = (char*)realloc(running_images, (long)(running_room + running_capacity) * journal_block_size);
+        memmove(image_data(0), running_images + (long)room * journal_block_size, (long)running_count * journal_block_size);
+        rebuild_index();
+    }
+    running_home[running_count] = block_number;
+    memcpy(image_data(running_count), buffer, journal_block_size);
+    running_index[index_slot(block_number)] = running_count;
+    running_count++;
+    pthread_mutex_unlock(&journal_lock);
+}
+
+int journal_read_block(int block_number, void *buffer){
+    int result = -1;
+    pthread_mutex_lock(&journal_lock);
+    if (journal_start != -1 && running_count > 0){
+        int image = running_index[index_slot(block_number)];
+        if (image != -1){
+            memcpy(buffer, image_data(image), journal_block_size);
+            result = 0;
+        }
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return result;
+}
+
+void journal_seal(){
+    pthread_mutex_lock(&journal_lock);
+    running_sealed = running_count;
+    pthread_mutex_unlock(&journal_lock);
+}
+
+int journal_commit(){
+    pthread_mutex_lock(&journal_lock);
+
+    //Case where no metadata changed, the data blocks are still made durable
+    if (journal_start == -1 || running_sealed == 0){
+        int written = sync_all();
+        pthread_mutex_unlock(&journal_lock);
+        return written;
+    }
+
+    //Case where the transaction does not fit in the region, it is only ever written whole so nothing is written
+    if (running_sealed > transaction_limit()){
+        pthread_mutex_unlock(&journal_lock);
+        return -1;
+    }
+
+    int written = commit_images(running_sealed);
+    if (written >= 0){
+        drop_images(running_sealed);
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return written;
+}
+
+int journal_checkpoint(){
+    pthread_mutex_lock(&journal_lock);
+    int written = 0;
+    if (journal_start != -1){
+        written = checkpoint_locked();
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return written;
+}
+
+int journal_logged(int block_number){
+    pthread_mutex_lock(&journal_lock);
+    int logged = logged_count > 0 && logged_blocks[logged_slot(block_number)] != -1;
+    pthread_mutex_unlock(&journal_lock);
+    return logged;
+}
+
+//Number of images waiting in the running transaction
+int journal_pending(){
+    pthread_mutex_lock(&journal_lock);
+    int count = running_count;
+    pthread_mutex_unlock(&journal_lock);
+    return count;
+}
+
+//Home blocks of the images in the running transaction, *count of them (the caller frees the list)
+int *journal_running_blocks(int *count){
+    pthread_mutex_lock(&journal_lock);
+    *count = running_count;
+    int *blocks = (int*)malloc(sizeof(int) * (running_count + 1));
+    memcpy(blocks, running_home, sizeof(int) * running_count);
+    pthread_mutex_unlock(&journal_lock);
+    return blocks;
+}
+
+//Most images one transaction can hold, the running one should be committed well before it gets there
+int journal_capacity(){
+    return journal_start == -1 ? 0 : transaction_limit();
+}
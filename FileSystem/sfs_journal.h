@@ -0,0 +1,30 @@
+#ifndef SFS_JOURNAL_H
+#define SFS_JOURNAL_H
+
+void journal_open(int start_address, int nblocks, int block_size);
+
+void journal_close();
+
+int journal_format();
+
+int journal_recover();
+
+void journal_add_block(int block_number, void *buffer);
+
+int journal_read_block(int block_number, void *buffer);
+
+void journal_seal();
+
+int journal_commit();
+
+int journal_checkpoint();
+
+int journal_logged(int block_number);
+
+int journal_pending();
+
+int *journal_running_blocks(int *count);
+
+int journal_capacity();
+
+#endif
@@ -0,0 +1,1967 @@
+/*
+ * Checks of the features added on top of the assignment's API. Each check
+ * returns the number of errors it found. Besides reading back what it wrote,
+ * a check counts the disk transfers disk_emu made (get_disk_counters) where
+ * the feature is meant to save them.
+ *
+ * The crash checks run first, before this process mounts anything: a child
+ * builds the file system and stops with _exit() (no sync, no unmount), then a
+ * second child mounts the disk again the way a restart would and reports its
+ * errors through its exit status.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <pthread.h>
+
+#include "sfs_api.h"
+#include "disk_emu.h"
+
+/* Fills a buffer with bytes that depend on their file offset and a seed,
+ * so a block that ends up in the wrong place is noticed.
+ */
+static void
+fill_pattern(char *buf, int offset, int length, int seed)
+{
+  int i;
+
+  for (i = 0; i < length; i++) {
+    buf[i] = (char)((offset + i) * 31 + seed * 7 + (offset + i) / 1024);
+  }
+}
+
+/* Reads back `length` bytes of an open file from `offset` and compares them
+ * with the pattern. Returns the number of errors.
+ */
+static int
+compare_pattern(int fd, int offset, int length, int seed, const char *what)
+{
+  char *expected = malloc(length);
+  char *buffer = malloc(length);
+  int error_count = 0;
+  int readsize;
+
+  fill_pattern(expected, offset, length, seed);
+  sfs_fseek(fd, offset);
+  readsize = sfs_fread(fd, buffer, length);
+  if (readsize != length) {
+    fprintf(stderr, "ERROR: %s: read %d bytes at %d, expected %d\n", what, readsize, offset, length);
+    error_count++;
+  }
+  else if (memcmp(expected, buffer, length) != 0) {
+    fprintf(stderr, "ERROR: %s: data mismatch at offset %d\n", what, offset);
+    error_count++;
+  }
+  free(expected);
+  free(buffer);
+  return error_count;
+}
+
+/* Writes the whole pattern to `name` from offset 0 */
+static int
+write_pattern_file(char *name, int length, int seed)
+{
+  char *buffer = malloc(length);
+  int fd = sfs_fopen(name);
+  int written;
+
+  fill_pattern(buffer, 0, length, seed);
+  sfs_fseek(fd, 0);
+  written = sfs_fwrite(fd, buffer, length);
+  free(buffer);
+  sfs_fclose(fd);
+  if (written != length) {
+    fprintf(stderr, "ERROR: wrote %d bytes of %s, expected %d\n", written, name, length);
+    return 1;
+  }
+  return 0;
+}
+
+/* Opens `name` and compares the whole file with the pattern */
+static int
+check_pattern_file(char *name, int length, int seed, const char *what)
+{
+  int error_count = 0;
+  int fd = sfs_fopen(name);
+
+  if (sfs_getfilesize(name) != length) {
+    fprintf(stderr, "ERROR: %s: %s has size %d, expected %d\n", what, name, sfs_getfilesize(name), length);
+    error_count++;
+  }
+  else {
+    error_count += compare_pattern(fd, 0, length, seed, what);
+  }
+  sfs_fclose(fd);
+  return error_count;
+}
+
+/* Block cache: a cache far smaller than the file must still give back what
+ * was written, under both eviction policies and after a remount. With the
+ * default cache, thousands of small appends to one file read each block at
+ * most once and write nothing before sfs_sync(), which then writes each
+ * block about once.
+ */
+#define APPEND_COUNT 2000
+#define APPEND_BYTES 10
+
+static int
+check_block_cache(void)
+{
+  struct disk_counters before, after;
+  char buffer[APPEND_BYTES];
+  int error_count = 0;
+  int policy, fd, i;
+
+  for (policy = SFS_CACHE_LRU; policy <= SFS_CACHE_CLOCK; policy++) {
+    sfs_configure_cache(8, policy);
+    mksfs(1);
+    error_count += write_pattern_file("cache.txt", 200 * 1024 + 17, 11 + policy);
+    error_count += check_pattern_file("cache.txt", 200 * 1024 + 17, 11 + policy, "cache");
+    mksfs(0);
+    error_count += check_pattern_file("cache.txt", 200 * 1024 + 17, 11 + policy, "cache after remount");
+  }
+
+  /* Back to the default cache */
+  sfs_configure_cache(64, SFS_CACHE_LRU);
+  mksfs(1);
+  sfs_sync();
+  get_disk_counters(&before);
+  fd = sfs_fopen("appends.txt");
+  for (i = 0; i < APPEND_COUNT; i++) {
+    fill_pattern(buffer, i * APPEND_BYTES, APPEND_BYTES, 13);
+    sfs_fwrite(fd, buffer, APPEND_BYTES);
+  }
+  sfs_fclose(fd);
+  error_count += check_pattern_file("appends.txt", APPEND_COUNT * APPEND_BYTES, 13, "cache");
+  get_disk_counters(&after);
+  if (after.writes != before.writes || after.reads - before.reads > 20) {
+    fprintf(stderr, "ERROR: cache: %ld reads and %ld writes reached the disk before sfs_sync()\n",
+            after.reads - before.reads, after.writes - before.writes);
+    error_count++;
+  }
+  sfs_sync();
+  get_disk_counters(&after);
+  if (after.blocks_written - before.blocks_written > 40) {
+    fprintf(stderr, "ERROR: cache: sfs_sync() wrote %ld blocks for a file of 20 blocks\n",
+            after.blocks_written - before.blocks_written);
+    error_count++;
+  }
+  return error_count;
+}
+
+/* Metadata flushing: only the blocks that changed are written back, so a
+ * small append writes its data block and one i-node block, and every file
+ * created, grown or removed before a sync looks the same after a remount.
+ */
+/* The journal writes the changed blocks twice, with its header and commit */
+#define METADATA_APPEND_BLOCKS 16
+
+static int
+check_metadata_flush(void)
+{
+  struct disk_counters before, after;
+  int error_count = 0;
+  char name[32], buffer[10];
+  int i, fd;
+
+  /* An i-node table of 1024 blocks, all of them written if the whole table were */
+  mksfs_geometry(1, 1024, 8192);
+  for (i = 0; i < 40; i++) {
+    sprintf(name, "meta%02d.txt", i);
+    error_count += write_pattern_file(name, 100 + i * 700, 20 + i);
+  }
+  for (i = 0; i < 40; i += 3) {
+    sprintf(name, "meta%02d.txt", i);
+    sfs_remove(name);
+  }
+  sfs_sync();
+
+  get_disk_counters(&before);
+  fd = sfs_fopen("meta01.txt");
+  fill_pattern(buffer, 800, 10, 21);
+  sfs_fseek(fd, 800);
+  sfs_fwrite(fd, buffer, 10);
+  sfs_fclose(fd);
+  sfs_sync();
+  get_disk_counters(&after);
+  if (after.blocks_written - before.blocks_written > METADATA_APPEND_BLOCKS) {
+    fprintf(stderr, "ERROR: metadata: a 10-byte append wrote %ld blocks\n", after.blocks_written - before.blocks_written);
+    error_count++;
+  }
+
+  mksfs(0);
+  for (i = 0; i < 40; i++) {
+    sprintf(name, "meta%02d.txt", i);
+    if (i % 3 == 0) {
+      if (sfs_getfilesize(name) != -1) {
+        fprintf(stderr, "ERROR: metadata: removed file %s is back after a remount\n", name);
+        error_count++;
+      }
+      continue;
+    }
+    error_count += check_pattern_file(name, 100 + i * 700 + (i == 1 ? 10 : 0), 20 + i, "metadata after remount");
+  }
+  return error_count;
+}
+
+/* Writes 100 KiB files named `prefix`0, `prefix`1, ... until the disk is
+ * full, returns the bytes written
+ */
+#define FILL_BYTES (100 * 1024)
+
+static int
+fill_disk(char *prefix)
+{
+  char *buffer = malloc(FILL_BYTES);
+  char name[32];
+  int total = 0;
+  int written = FILL_BYTES;
+  int i, fd;
+
+  for (i = 0; written == FILL_BYTES; i++) {
+    sprintf(name, "%s%d.txt", prefix, i);
+    fill_pattern(buffer, 0, FILL_BYTES, i);
+    fd = sfs_fopen(name);
+    written = sfs_fwrite(fd, buffer, FILL_BYTES);
+    sfs_fclose(fd);
+    total += written > 0 ? written : 0;
+  }
+  free(buffer);
+  return total;
+}
+
+/* Free bitmap: a full disk refuses the next write without harming the files
+ * on it, and every block the removed files gave back (their sizes are whole
+ * blocks) can be allocated again.
+ */
+static int
+check_free_bitmap(void)
+{
+  int error_count = 0;
+  char name[32], block[1024];
+  int first, second, files, fd, i;
+
+  mksfs(1);
+  first = fill_disk("bitmap");
+  files = first / FILL_BYTES + 1;
+  fd = sfs_fopen("bitmap_more.txt");
+  if (sfs_fwrite(fd, block, sizeof(block)) > 0) {
+    fprintf(stderr, "ERROR: bitmap: a write to a full disk succeeded\n");
+    error_count++;
+  }
+  sfs_fclose(fd);
+  for (i = 0; i < files - 1; i++) {
+    sprintf(name, "bitmap%d.txt", i);
+    error_count += check_pattern_file(name, FILL_BYTES, i, "bitmap with a full disk");
+  }
+  for (i = 0; i < files; i++) {
+    sprintf(name, "bitmap%d.txt", i);
+    sfs_remove(name);
+  }
+  sfs_remove("bitmap_more.txt");
+  sfs_sync();
+  second = fill_disk("bitmap");
+  if (first < 5 * FILL_BYTES || second != first) {
+    fprintf(stderr, "ERROR: bitmap: filled %d bytes, then %d after the removes\n", first, second);
+    error_count++;
+  }
+  return error_count;
+}
+
+/* Extents: a file larger than the 268 KiB its direct and indirect pointers
+ * could map, grown by appends, and two files grown side by side until they
+ * run out of extents, read back whole before and after a remount.
+ */
+#define EXTENT_APPEND (50 * 1024)
+
+static int
+check_extents(void)
+{
+  int error_count = 0;
+  char *buffer = malloc(EXTENT_APPEND);
+  int fd, other, i;
+
+  mksfs(1);
+  fd = sfs_fopen("extent.txt");
+  for (i = 0; i < 12; i++) {
+    fill_pattern(buffer, i * EXTENT_APPEND, EXTENT_APPEND, 30);
+    if (sfs_fwrite(fd, buffer, EXTENT_APPEND) != EXTENT_APPEND) {
+      fprintf(stderr, "ERROR: extents: append %d was cut short\n", i);
+      error_count++;
+    }
+  }
+  sfs_fclose(fd);
+  fd = sfs_fopen("extent2.txt");
+  other = sfs_fopen("extent3.txt");
+  for (i = 0; i < 16; i++) {
+    fill_pattern(buffer, i * 3000, 3000, 31);
+    sfs_fwrite(fd, buffer, 3000);
+    sfs_fsync(fd);
+    fill_pattern(buffer, i * 2000, 2000, 32);
+    sfs_fwrite(other, buffer, 2000);
+    sfs_fsync(other);
+  }
+  sfs_fclose(fd);
+  sfs_fclose(other);
+  error_count += check_pattern_file("extent.txt", 12 * EXTENT_APPEND, 30, "extents");
+  error_count += check_pattern_file("extent2.txt", 16 * 3000, 31, "extents");
+  mksfs(0);
+  error_count += check_pattern_file("extent.txt", 12 * EXTENT_APPEND, 30, "extents after remount");
+  error_count += check_pattern_file("extent2.txt", 16 * 3000, 31, "extents after remount");
+  error_count += check_pattern_file("extent3.txt", 16 * 2000, 32, "extents after remount");
+  free(buffer);
+  return error_count;
+}
+
+/* Multi-block I/O: reads and writes that start and end inside a block and
+ * cover many whole blocks in between, through the read_write_pointer. A
+ * transfer of 100 whole blocks goes to the disk in one call.
+ */
+#define WHOLE_BYTES (100 * 1024)
+
+static int
+check_multi_block_io(void)
+{
+  struct disk_counters before, after;
+  int error_count = 0;
+  char *expected = malloc(WHOLE_BYTES);
+  char *buffer = malloc(WHOLE_BYTES);
+  int fd;
+
+  mksfs(1);
+  fd = sfs_fopen("vector.txt");
+  fill_pattern(expected, 0, 50000, 40);
+  if (sfs_fwrite(fd, expected, 777) != 777 || sfs_fwrite(fd, expected + 777, 45000) != 45000 ||
+      sfs_fwrite(fd, expected + 45777, 4223) != 4223) {
+    fprintf(stderr, "ERROR: multi-block: short write\n");
+    error_count++;
+  }
+  sfs_fseek(fd, 333);
+  if (sfs_fread(fd, buffer + 333, 40000) != 40000 || memcmp(buffer + 333, expected + 333, 40000) != 0) {
+    fprintf(stderr, "ERROR: multi-block: unaligned read mismatch\n");
+    error_count++;
+  }
+  if (sfs_fread(fd, buffer + 40333, 20000) != 9667 || memcmp(buffer + 40333, expected + 40333, 9667) != 0) {
+    fprintf(stderr, "ERROR: multi-block: read up to the end of the file mismatch\n");
+    error_count++;
+  }
+  sfs_fclose(fd);
+
+  fd = sfs_fopen("whole.txt");
+  fill_pattern(expected, 0, WHOLE_BYTES, 41);
+  get_disk_counters(&before);
+  sfs_fwrite(fd, expected, WHOLE_BYTES);
+  get_disk_counters(&after);
+  if (after.writes - before.writes > 2) {
+    fprintf(stderr, "ERROR: multi-block: writing 100 blocks took %ld disk writes\n", after.writes - before.writes);
+    error_count++;
+  }
+  sfs_sync();
+  get_disk_counters(&before);
+  sfs_fseek(fd, 0);
+  if (sfs_fread(fd, buffer, WHOLE_BYTES) != WHOLE_BYTES || memcmp(buffer, expected, WHOLE_BYTES) != 0) {
+    fprintf(stderr, "ERROR: multi-block: whole block read mismatch\n");
+    error_count++;
+  }
+  get_disk_counters(&after);
+  if (after.reads - before.reads > 2) {
+    fprintf(stderr, "ERROR: multi-block: reading 100 blocks took %ld disk reads\n", after.reads - before.reads);
+    error_count++;
+  }
+  sfs_fclose(fd);
+  free(expected);
+  free(buffer);
+  return error_count;
+}
+
+/* Directory index: lookups find every file after removes punch holes in
+ * the index, a removed name can be created again, and the index holds one
+ * slot per file while staying at most half full.
+ */
+extern int directory_index_size;
+extern int directory_index_count;
+
+#define INDEX_FILES 80
+
+static int
+check_directory_index(void)
+{
+  int error_count = 0;
+  char name[32];
+  int i, size, entries;
+
+  mksfs(1);
+  entries = directory_index_count;
+  for (i = 0; i < INDEX_FILES; i++) {
+    sprintf(name, "idx%03d.txt", i);
+    error_count += write_pattern_file(name, i + 1, 50);
+  }
+  if (directory_index_count != entries + INDEX_FILES || directory_index_size < 2 * directory_index_count) {
+    fprintf(stderr, "ERROR: directory index: %d entries in %d slots, expected %d at most half full\n",
+            directory_index_count, directory_index_size, entries + INDEX_FILES);
+    error_count++;
+  }
+  for (i = 0; i < INDEX_FILES; i += 2) {
+    sprintf(name, "idx%03d.txt", i);
+    if (sfs_remove(name) != 0) {
+      fprintf(stderr, "ERROR: directory index: could not remove %s\n", name);
+      error_count++;
+    }
+  }
+  if (directory_index_count != entries + INDEX_FILES / 2 || directory_index_size < 2 * directory_index_count) {
+    fprintf(stderr, "ERROR: directory index: %d entries in %d slots, expected %d at most half full\n",
+            directory_index_count, directory_index_size, entries + INDEX_FILES / 2);
+    error_count++;
+  }
+  for (i = 0; i < INDEX_FILES; i++) {
+    sprintf(name, "idx%03d.txt", i);
+    size = sfs_getfilesize(name);
+    if (size != (i % 2 == 0 ? -1 : i + 1)) {
+      fprintf(stderr, "ERROR: directory index: %s has size %d\n", name, size);
+      error_count++;
+    }
+  }
+  error_count += write_pattern_file("idx000.txt", 10, 51);
+  error_count += check_pattern_file("idx000.txt", 10, 51, "directory index");
+  if (sfs_remove("idx100.txt") != -1) {
+    fprintf(stderr, "ERROR: directory index: removed a file that does not exist\n");
+    error_count++;
+  }
+  return error_count;
+}
+
+/* Directory beyond the old 96-entry table: more files than it had room for
+ * are listed by sfs_getnextfilename() and keep their data across a remount.
+ */
+#define LARGE_DIRECTORY_FILES 400
+
+static int
+count_files(void)
+{
+  char name[64];
+  int count = 0;
+
+  while (sfs_getnextfilename(name) == 1) {
+    count++;
+  }
+  return count;
+}
+
+static int
+check_large_directory(void)
+{
+  int error_count = 0;
+  char name[32];
+  int i, count;
+
+  mksfs_geometry(1, 1024, 8192);
+  for (i = 0; i < LARGE_DIRECTORY_FILES; i++) {
+    sprintf(name, "dir%03d.txt", i);
+    error_count += write_pattern_file(name, 200 + i, 60 + i);
+  }
+  if ((count = count_files()) != LARGE_DIRECTORY_FILES) {
+    fprintf(stderr, "ERROR: large directory: listed %d files, expected %d\n", count, LARGE_DIRECTORY_FILES);
+    error_count++;
+  }
+  mksfs(0);
+  if ((count = count_files()) != LARGE_DIRECTORY_FILES) {
+    fprintf(stderr, "ERROR: large directory: listed %d files after remount, expected %d\n", count, LARGE_DIRECTORY_FILES);
+    error_count++;
+  }
+  for (i = 0; i < LARGE_DIRECTORY_FILES; i += 37) {
+    sprintf(name, "dir%03d.txt", i);
+    error_count += check_pattern_file(name, 200 + i, 60 + i, "large directory");
+  }
+  return error_count;
+}
+
+/* Geometry: a disk of 2048 blocks of 4096 bytes takes that much room, holds
+ * a file three times the size of the default disk, keeps its layout across
+ * a remount with mksfs(0), and a bad geometry is refused.
+ */
+static int
+check_geometry(void)
+{
+  int error_count = 0;
+  FILE *disk;
+  long length = -1;
+
+  if (mksfs_geometry(1, 1000, 1024) != -1 || mksfs_geometry(1, 1024, 8) != -1) {
+    fprintf(stderr, "ERROR: geometry: an invalid geometry was accepted\n");
+    error_count++;
+  }
+  if (mksfs_geometry(1, 4096, 2048) != 0) {
+    fprintf(stderr, "ERROR: geometry: could not format 2048 blocks of 4096 bytes\n");
+    return error_count + 1;
+  }
+  disk = fopen("current_disk", "r");
+  if (disk != NULL) {
+    fseek(disk, 0, SEEK_END);
+    length = ftell(disk);
+    fclose(disk);
+  }
+  if (length != 4096L * 2048) {
+    fprintf(stderr, "ERROR: geometry: the disk file has %ld bytes, expected %ld\n", length, 4096L * 2048);
+    error_count++;
+  }
+  error_count += write_pattern_file("geometry.txt", 3 * 1024 * 1024 + 123, 70);
+  error_count += write_pattern_file("geometry2.txt", 5000, 71);
+  mksfs(0);
+  error_count += check_pattern_file("geometry.txt", 3 * 1024 * 1024 + 123, 70, "geometry after remount");
+  error_count += check_pattern_file("geometry2.txt", 5000, 71, "geometry after remount");
+  return error_count;
+}
+
+/* Formats and fills a disk through `backend`, then reads it back through
+ * the same backend and through the stdio one after remounts
+ */
+static int
+backend_round_trip(int backend, const char *what)
+{
+  int error_count = 0;
+
+  sfs_configure_disk(backend);
+  mksfs(1);
+  if (sfs_disk_backend() != backend) {
+    fprintf(stderr, "ERROR: %s: the disk was opened with backend %d\n", what, sfs_disk_backend());
+    error_count++;
+  }
+  error_count += write_pattern_file("backend.txt", 100000, 80 + backend);
+  error_count += write_pattern_file("backend2.txt", 777, 90 + backend);
+  error_count += check_pattern_file("backend.txt", 100000, 80 + backend, what);
+  mksfs(0);
+  error_count += check_pattern_file("backend.txt", 100000, 80 + backend, what);
+  sfs_configure_disk(SFS_DISK_STDIO);
+  mksfs(0);
+  error_count += check_pattern_file("backend.txt", 100000, 80 + backend, what);
+  error_count += check_pattern_file("backend2.txt", 777, 90 + backend, what);
+  return error_count;
+}
+
+/* Whether /proc/self/maps lists a mapping of the disk file */
+static int
+disk_is_mapped(void)
+{
+  char line[512];
+  FILE *maps = fopen("/proc/self/maps", "r");
+  int mapped = 0;
+
+  if (maps == NULL) {
+    return -1;
+  }
+  while (fgets(line, sizeof(line), maps) != NULL) {
+    if (strstr(line, "current_disk") != NULL) {
+      mapped = 1;
+    }
+  }
+  fclose(maps);
+  return mapped;
+}
+
+/* Memory-mapped backend: the disk file is mapped while it is mounted with
+ * it, and no longer once it is mounted with stdio again
+ */
+static int
+check_mmap_backend(void)
+{
+  int error_count = backend_round_trip(SFS_DISK_MMAP, "mmap backend");
+
+  sfs_configure_disk(SFS_DISK_MMAP);
+  mksfs(0);
+  if (disk_is_mapped() != 1) {
+    fprintf(stderr, "ERROR: mmap backend: the disk file is not mapped\n");
+    error_count++;
+  }
+  error_count += check_pattern_file("backend.txt", 100000, 80 + SFS_DISK_MMAP, "mmap backend");
+  sfs_configure_disk(SFS_DISK_STDIO);
+  mksfs(0);
+  if (disk_is_mapped() != 0) {
+    fprintf(stderr, "ERROR: mmap backend: the disk file is still mapped with the stdio backend\n");
+    error_count++;
+  }
+  return error_count;
+}
+
+/* Whether this process has a descriptor open on a file whose name contains
+ * `name`, with every bit of `flags` set (as /proc/self/fdinfo shows them)
+ */
+static int
+has_descriptor(const char *name, long flags)
+{
+  char path[64], target[256], line[128];
+  FILE *info;
+  unsigned long open_flags;
+  ssize_t length;
+  int fd, found = 0;
+
+  for (fd = 0; fd < 1024 && found == 0; fd++) {
+    sprintf(path, "/proc/self/fd/%d", fd);
+    length = readlink(path, target, sizeof(target) - 1);
+    if (length <= 0) {
+      continue;
+    }
+    target[length] = '\0';
+    if (strstr(target, name) == NULL) {
+      continue;
+    }
+    sprintf(path, "/proc/self/fdinfo/%d", fd);
+    info = fopen(path, "r");
+    if (info == NULL) {
+      continue;
+    }
+    while (fgets(line, sizeof(line), info) != NULL) {
+      if (sscanf(line, "flags: %lo", &open_flags) == 1 && (open_flags & flags) == flags) {
+        found = 1;
+      }
+    }
+    fclose(info);
+  }
+  return found;
+}
+
+/* pread/pwrite and O_DIRECT backends: both keep the data through remounts,
+ * and the direct one really opens the disk with O_DIRECT
+ */
+static int
+check_positional_backends(void)
+{
+  int error_count = 0;
+  /* Transfers are widened to whole 4 KiB pages, so every block size uses O_DIRECT */
+  int block_sizes[] = {512, 1024, 4096};
+  int i, length;
+
+  error_count += backend_round_trip(SFS_DISK_PREAD, "pread backend");
+  error_count += backend_round_trip(SFS_DISK_DIRECT, "direct backend");
+  for (i = 0; i < (int)(sizeof(block_sizes) / sizeof(block_sizes[0])); i++) {
+    length = 30 * block_sizes[i] + 77;
+    sfs_configure_disk(SFS_DISK_DIRECT);
+    mksfs_geometry(1, block_sizes[i], 4096);
+    if (sfs_disk_backend() != SFS_DISK_DIRECT || has_descriptor("current_disk", O_DIRECT) != 1) {
+      fprintf(stderr, "ERROR: direct backend: %d B blocks were not read with O_DIRECT\n", block_sizes[i]);
+      error_count++;
+    }
+    error_count += write_pattern_file("direct.txt", length, 78 + i);
+    mksfs(0);
+    error_count += check_pattern_file("direct.txt", length, 78 + i, "direct backend");
+    sfs_configure_disk(SFS_DISK_STDIO);
+    mksfs(0);
+    if (has_descriptor("current_disk", O_DIRECT) != 0) {
+      fprintf(stderr, "ERROR: direct backend: the stdio backend opened the disk with O_DIRECT\n");
+      error_count++;
+    }
+    error_count += check_pattern_file("direct.txt", length, 78 + i, "direct backend read back with stdio");
+  }
+  return error_count;
+}
+
+/* Asynchronous block I/O: with the pread backend and a small cache, reads
+ * and writes of two interleaved files cover many separate runs of blocks,
+ * each one sent to the io_uring ring the pread backend sets up.
+ */
+static int
+check_async_io(void)
+{
+  int error_count = 0;
+  char *buffer = malloc(200 * 1024);
+  int first, second, i;
+
+  sfs_configure_disk(SFS_DISK_PREAD);
+  sfs_configure_cache(8, SFS_CACHE_LRU);
+  mksfs(1);
+  if (has_descriptor("io_uring", 0) != 1) {
+    fprintf(stderr, "ERROR: async I/O: the pread backend has no io_uring ring\n");
+    error_count++;
+  }
+  first = sfs_fopen("async1.txt");
+  second = sfs_fopen("async2.txt");
+  for (i = 0; i < 20; i++) {
+    fill_pattern(buffer, i * 10000, 10000, 100);
+    sfs_fwrite(first, buffer, 10000);
+    sfs_fsync(first);
+    fill_pattern(buffer, i * 9000, 9000, 101);
+    sfs_fwrite(second, buffer, 9000);
+    sfs_fsync(second);
+  }
+  sfs_fclose(first);
+  sfs_fclose(second);
+  mksfs(0);
+  first = sfs_fopen("async1.txt");
+  sfs_fseek(first, 0);
+  if (sfs_fread(first, buffer, 200 * 1024) != 200000) {
+    fprintf(stderr, "ERROR: async I/O: short read of a fragmented file\n");
+    error_count++;
+  }
+  sfs_fclose(first);
+  error_count += check_pattern_file("async1.txt", 200000, 100, "async I/O");
+  error_count += check_pattern_file("async2.txt", 180000, 101, "async I/O");
+  sfs_configure_disk(SFS_DISK_STDIO);
+  sfs_configure_cache(64, SFS_CACHE_LRU);
+  free(buffer);
+  return error_count;
+}
+
+/* Threads: four threads write and read their own files at the same time
+ * through shared directory, allocator and cache state.
+ */
+#define THREAD_COUNT 4
+#define THREAD_ROUNDS 40
+#define THREAD_CHUNK 1500
+
+static void *
+thread_worker(void *arg)
+{
+  long id = (long)arg;
+  long errors = 0;
+  char name[32];
+  char buffer[THREAD_CHUNK], expected[THREAD_CHUNK];
+  int fd, i;
+
+  sprintf(name, "thread%ld.txt", id);
+  fd = sfs_fopen(name);
+  for (i = 0; i < THREAD_ROUNDS; i++) {
+    fill_pattern(buffer, i * THREAD_CHUNK, THREAD_CHUNK, 110 + id);
+    if (sfs_pwrite(fd, buffer, THREAD_CHUNK, i * THREAD_CHUNK) != THREAD_CHUNK) {
+      errors++;
+    }
+    fill_pattern(expected, (i / 2) * THREAD_CHUNK, THREAD_CHUNK, 110 + id);
+    if (sfs_pread(fd, buffer, THREAD_CHUNK, (i / 2) * THREAD_CHUNK) != THREAD_CHUNK ||
+        memcmp(buffer, expected, THREAD_CHUNK) != 0) {
+      errors++;
+    }
+  }
+  sfs_fclose(fd);
+  return (void *)errors;
+}
+
+static int
+check_threads(void)
+{
+  int error_count = 0;
+  pthread_t threads[THREAD_COUNT];
+  char name[32];
+  void *errors;
+  long i;
+
+  mksfs(1);
+  for (i = 0; i < THREAD_COUNT; i++) {
+    pthread_create(&threads[i], NULL, thread_worker, (void *)i);
+  }
+  for (i = 0; i < THREAD_COUNT; i++) {
+    pthread_join(threads[i], &errors);
+    if (errors != NULL) {
+      fprintf(stderr, "ERROR: threads: thread %ld found %ld errors\n", i, (long)errors);
+      error_count++;
+    }
+  }
+  mksfs(0);
+  for (i = 0; i < THREAD_COUNT; i++) {
+    sprintf(name, "thread%ld.txt", i);
+    error_count += check_pattern_file(name, THREAD_ROUNDS * THREAD_CHUNK, 110 + i, "threads after remount");
+  }
+  return error_count;
+}
+
+/* Positional I/O: sfs_pread() and sfs_pwrite() leave the read_write_pointer
+ * where it was, and a negative offset is refused.
+ */
+static int
+check_positional_io(void)
+{
+  int error_count = 0;
+  char buffer[3000], expected[3000];
+  int fd;
+
+  mksfs(1);
+  fd = sfs_fopen("positional.txt");
+  fill_pattern(buffer, 0, 3000, 120);
+  sfs_fwrite(fd, buffer, 3000);
+  sfs_fseek(fd, 100);
+  fill_pattern(buffer, 0, 1000, 121);
+  if (sfs_pwrite(fd, buffer, 1000, 1500) != 1000) {
+    fprintf(stderr, "ERROR: positional I/O: short pwrite\n");
+    error_count++;
+  }
+  fill_pattern(expected, 0, 1000, 121);
+  if (sfs_pread(fd, buffer, 1000, 1500) != 1000 || memcmp(buffer, expected, 1000) != 0) {
+    fprintf(stderr, "ERROR: positional I/O: pread did not return the pwrite data\n");
+    error_count++;
+  }
+  /* The pointer stayed at 100, so fread returns the first pattern from there */
+  fill_pattern(expected, 100, 200, 120);
+  if (sfs_fread(fd, buffer, 200) != 200 || memcmp(buffer, expected, 200) != 0) {
+    fprintf(stderr, "ERROR: positional I/O: read_write_pointer moved\n");
+    error_count++;
+  }
+  if (sfs_pread(fd, buffer, 10, -1) != -1 || sfs_pwrite(fd, buffer, 10, -1) != -1) {
+    fprintf(stderr, "ERROR: positional I/O: a negative offset was accepted\n");
+    error_count++;
+  }
+  if (sfs_pread(fd, buffer, 100, 2950) != 50) {
+    fprintf(stderr, "ERROR: positional I/O: pread past the end of the file\n");
+    error_count++;
+  }
+  sfs_fclose(fd);
+  return error_count;
+}
+
+/* Descriptor table: thousands of open files get distinct descriptors that
+ * each lead to their own file, opening an open file gives its descriptor
+ * back, and closed descriptors are handed out again before the table grows.
+ */
+#define OPEN_FILES 2000
+
+static int
+check_descriptor_table(void)
+{
+  int error_count = 0;
+  static int fds[OPEN_FILES];
+  static char used[OPEN_FILES * 2];
+  char name[32];
+  char byte;
+  int i, highest = 0;
+
+  mksfs_geometry(1, 1024, 32768);
+  for (i = 0; i < OPEN_FILES; i++) {
+    sprintf(name, "open%04d.txt", i);
+    fds[i] = sfs_fopen(name);
+    byte = (char)i;
+    if (fds[i] < 0 || fds[i] >= OPEN_FILES * 2 || sfs_fwrite(fds[i], &byte, 1) != 1) {
+      fprintf(stderr, "ERROR: descriptors: could not open and write %s\n", name);
+      return error_count + 1;
+    }
+    if (used[fds[i]]) {
+      fprintf(stderr, "ERROR: descriptors: %d is given to two files\n", fds[i]);
+      error_count++;
+    }
+    used[fds[i]] = 1;
+    highest = fds[i] > highest ? fds[i] : highest;
+  }
+  if (sfs_fopen("open0007.txt") != fds[7]) {
+    fprintf(stderr, "ERROR: descriptors: an open file got a second descriptor\n");
+    error_count++;
+  }
+  for (i = 0; i < OPEN_FILES; i += 2) {
+    sfs_fclose(fds[i]);
+    used[fds[i]] = 0;
+  }
+  if (sfs_fclose(fds[0]) != -1) {
+    fprintf(stderr, "ERROR: descriptors: a closed descriptor was closed again\n");
+    error_count++;
+  }
+  for (i = 0; i < OPEN_FILES; i += 2) {
+    sprintf(name, "open%04d.txt", i);
+    fds[i] = sfs_fopen(name);
+    if (fds[i] < 0 || fds[i] > highest || used[fds[i]]) {
+      fprintf(stderr, "ERROR: descriptors: reopening %s gave descriptor %d, not a closed one\n", name, fds[i]);
+      error_count++;
+      break;
+    }
+    used[fds[i]] = 1;
+  }
+  for (i = 0; i < OPEN_FILES; i++) {
+    if (sfs_pread(fds[i], &byte, 1, 0) != 1 || byte != (char)i) {
+      fprintf(stderr, "ERROR: descriptors: descriptor %d does not lead to file %d\n", fds[i], i);
+      error_count++;
+    }
+    sfs_fclose(fds[i]);
+  }
+  return error_count;
+}
+
+/* Indirect pointer trees: with 512-byte blocks, a file fragmented by writes
+ * to another file goes past the single indirect block (140 blocks) and
+ * reads back whole after a remount.
+ */
+static int
+check_double_indirect(void)
+{
+  int error_count = 0;
+  char *buffer = malloc(10000);
+  int fd, other, i;
+
+  mksfs_geometry(1, 512, 4096);
+  fd = sfs_fopen("indirect.txt");
+  other = sfs_fopen("indirect2.txt");
+  for (i = 0; i < 40; i++) {
+    fill_pattern(buffer, i * 10000, 10000, 130);
+    if (sfs_fwrite(fd, buffer, 10000) != 10000) {
+      fprintf(stderr, "ERROR: indirect: write %d was cut short\n", i);
+      error_count++;
+    }
+    sfs_fsync(fd);
+    fill_pattern(buffer, i * 700, 700, 131);
+    sfs_fwrite(other, buffer, 700);
+    sfs_fsync(other);
+  }
+  sfs_fclose(fd);
+  sfs_fclose(other);
+  error_count += check_pattern_file("indirect.txt", 400000, 130, "indirect");
+  mksfs(0);
+  error_count += check_pattern_file("indirect.txt", 400000, 130, "indirect after remount");
+  error_count += check_pattern_file("indirect2.txt", 28000, 131, "indirect after remount");
+  free(buffer);
+  return error_count;
+}
+
+/* Block maps sfs_api.c keeps for the i-nodes, one slot per i-node */
+struct pointer_path;
+extern struct pointer_path **block_maps;
+extern int block_map_count;
+
+static int
+resident_block_maps(void)
+{
+  int count = 0;
+  int i;
+
+  for (i = 0; i < block_map_count; i++) {
+    count += block_maps[i] != NULL;
+  }
+  return count;
+}
+
+/* Block map cache: many small pwrites spread over a fragmented file walk
+ * its pointer blocks back and forth, and all of them read back before and
+ * after a remount. The block map stays in memory while the file is open,
+ * and goes away when it is closed.
+ */
+static int
+check_block_map_cache(void)
+{
+  int error_count = 0;
+  int length = 200000;
+  char *expected = malloc(length);
+  char *buffer = malloc(length);
+  int fd, other, i, offset;
+
+  mksfs_geometry(1, 512, 4096);
+  fd = sfs_fopen("blockmap.txt");
+  other = sfs_fopen("blockmap2.txt");
+  fill_pattern(expected, 0, length, 140);
+  for (i = 0; i < 20; i++) {
+    sfs_fwrite(fd, expected + i * 10000, 10000);
+    sfs_fsync(fd);
+    sfs_fwrite(other, expected, 500);
+    sfs_fsync(other);
+  }
+  for (i = 0; i < 500; i++) {
+    offset = (int)(((long)i * 7919) % (length - 100));
+    fill_pattern(expected + offset, offset, 100, 141 + i % 3);
+    if (sfs_pwrite(fd, expected + offset, 100, offset) != 100) {
+      fprintf(stderr, "ERROR: block map cache: short pwrite at %d\n", offset);
+      error_count++;
+    }
+  }
+  if (sfs_pread(fd, buffer, length, 0) != length || memcmp(buffer, expected, length) != 0) {
+    fprintf(stderr, "ERROR: block map cache: data mismatch before remount\n");
+    error_count++;
+  }
+  if (resident_block_maps() != 2) {
+    fprintf(stderr, "ERROR: block map cache: %d block maps for the 2 open files\n", resident_block_maps());
+    error_count++;
+  }
+  sfs_fclose(fd);
+  sfs_fclose(other);
+  if (resident_block_maps() != 0) {
+    fprintf(stderr, "ERROR: block map cache: %d block maps left once the files are closed\n", resident_block_maps());
+    error_count++;
+  }
+  mksfs(0);
+  fd = sfs_fopen("blockmap.txt");
+  if (sfs_pread(fd, buffer, length, 0) != length || memcmp(buffer, expected, length) != 0) {
+    fprintf(stderr, "ERROR: block map cache: data mismatch after remount\n");
+    error_count++;
+  }
+  if (resident_block_maps() != 1) {
+    fprintf(stderr, "ERROR: block map cache: %d block maps after reading one file\n", resident_block_maps());
+    error_count++;
+  }
+  sfs_fclose(fd);
+  free(expected);
+  free(buffer);
+  return error_count;
+}
+
+/* Read-ahead: sequential small reads, with a jump back in the middle, return
+ * the right data with read-ahead off, with a small window and the default
+ * one. Once a few sequential reads started the default window and the
+ * prefetch thread had time to run, the next blocks need no disk read.
+ */
+#define READAHEAD_BYTES 150000
+#define READAHEAD_CHUNK 300
+
+/* Reads [start, end) of `fd` in small chunks, returns the number of errors */
+static int
+read_sequentially(int fd, int start, int end, int window)
+{
+  char buffer[READAHEAD_CHUNK], expected[READAHEAD_CHUNK];
+  int offset;
+
+  sfs_fseek(fd, start);
+  for (offset = start; offset < end; offset += READAHEAD_CHUNK) {
+    fill_pattern(expected, offset, READAHEAD_CHUNK, 150);
+    if (sfs_fread(fd, buffer, READAHEAD_CHUNK) != READAHEAD_CHUNK ||
+        memcmp(buffer, expected, READAHEAD_CHUNK) != 0) {
+      fprintf(stderr, "ERROR: read-ahead %d: bad data at offset %d\n", window, offset);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int
+check_readahead(void)
+{
+  struct disk_counters before, after;
+  int error_count = 0;
+  int windows[3] = {0, 4, 32};
+  int fd, w;
+
+  mksfs(1);
+  error_count += write_pattern_file("readahead.txt", READAHEAD_BYTES, 150);
+  for (w = 0; w < 3; w++) {
+    sfs_configure_readahead(windows[w]);
+    mksfs(0);
+    fd = sfs_fopen("readahead.txt");
+    error_count += read_sequentially(fd, 0, 90000, windows[w]);
+    error_count += read_sequentially(fd, 30000, READAHEAD_BYTES - READAHEAD_CHUNK, windows[w]);
+    sfs_fclose(fd);
+
+    mksfs(0);
+    fd = sfs_fopen("readahead.txt");
+    error_count += read_sequentially(fd, 0, 6000, windows[w]);
+    usleep(200000);
+    get_disk_counters(&before);
+    error_count += read_sequentially(fd, 6000, 8100, windows[w]);
+    get_disk_counters(&after);
+    if ((windows[w] == 0 && after.reads == before.reads) || (windows[w] == 32 && after.reads != before.reads)) {
+      fprintf(stderr, "ERROR: read-ahead %d: the blocks after a sequential read took %ld disk reads\n",
+              windows[w], after.reads - before.reads);
+      error_count++;
+    }
+    sfs_fclose(fd);
+  }
+  sfs_configure_readahead(32);
+  return error_count;
+}
+
+/* Reads a whole file with one sfs_fread() and returns how many disk reads
+ * it took, or -1 if the data is wrong
+ */
+static long
+count_file_reads(char *name, int length, int seed)
+{
+  struct disk_counters before, after;
+  char *expected = malloc(length);
+  char *buffer = malloc(length);
+  int fd = sfs_fopen(name);
+  long reads = -1;
+
+  fill_pattern(expected, 0, length, seed);
+  get_disk_counters(&before);
+  sfs_fseek(fd, 0);
+  if (sfs_fread(fd, buffer, length) == length && memcmp(buffer, expected, length) == 0) {
+    get_disk_counters(&after);
+    reads = after.reads - before.reads;
+  }
+  sfs_fclose(fd);
+  free(expected);
+  free(buffer);
+  return reads;
+}
+
+/* Write buffers: many small fwrites are seen by reads and sfs_getfilesize()
+ * while they are still buffered, and reach the disk on close. Two files
+ * written 50 bytes at a time side by side still get long runs of blocks,
+ * and buffered bytes keep their blocks while another file fills the disk.
+ */
+#define SIDE_BYTES 40000
+
+static int
+check_write_buffer(void)
+{
+  int error_count = 0;
+  char buffer[SIDE_BYTES], expected[SIDE_BYTES];
+  long reads;
+  int fd, other, i;
+
+  mksfs(1);
+  fd = sfs_fopen("buffered.txt");
+  fill_pattern(expected, 0, 20000, 160);
+  for (i = 0; i < 20000; i += 50) {
+    if (sfs_fwrite(fd, expected + i, 50) != 50) {
+      fprintf(stderr, "ERROR: write buffer: short write at %d\n", i);
+      error_count++;
+    }
+  }
+  if (sfs_getfilesize("buffered.txt") != 20000) {
+    fprintf(stderr, "ERROR: write buffer: size is %d before close\n", sfs_getfilesize("buffered.txt"));
+    error_count++;
+  }
+  sfs_fseek(fd, 0);
+  if (sfs_fread(fd, buffer, 20000) != 20000 || memcmp(buffer, expected, 20000) != 0) {
+    fprintf(stderr, "ERROR: write buffer: buffered data not read back\n");
+    error_count++;
+  }
+  sfs_fclose(fd);
+  mksfs(0);
+  error_count += check_pattern_file("buffered.txt", 20000, 160, "write buffer after remount");
+
+  /* Each file is read with one disk read per run of blocks (the reads bypass
+   * the cache), a block at a time would take 40
+   */
+  mksfs(1);
+  fd = sfs_fopen("side1.txt");
+  other = sfs_fopen("side2.txt");
+  fill_pattern(expected, 0, SIDE_BYTES, 161);
+  fill_pattern(buffer, 0, SIDE_BYTES, 162);
+  for (i = 0; i < SIDE_BYTES; i += 50) {
+    sfs_fwrite(fd, expected + i, 50);
+    sfs_fwrite(other, buffer + i, 50);
+  }
+  sfs_fclose(fd);
+  sfs_fclose(other);
+  sfs_sync();
+  for (i = 0; i < 2; i++) {
+    reads = count_file_reads(i == 0 ? "side1.txt" : "side2.txt", SIDE_BYTES, 161 + i);
+    if (reads < 0 || reads > 8) {
+      fprintf(stderr, "ERROR: write buffer: reading side%d.txt took %ld disk reads\n", i + 1, reads);
+      error_count++;
+    }
+  }
+
+  mksfs(1);
+  fd = sfs_fopen("reserved.txt");
+  fill_pattern(expected, 0, 5000, 163);
+  sfs_fwrite(fd, expected, 5000);
+  fill_disk("full");
+  sfs_fclose(fd);
+  error_count += check_pattern_file("reserved.txt", 5000, 163, "write buffer with a full disk");
+  mksfs(0);
+  error_count += check_pattern_file("reserved.txt", 5000, 163, "write buffer with a full disk after remount");
+  return error_count;
+}
+
+/* Runs `check` in a child process that ends with _exit(), so nothing it
+ * mounted is synced or unmounted. Returns the errors `check` found.
+ */
+static int
+run_in_child(int (*check)(void), const char *what)
+{
+  pid_t pid;
+  int status;
+
+  fflush(stdout);
+  fflush(stderr);
+  pid = fork();
+  if (pid == 0) {
+    int errors = check();
+    fflush(stderr);
+    _exit(errors > 255 ? 255 : errors);
+  }
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status)) {
+    fprintf(stderr, "ERROR: %s: child did not finish\n", what);
+    return 1;
+  }
+  return WEXITSTATUS(status);
+}
+
+/* Runs `crash` in a child (whatever it wrote but did not sync is lost with
+ * it), then `check` in another child that mounts the disk again.
+ */
+static int
+crash_and_remount(int (*crash)(void), int (*check)(void), const char *what)
+{
+  int error_count = run_in_child(crash, what);
+  return error_count + run_in_child(check, what);
+}
+
+/* Journal: blocks freed by a remove that is not committed yet must not be
+ * reused, or the replayed file would point at another file's data.
+ */
+#define CRASH_FILE_BLOCKS 240
+
+static int
+free_blocks_crash(void)
+{
+  char block[1024];
+  int fd, pad, i;
+
+  mksfs(1);
+
+  /* Writing F and a padding file one block at a time, so F is fragmented
+   * enough to need pointer blocks
+   */
+  fd = sfs_fopen("crash_f.txt");
+  pad = sfs_fopen("crash_pad.txt");
+  for (i = 0; i < CRASH_FILE_BLOCKS; i++) {
+    fill_pattern(block, i * 1024, 1024, 1);
+    sfs_fwrite(fd, block, 1024);
+    sfs_fwrite(pad, block, 512);
+    sfs_fsync(fd);
+  }
+  sfs_fclose(fd);
+  sfs_fclose(pad);
+  sfs_sync();
+
+  /* Removing F without a sync, then filling the disk with G */
+  sfs_remove("crash_f.txt");
+  fd = sfs_fopen("crash_g.txt");
+  memset(block, 'G', sizeof(block));
+  for (i = 0; i < 700; i++) {
+    if (sfs_fwrite(fd, block, 1024) != 1024) {
+      break;
+    }
+  }
+  return 0;
+}
+
+static int
+free_blocks_check(void)
+{
+  int error_count = 0;
+  int size, fd;
+
+  mksfs(0);
+
+  /* The remove may or may not have been committed, F is either gone or whole */
+  size = sfs_getfilesize("crash_f.txt");
+  if (size >= 0) {
+    if (size != CRASH_FILE_BLOCKS * 1024) {
+      fprintf(stderr, "ERROR: journal: crash_f.txt has size %d after the crash\n", size);
+      return 1;
+    }
+    fd = sfs_fopen("crash_f.txt");
+    error_count += compare_pattern(fd, 0, size, 1, "journal: crash_f.txt after the crash");
+    sfs_fclose(fd);
+  }
+  if (sfs_getfilesize("crash_pad.txt") != CRASH_FILE_BLOCKS * 512) {
+    fprintf(stderr, "ERROR: journal: crash_pad.txt lost after the crash\n");
+    error_count++;
+  }
+  return error_count;
+}
+
+/* Journal crashes: the last sfs_sync() of a crash child stops writing to the
+ * disk after `crash_limit` blocks, as if the power went off (-1 == never).
+ * The child without a limit stores how many blocks its sync wrote in
+ * CRASH_WRITES, so the caller knows where the crash points end.
+ */
+#define CRASH_WRITES "sfs_crash_writes"
+
+static long crash_limit = -1;
+
+static int
+sync_and_crash(void)
+{
+  struct disk_counters before, after;
+  FILE *file;
+  int result;
+
+  get_disk_counters(&before);
+  set_disk_write_limit(crash_limit);
+  result = sfs_sync();
+  get_disk_counters(&after);
+  if (crash_limit != -1) {
+    return 0;
+  }
+  file = fopen(CRASH_WRITES, "w");
+  fprintf(file, "%ld\n", after.blocks_written - before.blocks_written);
+  fclose(file);
+  if (result < 0) {
+    fprintf(stderr, "ERROR: journal: the transaction could not be committed\n");
+    return 1;
+  }
+  return 0;
+}
+
+/* Runs `crash` and `check` once without a crash, then with a crash after
+ * every `step` blocks the sync of `crash` writes
+ */
+static int
+crash_at_every_write(int (*crash)(void), int (*check)(void), int step, const char *what)
+{
+  FILE *file;
+  long writes = 0;
+  int error_count;
+
+  crash_limit = -1;
+  error_count = crash_and_remount(crash, check, what);
+  file = fopen(CRASH_WRITES, "r");
+  if (file == NULL || fscanf(file, "%ld", &writes) != 1) {
+    fprintf(stderr, "ERROR: %s: the sync did not report its writes\n", what);
+    error_count++;
+  }
+  if (file != NULL) {
+    fclose(file);
+  }
+  remove(CRASH_WRITES);
+
+  for (crash_limit = 0; crash_limit < writes && error_count == 0; crash_limit += step) {
+    error_count += crash_and_remount(crash, check, what);
+  }
+  crash_limit = -1;
+  return error_count;
+}
+
+/* Journal: one transaction of a few hundred images (with 512 B blocks the
+ * journal has 512 blocks, and its header takes two of them) is replayed
+ * whole or not at all, wherever the crash stops its commit.
+ */
+#define BIG_FILES 600
+
+static int
+big_transaction_crash(void)
+{
+  char data[100];
+  char name[16];
+  int i, fd;
+
+  mksfs_geometry(1, 512, 16384);
+  sfs_sync();
+  for (i = 0; i < BIG_FILES; i++) {
+    sprintf(name, "big%03d", i);
+    fill_pattern(data, 0, sizeof(data), i);
+    fd = sfs_fopen(name);
+    sfs_fwrite(fd, data, sizeof(data));
+    sfs_fclose(fd);
+  }
+  return sync_and_crash();
+}
+
+static int
+big_transaction_check(void)
+{
+  char name[16];
+  int present = 0;
+  int error_count = 0;
+  int i, fd;
+
+  mksfs_geometry(0, 512, 16384);
+  for (i = 0; i < BIG_FILES; i++) {
+    sprintf(name, "big%03d", i);
+    if (sfs_getfilesize(name) == -1) {
+      continue;
+    }
+    present++;
+    fd = sfs_fopen(name);
+    error_count += compare_pattern(fd, 0, 100, i, "journal: file of the large transaction");
+    sfs_fclose(fd);
+  }
+  if (present != 0 && (present != BIG_FILES || error_count != 0)) {
+    fprintf(stderr, "ERROR: journal: %d of the %d files after a crash at block %ld of the commit\n", present, BIG_FILES, crash_limit);
+    error_count++;
+  }
+  if (crash_limit == -1 && present != BIG_FILES) {
+    fprintf(stderr, "ERROR: journal: %d of the %d files after the commit\n", present, BIG_FILES);
+    error_count++;
+  }
+  return error_count;
+}
+
+/* Journal: creates, writes and removes with no close or sync in between
+ * change more metadata blocks than the journal holds (over 70 i-node and
+ * directory blocks, in a journal of 64). They are committed at the end of the calls that bring
+ * the transaction to half the journal, so a crash keeps the files as some
+ * call left them: a prefix of the creates, then of the removes. The written
+ * bytes only get their blocks when the sync writes the buffers back.
+ */
+#define MANY_FILES 250
+#define MANY_BYTES 700
+
+static void
+many_name(char *name, int i)
+{
+  sprintf(name, "many%03d", i);
+}
+
+static int
+many_changes_crash(void)
+{
+  char data[MANY_BYTES];
+  char name[16];
+  int i, fd;
+
+  mksfs_geometry(1, 512, 2048);
+  for (i = 0; i < MANY_FILES; i++) {
+    many_name(name, i);
+    fill_pattern(data, 0, MANY_BYTES, i);
+    fd = sfs_fopen(name);
+    sfs_fwrite(fd, data, MANY_BYTES);
+  }
+  for (i = 0; i < MANY_FILES; i += 3) {
+    many_name(name, i);
+    sfs_remove(name);
+  }
+  return sync_and_crash();
+}
+
+static int
+many_changes_check(void)
+{
+  char name[16];
+  int present[MANY_FILES];
+  int created = 0;
+  int removed = 0;
+  int error_count = 0;
+  int i, fd, size;
+
+  mksfs_geometry(0, 512, 2048);
+  for (i = 0; i < MANY_FILES; i++) {
+    many_name(name, i);
+    size = sfs_getfilesize(name);
+    present[i] = size != -1;
+    if (size > 0) {
+      fd = sfs_fopen(name);
+      error_count += size != MANY_BYTES;
+      error_count += compare_pattern(fd, 0, MANY_BYTES, i, "journal: file written before the crash");
+      sfs_fclose(fd);
+    }
+  }
+
+  /* Files created, then files among the first ones created that are removed */
+  while (created < MANY_FILES && present[created]) {
+    created++;
+  }
+  if (created == MANY_FILES || created == 0) {
+    while (removed * 3 < MANY_FILES && !present[removed * 3]) {
+      removed++;
+    }
+    created = removed > 0 ? MANY_FILES : created;
+  }
+  for (i = 0; i < MANY_FILES; i++) {
+    int expected = i < created && (i % 3 != 0 || i / 3 >= removed);
+    if (present[i] != expected) {
+      error_count++;
+    }
+  }
+  if (crash_limit == 0 && created == 0) {
+    fprintf(stderr, "ERROR: journal: nothing was committed before the sync\n");
+    error_count++;
+  }
+  if (crash_limit == -1 && (created != MANY_FILES || removed * 3 < MANY_FILES)) {
+    error_count++;
+  }
+  if (error_count != 0) {
+    fprintf(stderr, "ERROR: journal: %d files created and %d removed after a crash at block %ld of the sync\n",
+            created, removed, crash_limit);
+  }
+  return error_count;
+}
+
+/* Lazy mount: mounting a disk with a large i-node table reads little more
+ * than the super block, sfs_time_to_first_open() is -1 until the first
+ * open after a mount, and files opened before the background load ends
+ * read back right.
+ */
+static int
+check_lazy_mount(void)
+{
+  struct disk_counters counters;
+  int error_count = 0;
+  char name[32];
+  int i;
+
+  mksfs_geometry(1, 1024, 65536);
+  for (i = 0; i < 20; i++) {
+    sprintf(name, "lazy%02d.txt", i);
+    error_count += write_pattern_file(name, 1000 * i + 1, 170 + i);
+  }
+  mksfs(0);
+
+  /* The counters start over when the disk is opened */
+  get_disk_counters(&counters);
+  if (counters.blocks_read > 100) {
+    fprintf(stderr, "ERROR: lazy mount: the mount read %ld blocks\n", counters.blocks_read);
+    error_count++;
+  }
+  if (sfs_time_to_first_open() != -1) {
+    fprintf(stderr, "ERROR: lazy mount: time to first open set before any open\n");
+    error_count++;
+  }
+  error_count += check_pattern_file("lazy19.txt", 19001, 189, "lazy mount");
+  if (sfs_time_to_first_open() < 0) {
+    fprintf(stderr, "ERROR: lazy mount: time to first open not set after an open\n");
+    error_count++;
+  }
+  for (i = 0; i < 19; i++) {
+    sprintf(name, "lazy%02d.txt", i);
+    error_count += check_pattern_file(name, 1000 * i + 1, 170 + i, "lazy mount");
+  }
+  return error_count;
+}
+
+/* Snapshot cost: taking a snapshot copies no data, and a write after it
+ * only copies the block it changes.
+ */
+#define COST_BYTES (300 * 1024)
+
+static int
+check_snapshot_cost(void)
+{
+  struct disk_counters before, after;
+  int error_count = 0;
+  char buffer[1024];
+  int fd;
+
+  mksfs(1);
+  error_count += write_pattern_file("cost.txt", COST_BYTES, 215);
+  sfs_sync();
+  get_disk_counters(&before);
+  if (sfs_snapshot() != 0) {
+    fprintf(stderr, "ERROR: snapshot: sfs_snapshot() failed\n");
+    error_count++;
+  }
+  get_disk_counters(&after);
+  if (after.blocks_written - before.blocks_written > 30) {
+    fprintf(stderr, "ERROR: snapshot: taking it wrote %ld blocks\n", after.blocks_written - before.blocks_written);
+    error_count++;
+  }
+  fd = sfs_fopen("cost.txt");
+  fill_pattern(buffer, 100 * 1024, 1024, 216);
+  sfs_fseek(fd, 100 * 1024);
+  sfs_fwrite(fd, buffer, 1024);
+  sfs_fclose(fd);
+  get_disk_counters(&before);
+  sfs_sync();
+  get_disk_counters(&after);
+  if (after.blocks_written - before.blocks_written > 30) {
+    fprintf(stderr, "ERROR: snapshot: a one-block write then wrote %ld blocks\n", after.blocks_written - before.blocks_written);
+    error_count++;
+  }
+  fd = sfs_fopen("cost.txt");
+  error_count += compare_pattern(fd, 0, 100 * 1024, 215, "snapshot cost");
+  error_count += compare_pattern(fd, 100 * 1024, 1024, 216, "snapshot cost");
+  error_count += compare_pattern(fd, 101 * 1024, COST_BYTES - 101 * 1024, 215, "snapshot cost");
+  sfs_fclose(fd);
+  if (sfs_snapshot_delete() != 0) {
+    fprintf(stderr, "ERROR: snapshot: sfs_snapshot_delete() failed\n");
+    error_count++;
+  }
+  return error_count;
+}
+
+/* Snapshot: it is kept on the disk, so it is still there after a crash at
+ * any point of the sync that follows it, and a write it leaves no room for
+ * fails. The exported image is a disk of its own, with the snapshot's files,
+ * free bitmap and reference counts.
+ */
+#define SNAP_A_BYTES (20 * 1024)
+#define SNAP_B_BYTES (30 * 1024 + 100)
+#define SNAP_E_BYTES (8 * 1024)
+#define SNAP_IMAGE "sfs_snapshot_image"
+
+/* Each block of `fd` must hold the pattern of one of the two seeds */
+static int
+compare_either(int fd, int length, int seed1, int seed2, const char *what)
+{
+  char expected1[1024], expected2[1024], buffer[1024];
+  int error_count = 0;
+  int offset, chunk;
+
+  for (offset = 0; offset < length && error_count == 0; offset += chunk) {
+    chunk = length - offset < 1024 ? length - offset : 1024;
+    fill_pattern(expected1, offset, chunk, seed1);
+    fill_pattern(expected2, offset, chunk, seed2);
+    if (sfs_pread(fd, buffer, chunk, offset) != chunk ||
+        (memcmp(buffer, expected1, chunk) != 0 && memcmp(buffer, expected2, chunk) != 0)) {
+      fprintf(stderr, "ERROR: %s: bad data at offset %d\n", what, offset);
+      error_count++;
+    }
+  }
+  return error_count;
+}
+
+static int
+snapshot_crash(void)
+{
+  int error_count = 0;
+
+  mksfs(1);
+  error_count += write_pattern_file("snap_a.txt", SNAP_A_BYTES, 2);
+  error_count += write_pattern_file("snap_b.txt", SNAP_B_BYTES, 3);
+  error_count += write_pattern_file("snap_e.txt", SNAP_E_BYTES, 7);
+  if (sfs_snapshot() != 0) {
+    fprintf(stderr, "ERROR: snapshot: sfs_snapshot() failed\n");
+    error_count++;
+  }
+
+  /* Changing the files the snapshot shares, the sync may be cut short */
+  error_count += write_pattern_file("snap_a.txt", SNAP_A_BYTES, 4);
+  sfs_remove("snap_b.txt");
+  error_count += write_pattern_file("snap_c.txt", 40 * 1024, 5);
+  return error_count + sync_and_crash();
+}
+
+static int
+snapshot_check(void)
+{
+  int error_count = 0;
+  char block[1024];
+  char *buffer;
+  int fd, i, written;
+
+  /* The crash may have cut the changes short, never the snapshot, and it is
+   * still there once the disk is mounted again
+   */
+  mksfs(0);
+  mksfs(0);
+  fd = sfs_fopen("snap_a.txt");
+  error_count += compare_either(fd, SNAP_A_BYTES, 2, 4, "snapshot: snap_a.txt after the crash");
+  sfs_fclose(fd);
+  if (sfs_getfilesize("snap_b.txt") >= 0) {
+    fd = sfs_fopen("snap_b.txt");
+    error_count += compare_pattern(fd, 0, SNAP_B_BYTES, 3, "snapshot: snap_b.txt after the crash");
+    sfs_fclose(fd);
+  }
+
+  /* Filling the disk: the blocks the snapshot uses are not handed out */
+  fd = sfs_fopen("snap_fill.txt");
+  memset(block, 'F', sizeof(block));
+  for (i = 0; i < 2000; i++) {
+    if (sfs_fwrite(fd, block, sizeof(block)) != sizeof(block)) {
+      break;
+    }
+  }
+  sfs_fclose(fd);
+
+  /* Overwriting a file the snapshot shares needs new blocks, there are none */
+  buffer = malloc(SNAP_E_BYTES);
+  fill_pattern(buffer, 0, SNAP_E_BYTES, 8);
+  fd = sfs_fopen("snap_e.txt");
+  written = sfs_pwrite(fd, buffer, SNAP_E_BYTES, 0);
+  if (written < 0 || written == SNAP_E_BYTES) {
+    fprintf(stderr, "ERROR: snapshot: write with no room for the snapshot returned %d\n", written);
+    error_count++;
+  }
+  else {
+    error_count += compare_pattern(fd, 0, written, 8, "snapshot: snap_e.txt after the short write");
+    error_count += compare_pattern(fd, written, SNAP_E_BYTES - written, 7, "snapshot: snap_e.txt after the short write");
+  }
+  sfs_fclose(fd);
+  if (sfs_snapshot_export(SNAP_IMAGE) != 0) {
+    fprintf(stderr, "ERROR: snapshot: sfs_snapshot_export() failed after the crash\n");
+    error_count++;
+  }
+
+  /* Deleting the snapshot gives its blocks back */
+  if (sfs_snapshot_delete() != 0 || sfs_snapshot_delete() != -1) {
+    fprintf(stderr, "ERROR: snapshot: sfs_snapshot_delete() failed\n");
+    error_count++;
+  }
+  error_count += write_pattern_file("snap_e.txt", SNAP_E_BYTES, 8);
+  error_count += check_pattern_file("snap_e.txt", SNAP_E_BYTES, 8, "snapshot: snap_e.txt once deleted");
+  free(buffer);
+  return error_count;
+}
+
+/* Mounting the exported image in place of the disk */
+static int
+snapshot_image_check(void)
+{
+  int error_count = 0;
+  int fd;
+
+  if (rename(SNAP_IMAGE, "current_disk") != 0) {
+    fprintf(stderr, "ERROR: snapshot: no exported image\n");
+    return 1;
+  }
+  mksfs(0);
+  if (sfs_getfilesize("snap_c.txt") != -1) {
+    fprintf(stderr, "ERROR: snapshot: image has a file created after the snapshot\n");
+    error_count++;
+  }
+
+  /* A new file takes blocks the image's bitmap has as free */
+  error_count += write_pattern_file("snap_d.txt", 100 * 1024, 6);
+  fd = sfs_fopen("snap_a.txt");
+  error_count += compare_pattern(fd, 0, SNAP_A_BYTES, 2, "snapshot: snap_a.txt in the image");
+  sfs_fclose(fd);
+  fd = sfs_fopen("snap_b.txt");
+  error_count += compare_pattern(fd, 0, SNAP_B_BYTES, 3, "snapshot: snap_b.txt in the image");
+  sfs_fclose(fd);
+  error_count += check_pattern_file("snap_e.txt", SNAP_E_BYTES, 7, "snapshot: snap_e.txt in the image");
+  fd = sfs_fopen("snap_d.txt");
+  error_count += compare_pattern(fd, 0, 100 * 1024, 6, "snapshot: new file in the image");
+  sfs_fclose(fd);
+  return error_count;
+}
+
+/* Clones: a clone shares the original's blocks, so making it writes little
+ * more than an i-node and a directory entry. A write to the clone leaves the
+ * original alone, removing the original leaves the clone whole, and both
+ * survive a remount.
+ */
+static int
+check_clone(void)
+{
+  struct disk_counters before, after;
+  int error_count = 0;
+  char buffer[2000];
+  int fd;
+
+  mksfs(1);
+  error_count += write_pattern_file("original.txt", 60000, 180);
+  sfs_sync();
+  get_disk_counters(&before);
+  if (sfs_clone("original.txt", "clone.txt") != 0 || sfs_clone("original.txt", "clone.txt") != -1) {
+    fprintf(stderr, "ERROR: clone: clone did not succeed once and fail on an existing name\n");
+    error_count++;
+  }
+  sfs_sync();
+  get_disk_counters(&after);
+  if (after.blocks_written - before.blocks_written > 20) {
+    fprintf(stderr, "ERROR: clone: cloning a file of 59 blocks wrote %ld blocks\n", after.blocks_written - before.blocks_written);
+    error_count++;
+  }
+  error_count += check_pattern_file("clone.txt", 60000, 180, "clone");
+  fd = sfs_fopen("clone.txt");
+  fill_pattern(buffer, 30000, 2000, 181);
+  sfs_pwrite(fd, buffer, 2000, 30000);
+  sfs_fclose(fd);
+  error_count += check_pattern_file("original.txt", 60000, 180, "clone original");
+  sfs_remove("original.txt");
+  mksfs(0);
+  fd = sfs_fopen("clone.txt");
+  error_count += compare_pattern(fd, 0, 30000, 180, "clone after remount");
+  error_count += compare_pattern(fd, 30000, 2000, 181, "clone after remount");
+  error_count += compare_pattern(fd, 32000, 28000, 180, "clone after remount");
+  sfs_fclose(fd);
+  return error_count;
+}
+
+/* Inline data: a tiny file kept in its i-node survives a remount, then
+ * grows past the inline limit (120 bytes) into a block with its first bytes
+ * intact. A hundred tiny files take no data blocks from the disk.
+ */
+#define TINY_FILES 100
+
+static int
+check_inline_data(void)
+{
+  int error_count = 0;
+  char buffer[3000], name[32];
+  int fd, i, empty, full;
+
+  mksfs(1);
+  error_count += write_pattern_file("tiny.txt", 100, 190);
+  mksfs(0);
+  error_count += check_pattern_file("tiny.txt", 100, 190, "inline data after remount");
+  fd = sfs_fopen("tiny.txt");
+  fill_pattern(buffer, 100, 2900, 190);
+  if (sfs_fwrite(fd, buffer, 2900) != 2900) {
+    fprintf(stderr, "ERROR: inline data: could not grow the file\n");
+    error_count++;
+  }
+  sfs_fclose(fd);
+  error_count += check_pattern_file("tiny.txt", 3000, 190, "inline data grown");
+  mksfs(0);
+  error_count += check_pattern_file("tiny.txt", 3000, 190, "inline data grown after remount");
+
+  mksfs(1);
+  empty = fill_disk("space");
+  mksfs(1);
+  for (i = 0; i < TINY_FILES; i++) {
+    sprintf(name, "tiny%03d.txt", i);
+    error_count += write_pattern_file(name, 100, 191 + i);
+  }
+  full = fill_disk("space");
+  if (empty - full > 20 * 1024) {
+    fprintf(stderr, "ERROR: inline data: %d tiny files took %d bytes of the disk\n", TINY_FILES, empty - full);
+    error_count++;
+  }
+  for (i = 0; i < TINY_FILES; i += 9) {
+    sprintf(name, "tiny%03d.txt", i);
+    error_count += check_pattern_file(name, 100, 191 + i, "inline data with a full disk");
+  }
+  return error_count;
+}
+
+/* Sparse files: the gap left by a write past the end of the file reads as
+ * zeros without any disk read, and sfs_seek_data()/sfs_seek_hole() find
+ * where it starts and ends. A file of almost 5 MB with two written ranges
+ * fits on the 1 MiB disk.
+ */
+#define FAR_OFFSET 5000000
+
+static int
+check_sparse_file(void)
+{
+  struct disk_counters before, after;
+  int error_count = 0;
+  char buffer[20480], zeros[20480];
+  int fd, i, position;
+
+  mksfs(1);
+  memset(zeros, 0, sizeof(zeros));
+  fd = sfs_fopen("sparse.txt");
+  fill_pattern(buffer, 0, 1000, 200);
+  sfs_pwrite(fd, buffer, 1000, 0);
+  fill_pattern(buffer, 20480, 1000, 200);
+  sfs_pwrite(fd, buffer, 1000, 20480);
+  sfs_fclose(fd);
+  for (i = 0; i < 2; i++) {
+    fd = sfs_fopen("sparse.txt");
+    if (sfs_getfilesize("sparse.txt") != 21480) {
+      fprintf(stderr, "ERROR: sparse: size is %d, expected 21480\n", sfs_getfilesize("sparse.txt"));
+      error_count++;
+    }
+    error_count += compare_pattern(fd, 0, 1000, 200, "sparse");
+    error_count += compare_pattern(fd, 20480, 1000, 200, "sparse");
+    if (sfs_pread(fd, buffer, 19480, 1000) != 19480 || memcmp(buffer, zeros, 19480) != 0) {
+      fprintf(stderr, "ERROR: sparse: hole does not read as zeros\n");
+      error_count++;
+    }
+    if ((position = sfs_seek_hole(fd, 0)) != 1024) {
+      fprintf(stderr, "ERROR: sparse: hole found at %d, expected 1024\n", position);
+      error_count++;
+    }
+    if ((position = sfs_seek_data(fd, 1024)) != 20480) {
+      fprintf(stderr, "ERROR: sparse: data found at %d, expected 20480\n", position);
+      error_count++;
+    }
+    if ((position = sfs_seek_hole(fd, 20480)) != 21480 || sfs_seek_data(fd, 21480) != -1) {
+      fprintf(stderr, "ERROR: sparse: end of file seen as %d, expected 21480\n", position);
+      error_count++;
+    }
+    sfs_fclose(fd);
+    mksfs(0);
+  }
+
+  fd = sfs_fopen("sparse.txt");
+  fill_pattern(buffer, FAR_OFFSET, 1000, 201);
+  if (sfs_pwrite(fd, buffer, 1000, FAR_OFFSET) != 1000 || sfs_getfilesize("sparse.txt") != FAR_OFFSET + 1000) {
+    fprintf(stderr, "ERROR: sparse: a write at %d failed\n", FAR_OFFSET);
+    error_count++;
+  }
+  sfs_sync();
+  get_disk_counters(&before);
+  if (sfs_pread(fd, buffer, 20480, 1000000) != 20480 || memcmp(buffer, zeros, 20480) != 0) {
+    fprintf(stderr, "ERROR: sparse: far hole does not read as zeros\n");
+    error_count++;
+  }
+  get_disk_counters(&after);
+  if (after.reads != before.reads) {
+    fprintf(stderr, "ERROR: sparse: reading a hole took %ld disk reads\n", after.reads - before.reads);
+    error_count++;
+  }
+  error_count += compare_pattern(fd, FAR_OFFSET, 1000, 201, "sparse far write");
+  sfs_fclose(fd);
+  return error_count;
+}
+
+/* Preallocation: sfs_fallocate() leaves the file size alone, a write into
+ * the allocated range past the end of the file leaves zeros before it, and
+ * a range the disk cannot hold is refused. A preallocated file stays in one
+ * run of blocks while another file grows between its writes.
+ */
+#define PREALLOCATED_BYTES (200 * 1024)
+
+static int
+check_fallocate(void)
+{
+  int error_count = 0;
+  char buffer[49500], zeros[49500];
+  long reads;
+  int fd, other, i;
+
+  mksfs(1);
+  memset(zeros, 0, sizeof(zeros));
+  /* The allocated blocks held another file's data before */
+  error_count += write_pattern_file("garbage.txt", 300000, 212);
+  sfs_remove("garbage.txt");
+  sfs_sync();
+  error_count += write_pattern_file("prealloc.txt", 500, 210);
+  fd = sfs_fopen("prealloc.txt");
+  if (sfs_fallocate(fd, 0, 100000) != 0 || sfs_getfilesize("prealloc.txt") != 500) {
+    fprintf(stderr, "ERROR: fallocate: failed or changed the size to %d\n", sfs_getfilesize("prealloc.txt"));
+    error_count++;
+  }
+  if (sfs_fallocate(fd, 0, 4 * 1024 * 1024) != -1) {
+    fprintf(stderr, "ERROR: fallocate: a range larger than the disk was accepted\n");
+    error_count++;
+  }
+  fill_pattern(buffer, 50000, 1000, 211);
+  sfs_pwrite(fd, buffer, 1000, 50000);
+  sfs_fclose(fd);
+  mksfs(0);
+  fd = sfs_fopen("prealloc.txt");
+  error_count += compare_pattern(fd, 0, 500, 210, "fallocate");
+  error_count += compare_pattern(fd, 50000, 1000, 211, "fallocate");
+  if (sfs_pread(fd, buffer, 49500, 500) != 49500 || memcmp(buffer, zeros, 49500) != 0) {
+    fprintf(stderr, "ERROR: fallocate: bytes before the write are not zeros\n");
+    error_count++;
+  }
+  sfs_fclose(fd);
+
+  mksfs(1);
+  fd = sfs_fopen("grown.txt");
+  other = sfs_fopen("between.txt");
+  sfs_fallocate(fd, 0, PREALLOCATED_BYTES);
+  for (i = 0; i < 20; i++) {
+    fill_pattern(buffer, i * 10240, 10240, 213);
+    sfs_fwrite(fd, buffer, 10240);
+    sfs_fsync(fd);
+    fill_pattern(buffer, i * 3000, 3000, 214);
+    sfs_fwrite(other, buffer, 3000);
+    sfs_fsync(other);
+  }
+  sfs_fclose(fd);
+  sfs_fclose(other);
+  sfs_sync();
+  reads = count_file_reads("grown.txt", PREALLOCATED_BYTES, 213);
+  if (reads < 0 || reads > 2) {
+    fprintf(stderr, "ERROR: fallocate: reading the preallocated file took %ld disk reads\n", reads);
+    error_count++;
+  }
+  return error_count;
+}
+
+/* The main testing program
+ */
+int
+main(int argc, char **argv)
+{
+  int error_count = 0;
+
+  /* Crash checks, while this process has no disk mounted */
+  error_count += crash_and_remount(free_blocks_crash, free_blocks_check, "journal");
+  error_count += crash_at_every_write(big_transaction_crash, big_transaction_check, 9, "journal");
+  error_count += crash_at_every_write(many_changes_crash, many_changes_check, 5, "journal");
+  error_count += crash_at_every_write(snapshot_crash, snapshot_check, 5, "snapshot");
+  error_count += run_in_child(snapshot_image_check, "snapshot");
+
+  /* Checks that mount their own disk in this process */
+  error_count += check_block_cache();
+  error_count += check_metadata_flush();
+  error_count += check_free_bitmap();
+  error_count += check_extents();
+  error_count += check_multi_block_io();
+  error_count += check_directory_index();
+  error_count += check_large_directory();
+  error_count += check_geometry();
+  error_count += check_mmap_backend();
+  error_count += check_positional_backends();
+  error_count += check_async_io();
+  error_count += check_threads();
+  error_count += check_positional_io();
+  error_count += check_descriptor_table();
+  error_count += check_double_indirect();
+  error_count += check_block_map_cache();
+  error_count += check_readahead();
+  error_count += check_write_buffer();
+  error_count += check_lazy_mount();
+  error_count += check_snapshot_cost();
+  error_count += check_clone();
+  error_count += check_inline_data();
+  error_count += check_sparse_file();
+  error_count += check_fallocate();
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}